@@ -86,19 +86,99 @@ typedef struct {
 
 } frame_sequencer_t;
 
+// first order filter, see apply_output_filters
+typedef struct {
+    float prev_in;
+    float prev_out;
+} output_filter_t;
+
 
 typedef struct {
-    SDL_AudioSpec spec_desired, spec_obtained;
-    SDL_AudioDeviceID audio_device;
     pulse_channel_t pulse1, pulse2;
     tri_channel_t triangle;
     noise_channel_t noise;
     dmc_channel_t dmc;
     frame_sequencer_t frame_sequencer;
+
+    uint64_t cycle;              /* number of apu ticks so far */
+    uint32_t downsample_counter;
+    bool odd_cycle;
+
+    // the nes output stage, two high pass filters and a low pass filter
+    output_filter_t hp90, hp440, lp14k;
+
+    /* A shadow apu only models what the cpu can observe (length counters,
+     * frame irq and the dmc) and does not synthesize any sound. A synth apu
+     * does not touch the bus, dmc sample bytes are handed to it through
+     * dmc_fetched_byte instead. */
+    bool shadow;
+    bool synth;
+    bool dmc_fetch_ready;
+    uint8_t dmc_fetched_byte;
 } apu_t;
 
+// libnes defines NES_NO_AUDIO_DEVICE, it hands all sound to a sink and
+// builds without SDL
+#ifndef NES_NO_AUDIO_DEVICE
+typedef struct {
+    SDL_AudioSpec spec_desired, spec_obtained;
+    SDL_AudioDeviceID audio_device;
+} audio_device_t;
+#endif
+
+
+/*
+ * Threaded synthesis
+ *
+ * When the apu thread is running, the emulation thread only ticks a shadow
+ * apu and logs every register write, tagged with the apu cycle it happened
+ * on, into a single producer single consumer queue. The apu thread replays
+ * the log into its own copy of the apu, which synthesizes the samples. At the
+ * end of each frame a sync record tells the thread to catch up to that cycle
+ * and flush the samples. Loading a state logs a load record, which makes the
+ * thread's apu jump to the loaded state at that point of the log.
+ */
+typedef enum {
+    APU_LOG_WRITE,     /* register write */
+    APU_LOG_DMC_FETCH, /* byte read by the dmc through bus_read */
+    APU_LOG_SYNC,      /* run up to cycle and flush the sound buffer, or drop it if data is set */
+    APU_LOG_LOAD,      /* run up to cycle and replace the apu with loads[data] */
+    APU_LOG_QUIT,
+} apu_log_type_t;
+
+typedef struct {
+    uint64_t cycle;
+    uint64_t ticks; /* sync only, host time at which cycle was emulated */
+    uint16_t addr;
+    uint8_t data;
+    uint8_t type;
+} apu_log_record_t;
 
+#define APU_LOG_SIZE 16384 /* must be a power of 2 */
+#define APU_MAX_FRAMES_IN_FLIGHT 2
+#define APU_LOG_LOADS 4 /* loaded states not yet taken by the apu thread */
 
+typedef struct {
+    apu_log_record_t records[APU_LOG_SIZE];
+    atomic_int_t head; /* written by the emulation thread */
+    atomic_int_t tail; /* written by the apu thread */
+    atomic_int_t frames_in_flight;
+    apu_t loads[APU_LOG_LOADS];
+    atomic_int_t loads_pending;
+    int next_load;     /* written by the emulation thread */
+    semaphore_t *sync_sem; /* posted for every sync and load record */
+    thread_t *thread;
+    bool running;
+    /* output settings of the thread that started the apu thread, which the
+     * apu thread takes over since they are per thread */
+    int sample_rate;
+    apu_sound_sink_t sound_sink;
+    void *sound_sink_userdata;
+} apu_log_t;
+
+
+
+#ifndef NES_NO_AUDIO_DEVICE
 // audio device buffer
 // NOTE(shaw): this is a large circular buffer that the apu will write to and
 // the sound card will read from
@@ -108,30 +188,85 @@ static uint32_t ad_buffer_read;
 static uint32_t ad_buffer_write;
 static uint32_t ad_buffer_in;
 
-// apu sound buffer
-#define WAVE_BUFFER_SIZE 2048
-static float wave[WAVE_BUFFER_SIZE];
-static int wave_index = 0;
-
+// target number of samples queued in ad_buffer, a new frame is emulated when
+// the fill drops to this level. starts at base_fill, jumps up whenever the
+// sound card is starved and decays back down slowly while playback is clean,
+// so a jittery host settles at the lowest fill it can sustain
+static atomic_int_t ad_target_fill;
+static uint32_t ad_base_fill;
+static uint32_t ad_max_fill;
+static uint32_t ad_clean_callbacks;
+static uint32_t ad_underruns;
+
+static int device_samples = APU_DEFAULT_DEVICE_SAMPLES;
+static int latency_target_ms;
+
+// latency instrumentation, enabled with apu_enable_latency_stats
+// ad_stamp holds, for each queued sample, the host performance counter value
+// at which the cpu cycle that produced it was emulated
+#define LATENCY_HISTOGRAM_BUCKETS 256 // 1 ms each, the last one is overflow
+static bool latency_stats;
+static uint64_t *ad_stamp;
+static uint32_t latency_histogram[LATENCY_HISTOGRAM_BUCKETS];
+static uint64_t latency_min = UINT64_MAX, latency_max;
+#endif
 
-static bool should_tick_quarter_frame(void);
-static bool should_tick_half_frame(void);
-static void tick_quarter_frame(void);
-static void tick_half_frame(void);
+// apu sound buffer
+// NOTE(shaw): at each output sample tick_synth only records the level of every
+// channel, one buffer per channel. mix_wave turns a whole frame worth of
+// levels into samples in wave at flush time. each thread that synthesizes
+// sound has its own
+#define WAVE_BUFFER_SIZE 4096
+static THREAD_LOCAL float wave[WAVE_BUFFER_SIZE];
+static THREAD_LOCAL uint8_t wave_pulse1[WAVE_BUFFER_SIZE];
+static THREAD_LOCAL uint8_t wave_pulse2[WAVE_BUFFER_SIZE];
+static THREAD_LOCAL uint8_t wave_triangle[WAVE_BUFFER_SIZE]; // twice the level, so 7.5 fits
+static THREAD_LOCAL uint8_t wave_noise[WAVE_BUFFER_SIZE];
+static THREAD_LOCAL uint8_t wave_dmc[WAVE_BUFFER_SIZE];
+static THREAD_LOCAL uint64_t wave_cycle[WAVE_BUFFER_SIZE]; // apu cycle of each sample
+#ifndef NES_NO_AUDIO_DEVICE
+static THREAD_LOCAL uint64_t wave_stamp[WAVE_BUFFER_SIZE];
+#endif
+static THREAD_LOCAL int wave_index = 0;
+
+#define APU_CPU_FREQ 1789773 // NTSC cpu clock rate, the apu is ticked once per cpu cycle
+static THREAD_LOCAL int sample_rate = APU_DEFAULT_SAMPLE_RATE;
+
+// when a sink is set, flushed samples go to it instead of the audio device
+static THREAD_LOCAL apu_sound_sink_t sound_sink;
+static THREAD_LOCAL void *sound_sink_userdata;
+
+
+static bool should_tick_quarter_frame(apu_t *apu);
+static bool should_tick_half_frame(apu_t *apu);
+static void tick_quarter_frame(apu_t *apu);
+static void tick_half_frame(apu_t *apu);
 static void tick_pulse_channel(pulse_channel_t *pulse);
 static void tick_pulse_envelope(pulse_channel_t *pulse);
-static void tick_pulse_sweep(pulse_channel_t *pulse, bool is_pulse_2);
-static void tick_triangle_channel(void);
-static void tick_noise_channel(void);
+static void tick_pulse_sweep(apu_t *apu, pulse_channel_t *pulse, bool is_pulse_1);
+static void tick_triangle_channel(apu_t *apu);
+static void tick_noise_channel(apu_t *apu);
 static void tick_noise_envelope(noise_channel_t *noise);
-static void tick_dmc_channel(void);
-static void tick_frame_sequencer(void);
-static bool is_sweep_forcing_silence(pulse_channel_t *pulse);
-static uint8_t pulse_output(pulse_channel_t *pulse);
-static float triangle_output(void);
-static uint8_t noise_output(void);
-
-static apu_t apu;
+static void tick_dmc_channel(apu_t *apu);
+static void tick_frame_sequencer(apu_t *apu);
+static bool is_sweep_forcing_silence(apu_t *apu, pulse_channel_t *pulse);
+static uint8_t pulse_output(apu_t *apu, pulse_channel_t *pulse);
+static float triangle_output(apu_t *apu);
+static uint8_t noise_output(apu_t *apu);
+#ifndef NES_NO_AUDIO_DEVICE
+static void print_latency_stats(void);
+#endif
+
+// noise shift register must never be zero or the noise channel will never produce any output
+// apu_synth and apu_log belong to the apu thread, shared with the thread
+// that started it
+static THREAD_LOCAL apu_t apu_state = { .noise.shift_reg = 1 };
+static apu_t apu_synth;
+static apu_log_t apu_log;
+static THREAD_LOCAL bool apu_speculating; // see apu_begin_speculation
+#ifndef NES_NO_AUDIO_DEVICE
+static audio_device_t audio;
+#endif
 /*static uint64_t samples_played;*/
 
 
@@ -157,9 +292,20 @@ static apu_t apu;
 static const uint8_t duty_table[4] = { 0x02, 0x06, 0x1D, 0xF9 };
 
 
-/*double pulse_lookup_table[31] = { 0, 0.011609139523578026, 0.022939481268011527, 0.034000949216896059, 0.044803001876172609, 0.055354659248956883, 0.065664527956003665, 0.075740824648844587, 0.085591397849462361, 0.095223748338502431, 0.10464504820333041, 0.11386215864759427, 0.12288164665523155, 0.13170980059397538, 0.14035264483627205, 0.14881595346904861, 0.15710526315789472, 0.16522588522588522, 0.17318291700241739, 0.18098125249301955, 0.18862559241706162, 0.19612045365662886, 0.20347017815646784, 0.21067894131185272, 0.21775075987841944, 0.22468949943545349, 0.23149888143176731, 0.23818248984115256, 0.24474377745241579, 0.2511860718171926, 0.25751258087706685 };*/
-
-/*double tnd_lookup_table[203] = {0};*/
+/*
+ * Mixer lookup tables, from https://www.nesdev.org/wiki/APU_Mixer
+ *
+ * pulse_table[n] = 95.52 / (8128.0 / n + 100)          n = pulse1 + pulse2
+ * tnd_table[n]   = 163.67 / (24329.0 / (n/2) + 100)    n = 2 * (3*triangle + 2*noise + dmc)
+ *
+ * tnd_table is indexed at twice the resolution so the ultrasonic triangle
+ * level of 7.5 can be looked up exactly.
+ */
+#define TND_TABLE_SIZE (2*(3*15 + 2*15 + 127) + 1)
+static THREAD_LOCAL float pulse_table[31];
+static THREAD_LOCAL float tnd_table[TND_TABLE_SIZE];
+static THREAD_LOCAL bool mixer_initialized;
+static THREAD_LOCAL float hp90_coef, hp440_coef, lp14k_coef;
 
 static uint8_t length_table[32] = {10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14, 12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30 };
 
@@ -194,6 +340,14 @@ static uint16_t dmc_freq_table[16] = {428, 380, 340, 320, 286, 254, 226, 214, 19
     /*}*/
 /*}*/
 
+void apu_set_sample_rate(int rate) {
+    assert(rate >= APU_MIN_SAMPLE_RATE && rate <= APU_MAX_SAMPLE_RATE);
+    if (rate != sample_rate)
+        mixer_initialized = false; // the filters depend on it
+    sample_rate = rate;
+}
+
+#ifndef NES_NO_AUDIO_DEVICE
 /*
  * The callback must completely initialize the buffer; as of SDL 2.0, this
  * buffer is not initialized before the callback is called. If there is nothing
@@ -208,6 +362,20 @@ void apu_sound_output(void *userdata, uint8_t *byte_buffer, int buffer_size) {
 
     buffer_size >>= 2;
 
+    // the first sample of this buffer starts playing once the buffer already
+    // queued in the device has drained, so count one device buffer on top
+    if (latency_stats && ad_buffer_in) {
+        uint64_t now = time_ns();
+        uint64_t freq = 1000000000u;
+        uint64_t latency = now - ad_stamp[ad_buffer_read] + freq * buffer_size / audio.spec_obtained.freq;
+        uint64_t ms = latency * 1000 / freq;
+        ++latency_histogram[MIN(ms, LATENCY_HISTOGRAM_BUCKETS-1)];
+        latency_min = MIN(latency_min, latency);
+        latency_max = MAX(latency_max, latency);
+    }
+
+    bool starved = (uint32_t)buffer_size > ad_buffer_in;
+
     while (buffer_size) {
         if (ad_buffer_in) {
             sample = ad_buffer[ad_buffer_read];
@@ -225,53 +393,143 @@ void apu_sound_output(void *userdata, uint8_t *byte_buffer, int buffer_size) {
         sound_buf++;
         buffer_size--;
     }
+
+    int target = atomic_get(&ad_target_fill);
+    if (starved) {
+        ++ad_underruns;
+        ad_clean_callbacks = 0;
+        target = MIN(target + audio.spec_obtained.samples/2, (int)ad_max_fill);
+        atomic_set(&ad_target_fill, target);
+    } else if (++ad_clean_callbacks * audio.spec_obtained.samples >= (uint32_t)audio.spec_obtained.freq) {
+        // a second without starving, give back a little latency
+        ad_clean_callbacks = 0;
+        if ((uint32_t)target > ad_base_fill) {
+            target = MAX(target - MAX(audio.spec_obtained.samples/8, 1), (int)ad_base_fill);
+            atomic_set(&ad_target_fill, target);
+        }
+    }
 }
 
 void apu_init(void) {
-    apu.spec_desired.freq = 44100;
-    apu.spec_desired.format = AUDIO_F32;
-    apu.spec_desired.channels = 1;
-    apu.spec_desired.samples = 512;
-    apu.spec_desired.callback = apu_sound_output;
-    apu.spec_desired.userdata = &apu;
+    audio.spec_desired.freq = sample_rate;
+    audio.spec_desired.format = AUDIO_F32;
+    audio.spec_desired.channels = 1;
+    audio.spec_desired.samples = device_samples;
+    audio.spec_desired.callback = apu_sound_output;
+    audio.spec_desired.userdata = NULL;
 
     int bufsize_in_ms = 128; // I copied this default value from fceux
-    ad_buffer_size = apu.spec_desired.freq * bufsize_in_ms / 1000;
+    ad_buffer_size = audio.spec_desired.freq * bufsize_in_ms / 1000;
 
-    // enforce minimium size
-	uint32_t min_size = apu.spec_desired.samples * 2;
+    // enforce minimium size, the ring has to hold the target fill plus a
+    // whole frame of samples
+	uint32_t min_size = audio.spec_desired.samples * 2;
     if (ad_buffer_size < min_size) ad_buffer_size = min_size;
+    uint32_t target_samples = (uint32_t)(sample_rate * latency_target_ms / 1000);
+    if (ad_buffer_size < 2*target_samples) ad_buffer_size = 2*target_samples;
+    if (ad_buffer_size < 2*WAVE_BUFFER_SIZE) ad_buffer_size = 2*WAVE_BUFFER_SIZE;
 
     ad_buffer = malloc(ad_buffer_size * sizeof(float));
     if (!ad_buffer) {
         fprintf(stderr, "[AUDIO] Failed to allocate %zu bytes for the audio device buffer\n", 
                 ad_buffer_size * sizeof(float));
     }
+    if (latency_stats) {
+        ad_stamp = xcalloc(ad_buffer_size, sizeof(uint64_t));
+        atexit(print_latency_stats);
+    }
 
     ad_buffer_read = ad_buffer_write = ad_buffer_in = 0;
 
-    apu.audio_device = SDL_OpenAudioDevice(NULL, 0, 
-        &apu.spec_desired, &apu.spec_obtained, 
-        0);
+    // allow SDL to hand back a different buffer size, it may not support
+    // very small ones
+    audio.audio_device = SDL_OpenAudioDevice(NULL, 0, 
+        &audio.spec_desired, &audio.spec_obtained, 
+        SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
 
-    if (!apu.audio_device)
+    ad_base_fill = MAX((uint32_t)audio.spec_obtained.samples, target_samples);
+    ad_max_fill = ad_buffer_size - WAVE_BUFFER_SIZE;
+    if (ad_base_fill > ad_max_fill) ad_base_fill = ad_max_fill;
+    atomic_set(&ad_target_fill, ad_base_fill);
+    ad_clean_callbacks = ad_underruns = 0;
+
+    if (!audio.audio_device)
         fprintf(stderr, "[AUDIO] Failed to open audio device: %s\n", SDL_GetError());
-    else if(apu.spec_desired.format != apu.spec_obtained.format)
+    else if(audio.spec_desired.format != audio.spec_obtained.format)
         fprintf(stderr, "[AUDIO] Failed to obtain the desired AudioSpec data format\n");
     else {
         const char *driverName = SDL_GetCurrentAudioDriver();
         if (driverName) {
             fprintf(stderr, "Loading SDL sound with %s driver...\n", driverName);
         }
-        SDL_PauseAudioDevice(apu.audio_device, 0);
+        SDL_PauseAudioDevice(audio.audio_device, 0);
+    }
+}
+/* Number of samples per audio callback. Smaller buffers lower the output
+ * latency at the cost of more frequent callbacks. */
+void apu_set_device_buffer(int samples) {
+    assert(samples >= APU_MIN_DEVICE_SAMPLES && samples <= APU_MAX_DEVICE_SAMPLES);
+    device_samples = samples;
+}
+
+/* Minimum amount of audio kept queued ahead of the sound card. 0 means one
+ * device buffer, which is the lowest latency that can be sustained. */
+void apu_set_latency_target(int ms) {
+    assert(ms >= 0);
+    latency_target_ms = ms;
+}
+
+/* Measures the output latency of every audio callback and prints a histogram
+ * at exit. Must be called before apu_init. */
+void apu_enable_latency_stats(void) {
+    latency_stats = true;
+}
+
+static void print_latency_stats(void) {
+    if (audio.audio_device) SDL_LockAudioDevice(audio.audio_device);
+
+    uint32_t total = 0, peak = 0;
+    for (int i=0; i<LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        total += latency_histogram[i];
+        peak = MAX(peak, latency_histogram[i]);
+    }
+
+    fprintf(stderr, "[AUDIO] output latency: %u callbacks, %d samples at %d Hz, target fill %d samples, %u underruns\n",
+        total, audio.spec_obtained.samples, audio.spec_obtained.freq,
+        atomic_get(&ad_target_fill), ad_underruns);
+
+    if (total) {
+        uint64_t freq = 1000000000u;
+        int p50 = -1, p99 = -1;
+        uint32_t sum = 0;
+        for (int i=0; i<LATENCY_HISTOGRAM_BUCKETS; ++i) {
+            sum += latency_histogram[i];
+            if (p50 < 0 && sum*2 >= total) p50 = i;
+            if (p99 < 0 && sum*100 >= total*99) p99 = i;
+        }
+        fprintf(stderr, "[AUDIO] min %.2f ms, p50 %d ms, p99 %d ms, max %.2f ms\n",
+            1000.0 * latency_min / freq, p50, p99, 1000.0 * latency_max / freq);
+
+        for (int i=0; i<LATENCY_HISTOGRAM_BUCKETS; ++i) {
+            if (!latency_histogram[i]) continue;
+            int bar = (int)((uint64_t)latency_histogram[i] * 50 / peak);
+            fprintf(stderr, "%s%3d ms | %-50.*s %u\n", 
+                i == LATENCY_HISTOGRAM_BUCKETS-1 ? ">=" : "  ", i, 
+                bar, "##################################################", latency_histogram[i]);
+        }
     }
 
-    // noise shift register must never be zero or the noise channel will never produce any output
-    apu.noise.shift_reg = 1;
+    if (audio.audio_device) SDL_UnlockAudioDevice(audio.audio_device);
+}
+#endif
 
+void apu_set_sound_sink(apu_sound_sink_t sink, void *userdata) {
+    sound_sink = sink;
+    sound_sink_userdata = userdata;
 }
 
 uint8_t apu_read(uint16_t addr) {
+	apu_t *apu = &apu_state;
 	uint8_t data = 0;
 
 	// NOTE(shaw): allowing reading addrs besides 0x4015 here for the memory viewer
@@ -279,30 +537,30 @@ uint8_t apu_read(uint16_t addr) {
 
 	// triangle $4008-$400B
 	case 0x4008:
-		data = (apu.triangle.linear_control << 7) | apu.triangle.linear_load;
+		data = (apu->triangle.linear_control << 7) | apu->triangle.linear_load;
 		break;
 	case 0x400A:
-		data = apu.triangle.freq_timer & 0xFF;
+		data = apu->triangle.freq_timer & 0xFF;
 		break;
 	case 0x400B:
-		data = (apu.triangle.length_counter << 3) | ((apu.triangle.freq_timer >> 8) & 0x7);
+		data = (apu->triangle.length_counter << 3) | ((apu->triangle.freq_timer >> 8) & 0x7);
 		break;
 
 	// status register
     case 0x4015: { 
-        frame_sequencer_t *seq = &apu.frame_sequencer;
+        frame_sequencer_t *seq = &apu->frame_sequencer;
 
-        if (apu.pulse1.length_counter > 0)
+        if (apu->pulse1.length_counter > 0)
             data |= 0x01;
-        if (apu.pulse2.length_counter > 0)
+        if (apu->pulse2.length_counter > 0)
             data |= 0x02;
-        if (apu.triangle.length_counter > 0)
+        if (apu->triangle.length_counter > 0)
             data |= 0x04;
-        if (apu.noise.length_counter > 0)
+        if (apu->noise.length_counter > 0)
             data |= 0x08;
-        if (apu.dmc.sample_length > 0)
+        if (apu->dmc.sample_length > 0)
             data |= 0x10;
-        if (apu.dmc.irq_pending > 0)
+        if (apu->dmc.irq_pending > 0)
             data |= 0x80;
 
 		// NOTE(shaw): If an interrupt flag was set at the same moment of the
@@ -325,13 +583,13 @@ uint8_t apu_read(uint16_t addr) {
 	return data;
 }
 
-void apu_write(uint16_t addr, uint8_t data) {
+static void apu_write_register(apu_t *apu, uint16_t addr, uint8_t data) {
     switch(addr) {
         /* PULSE 1 */
         case 0x4000:
         /* pulse1 volume */
         {
-            channel_register_t *reg = &apu.pulse1.reg;
+            channel_register_t *reg = &apu->pulse1.reg;
             reg->duty            = (data >> 6) & 0x3;
             reg->loop            = (data >> 5) & 0x1;
             reg->constant_volume = (data >> 4) & 0x1;
@@ -341,7 +599,7 @@ void apu_write(uint16_t addr, uint8_t data) {
         case 0x4001:
         /* pulse1 sweep */
         {
-            sweep_register_t *sweep = &apu.pulse1.sweep;
+            sweep_register_t *sweep = &apu->pulse1.sweep;
             sweep->enabled     = (data >> 7) & 0x1;
             sweep->divider     = (data >> 4) & 0x7;
             sweep->negate      = (data >> 3) & 0x1;
@@ -351,21 +609,21 @@ void apu_write(uint16_t addr, uint8_t data) {
         case 0x4002:
         /* pulse1 freq_timer low */
         {
-            apu.pulse1.freq_timer = (apu.pulse1.freq_timer & 0xFF00) | data;
+            apu->pulse1.freq_timer = (apu->pulse1.freq_timer & 0xFF00) | data;
             break;
         }
 
         case 0x4003:
         /* pulse1 freq_timer high and length counter load*/
         {
-            apu.pulse1.freq_timer = (apu.pulse1.freq_timer & 0x00FF) | ((data & 0x7) << 8);
-            if (apu.pulse1.enabled)
-                apu.pulse1.length_counter = length_table[(data >> 3) & 0x1F];
+            apu->pulse1.freq_timer = (apu->pulse1.freq_timer & 0x00FF) | ((data & 0x7) << 8);
+            if (apu->pulse1.enabled)
+                apu->pulse1.length_counter = length_table[(data >> 3) & 0x1F];
             /* reset phase */
-            apu.pulse1.freq_counter = apu.pulse1.freq_timer;
-            apu.pulse1.duty_counter = 0;
+            apu->pulse1.freq_counter = apu->pulse1.freq_timer;
+            apu->pulse1.duty_counter = 0;
 
-            apu.pulse1.envelope_start = true;
+            apu->pulse1.envelope_start = true;
             break;
         }
 
@@ -373,7 +631,7 @@ void apu_write(uint16_t addr, uint8_t data) {
         case 0x4004:
         /* pulse2 volume */
         {
-            channel_register_t *reg = &apu.pulse2.reg;
+            channel_register_t *reg = &apu->pulse2.reg;
             reg->duty            = (data >> 6) & 0x3;
             reg->loop            = (data >> 5) & 0x1;
             reg->constant_volume = (data >> 4) & 0x1;
@@ -383,7 +641,7 @@ void apu_write(uint16_t addr, uint8_t data) {
         case 0x4005:
         /* pulse2 sweep */
         {
-            sweep_register_t *sweep = &apu.pulse2.sweep;
+            sweep_register_t *sweep = &apu->pulse2.sweep;
             sweep->enabled     = (data >> 7) & 0x1;
             sweep->divider     = (data >> 4) & 0x7;
             sweep->negate      = (data >> 3) & 0x1;
@@ -393,28 +651,28 @@ void apu_write(uint16_t addr, uint8_t data) {
         case 0x4006:
         /* pulse2 freq_timer low */
         {
-            apu.pulse2.freq_timer = (apu.pulse2.freq_timer & 0xFF00) | data;
+            apu->pulse2.freq_timer = (apu->pulse2.freq_timer & 0xFF00) | data;
             break;
         }
         case 0x4007:
         /* pulse2 freq_timer high and length counter load*/
         {
-            apu.pulse2.freq_timer = (apu.pulse2.freq_timer & 0x00FF) | ((data & 0x7) << 8);
-            if (apu.pulse2.enabled)
-                apu.pulse2.length_counter = length_table[(data >> 3) & 0x1F];
+            apu->pulse2.freq_timer = (apu->pulse2.freq_timer & 0x00FF) | ((data & 0x7) << 8);
+            if (apu->pulse2.enabled)
+                apu->pulse2.length_counter = length_table[(data >> 3) & 0x1F];
             /* reset phase */
-            apu.pulse2.freq_counter = apu.pulse2.freq_timer;
-            apu.pulse2.duty_counter = 0;
+            apu->pulse2.freq_counter = apu->pulse2.freq_timer;
+            apu->pulse2.duty_counter = 0;
 
-            apu.pulse2.envelope_start = true;
+            apu->pulse2.envelope_start = true;
             break;
         }
 
         /* TRIANGLE */
         case 0x4008:
         {
-            apu.triangle.linear_control = (data >> 7) & 1;
-            apu.triangle.linear_load = data & 0x7F;
+            apu->triangle.linear_control = (data >> 7) & 1;
+            apu->triangle.linear_load = data & 0x7F;
             break;
         }
 
@@ -423,23 +681,23 @@ void apu_write(uint16_t addr, uint8_t data) {
         case 0x400A:
         /* triangle freq_timer low */
         {
-            apu.triangle.freq_timer = (apu.triangle.freq_timer & 0xFF00) | data;
+            apu->triangle.freq_timer = (apu->triangle.freq_timer & 0xFF00) | data;
             break;
         }
         case 0x400B:
         /* triangle freq_timer high and length counter load*/
         {
-            apu.triangle.freq_timer = (apu.triangle.freq_timer & 0x00FF) | (((uint16_t)data & 0x7) << 8);
-            if (apu.triangle.enabled)
-                apu.triangle.length_counter = length_table[(data >> 3) & 0x1F];
-            apu.triangle.linear_reload_flag = true;
+            apu->triangle.freq_timer = (apu->triangle.freq_timer & 0x00FF) | (((uint16_t)data & 0x7) << 8);
+            if (apu->triangle.enabled)
+                apu->triangle.length_counter = length_table[(data >> 3) & 0x1F];
+            apu->triangle.linear_reload_flag = true;
             break;
         }
  
         /* NOISE */
         case 0x400C:
         {
-            channel_register_t *reg = &apu.noise.reg;
+            channel_register_t *reg = &apu->noise.reg;
             reg->loop            = (data >> 5) & 0x1;
             reg->constant_volume = (data >> 4) & 0x1;
             reg->envelope        = (data >> 0) & 0xF;
@@ -449,41 +707,41 @@ void apu_write(uint16_t addr, uint8_t data) {
         case 0x400E:
         {
 
-            apu.noise.freq_timer = noise_freq_table[data & 0xF];
-            apu.noise.shift_mode = (data >> 7) & 1;
+            apu->noise.freq_timer = noise_freq_table[data & 0xF];
+            apu->noise.shift_mode = (data >> 7) & 1;
             break;
         }
         case 0x400F:
         {
-            if (apu.noise.enabled)
-                apu.noise.length_counter = length_table[(data >> 3) & 0x1F];
-            apu.noise.envelope_start = true;
+            if (apu->noise.enabled)
+                apu->noise.length_counter = length_table[(data >> 3) & 0x1F];
+            apu->noise.envelope_start = true;
             break;
         }
 
         /* DMC */
         case 0x4010:
         {
-            apu.dmc.irq_enabled = (data >> 7) & 1;
-            apu.dmc.loop = (data >> 6) & 1;
-            apu.dmc.freq_timer = dmc_freq_table[data & 0xF];
-            if (!apu.dmc.irq_enabled)
-                apu.dmc.irq_pending = false;
+            apu->dmc.irq_enabled = (data >> 7) & 1;
+            apu->dmc.loop = (data >> 6) & 1;
+            apu->dmc.freq_timer = dmc_freq_table[data & 0xF];
+            if (!apu->dmc.irq_enabled)
+                apu->dmc.irq_pending = false;
             break;
         }
         case 0x4011:
         {
-            apu.dmc.output = data & 0x7F;
+            apu->dmc.output = data & 0x7F;
             break;
         }
         case 0x4012:
         {
-            apu.dmc.sample_addr_load = 0xC000 + (data << 6);
+            apu->dmc.sample_addr_load = 0xC000 + (data << 6);
             break;
         }
         case 0x4013:
         {
-            apu.dmc.sample_length_load = (data << 4) + 1;
+            apu->dmc.sample_length_load = (data << 4) + 1;
             break;
         }
 
@@ -496,41 +754,41 @@ void apu_write(uint16_t addr, uint8_t data) {
             bool n   = (data >> 3) & 1;
             bool dmc = (data >> 4) & 1;
 
-            apu.pulse1.enabled   = p1;
-            apu.pulse2.enabled   = p2;
-            apu.triangle.enabled = t;
-            apu.noise.enabled = n;
+            apu->pulse1.enabled   = p1;
+            apu->pulse2.enabled   = p2;
+            apu->triangle.enabled = t;
+            apu->noise.enabled = n;
 
-            if (!p1) apu.pulse1.length_counter   = 0;
-            if (!p2) apu.pulse2.length_counter   = 0;
-            if (!t)  apu.triangle.length_counter = 0;
-            if (!n)  apu.noise.length_counter    = 0;
+            if (!p1) apu->pulse1.length_counter   = 0;
+            if (!p2) apu->pulse2.length_counter   = 0;
+            if (!t)  apu->triangle.length_counter = 0;
+            if (!n)  apu->noise.length_counter    = 0;
 
             if (dmc) {
-                if (apu.dmc.sample_length == 0) {
-                    apu.dmc.sample_length = apu.dmc.sample_length_load;
-                    apu.dmc.sample_addr = apu.dmc.sample_addr_load;
+                if (apu->dmc.sample_length == 0) {
+                    apu->dmc.sample_length = apu->dmc.sample_length_load;
+                    apu->dmc.sample_addr = apu->dmc.sample_addr_load;
                 }
             } 
             else
-                apu.dmc.sample_length = 0;
+                apu->dmc.sample_length = 0;
 
-            apu.dmc.irq_pending = false; // acknowledge DMC IRQ on write
+            apu->dmc.irq_pending = false; // acknowledge DMC IRQ on write
             break;
         }
 
         case 0x4017:
         /* frame sequencer */
         {
-            frame_sequencer_t *seq = &apu.frame_sequencer;
+            frame_sequencer_t *seq = &apu->frame_sequencer;
             seq->mode        = (data >> 7) & 1;
             seq->irq_inhibit = (data >> 6) & 1; 
 
             seq->counter = 7457; /* cpu cycles to next sequence step */
 
             if (seq->mode) {
-                tick_quarter_frame();
-                tick_half_frame();
+                tick_quarter_frame(apu);
+                tick_half_frame(apu);
             }
 
             if (seq->irq_inhibit)
@@ -541,32 +799,61 @@ void apu_write(uint16_t addr, uint8_t data) {
     }
 }
 
-static bool should_tick_quarter_frame(void) {
-    uint8_t step = apu.frame_sequencer.step;
-    uint8_t mode = apu.frame_sequencer.mode;
+// the apu thread only hears about what happens outside of speculation
+static bool apu_logging(void) {
+    return apu_log.running && !apu_speculating;
+}
+
+static void apu_log_push(apu_log_type_t type, uint64_t cycle, uint16_t addr, uint8_t data) {
+    int head = atomic_get(&apu_log.head);
+    int next = (head + 1) & (APU_LOG_SIZE - 1);
+
+    // the apu thread is behind by a whole log, wait for it to drain
+    while (next == atomic_get(&apu_log.tail))
+        sleep_ms(1);
+
+    apu_log.records[head] = (apu_log_record_t){ 
+        .cycle = cycle, .addr = addr, .data = data, .type = type };
+    if (type == APU_LOG_SYNC)
+        apu_log.records[head].ticks = time_ns();
+    atomic_set(&apu_log.head, next);
+}
+
+void apu_write(uint16_t addr, uint8_t data) {
+    apu_write_register(&apu_state, addr, data);
+    if (apu_logging())
+        apu_log_push(APU_LOG_WRITE, apu_state.cycle, addr, data);
+}
+
+static bool should_tick_quarter_frame(apu_t *apu) {
+    uint8_t step = apu->frame_sequencer.step;
+    uint8_t mode = apu->frame_sequencer.mode;
     if (step < 3) return true;
     if (!mode && step == 3) return true;
     if  (mode && step == 4) return true;
     return false;
 }
 
-static bool should_tick_half_frame(void) {
-    uint8_t step = apu.frame_sequencer.step;
-    uint8_t mode = apu.frame_sequencer.mode;
+static bool should_tick_half_frame(apu_t *apu) {
+    uint8_t step = apu->frame_sequencer.step;
+    uint8_t mode = apu->frame_sequencer.mode;
     if (step == 1) return true;
     if (!mode && step == 3) return true;
     if  (mode && step == 4) return true;
     return false;
 }
 
-static void tick_quarter_frame(void) {
-    tick_pulse_envelope(&apu.pulse1);
-    tick_pulse_envelope(&apu.pulse2);
+static void tick_quarter_frame(apu_t *apu) {
+    // envelopes and the linear counter are not visible to the cpu
+    if (apu->shadow) return;
 
-    tick_noise_envelope(&apu.noise);
+    tick_pulse_envelope(&apu->pulse1);
+    tick_pulse_envelope(&apu->pulse2);
+
+    tick_noise_envelope(&apu->noise);
 
     /* tick triangle linear counter */
-    tri_channel_t *tri = &apu.triangle;
+    tri_channel_t *tri = &apu->triangle;
     if (tri->linear_reload_flag)
         tri->linear_counter = tri->linear_load;
     else if (tri->linear_counter > 0)
@@ -576,29 +863,31 @@ static void tick_quarter_frame(void) {
         tri->linear_reload_flag = false;
 }
 
-static void tick_half_frame(void) {
-    tick_pulse_sweep(&apu.pulse1, true);
-    tick_pulse_sweep(&apu.pulse2, false);
+static void tick_half_frame(apu_t *apu) {
+    if (!apu->shadow) {
+        tick_pulse_sweep(apu, &apu->pulse1, true);
+        tick_pulse_sweep(apu, &apu->pulse2, false);
+    }
 
-    if (!apu.pulse1.reg.loop && apu.pulse1.length_counter > 0)
-        --apu.pulse1.length_counter;
-    if (!apu.pulse2.reg.loop && apu.pulse2.length_counter > 0)
-        --apu.pulse2.length_counter;
-    if (!apu.triangle.linear_control && apu.triangle.length_counter > 0)
-        --apu.triangle.length_counter;
-    if (!apu.noise.reg.loop && apu.noise.length_counter > 0)
-        --apu.noise.length_counter;
+    if (!apu->pulse1.reg.loop && apu->pulse1.length_counter > 0)
+        --apu->pulse1.length_counter;
+    if (!apu->pulse2.reg.loop && apu->pulse2.length_counter > 0)
+        --apu->pulse2.length_counter;
+    if (!apu->triangle.linear_control && apu->triangle.length_counter > 0)
+        --apu->triangle.length_counter;
+    if (!apu->noise.reg.loop && apu->noise.length_counter > 0)
+        --apu->noise.length_counter;
 }
 
-static void tick_frame_sequencer(void) {
-    frame_sequencer_t *seq = &apu.frame_sequencer;
+static void tick_frame_sequencer(apu_t *apu) {
+    frame_sequencer_t *seq = &apu->frame_sequencer;
     if (seq->counter > 0) {
         --seq->counter;
     } else {
-        if (should_tick_quarter_frame())
-            tick_quarter_frame();
-        if (should_tick_half_frame())
-            tick_half_frame();
+        if (should_tick_quarter_frame(apu))
+            tick_quarter_frame(apu);
+        if (should_tick_half_frame(apu))
+            tick_half_frame(apu);
         if (!seq->irq_inhibit && !seq->mode && seq->step == 3)
             seq->irq_pending = true;
 
@@ -655,7 +944,7 @@ static void tick_noise_envelope(noise_channel_t *noise) {
 }
 
 
-static void tick_pulse_sweep(pulse_channel_t *pulse, bool is_pulse_1) {
+static void tick_pulse_sweep(apu_t *apu, pulse_channel_t *pulse, bool is_pulse_1) {
     if (pulse->sweep_reload) {
         pulse->sweep_counter = pulse->sweep.divider;
         pulse->sweep_reload = false;
@@ -665,7 +954,7 @@ static void tick_pulse_sweep(pulse_channel_t *pulse, bool is_pulse_1) {
         --pulse->sweep_counter;
     } else {
         pulse->sweep_counter = pulse->sweep.divider;
-        if (pulse->sweep.enabled && !is_sweep_forcing_silence(pulse)) {
+        if (pulse->sweep.enabled && !is_sweep_forcing_silence(apu, pulse)) {
             if(pulse->sweep.negate) {
                 pulse->freq_timer -= pulse->freq_timer >> pulse->sweep.shift_count;
                 if (is_pulse_1)
@@ -679,8 +968,8 @@ static void tick_pulse_sweep(pulse_channel_t *pulse, bool is_pulse_1) {
 
 
 
-static bool is_sweep_forcing_silence(pulse_channel_t *pulse) {
-    sweep_register_t *sweep = &apu.pulse1.sweep;
+static bool is_sweep_forcing_silence(apu_t *apu, pulse_channel_t *pulse) {
+    sweep_register_t *sweep = &apu->pulse1.sweep;
     if (pulse->freq_timer < 8)
         return true;
     else if (!sweep->negate && (pulse->freq_timer + (pulse->freq_timer >> sweep->shift_count)) > 0x7FF)
@@ -689,13 +978,13 @@ static bool is_sweep_forcing_silence(pulse_channel_t *pulse) {
         return false;
 }
 
-static uint8_t pulse_output(pulse_channel_t *pulse) {
+static uint8_t pulse_output(apu_t *apu, pulse_channel_t *pulse) {
     uint8_t output = 0;
     bool duty_high = (duty_table[pulse->reg.duty] >> pulse->duty_counter) & 1;
 
     if (duty_high && 
         pulse->length_counter > 0 && 
-        !is_sweep_forcing_silence(pulse))
+        !is_sweep_forcing_silence(apu, pulse))
     {
         if(pulse->reg.constant_volume) 
             output = pulse->reg.envelope;
@@ -707,8 +996,8 @@ static uint8_t pulse_output(pulse_channel_t *pulse) {
 }
 
 
-static void tick_triangle_channel(void) {
-    tri_channel_t *tri = &apu.triangle;
+static void tick_triangle_channel(apu_t *apu) {
+    tri_channel_t *tri = &apu->triangle;
 
     tri->ultrasonic = false;
     if (tri->freq_timer < 2 && tri->freq_counter == 0)
@@ -727,8 +1016,8 @@ static void tick_triangle_channel(void) {
     }
 }
 
-static float triangle_output(void) {
-    tri_channel_t *tri = &apu.triangle;
+static float triangle_output(apu_t *apu) {
+    tri_channel_t *tri = &apu->triangle;
 
 	// Due to the averaging effect of the lowpass filter, the resulting value
 	// is halfway between 7 and 8
@@ -739,8 +1028,8 @@ static float triangle_output(void) {
     else                       return tri->step;
 }
 
-static void tick_noise_channel(void) {
-    noise_channel_t *n = &apu.noise;
+static void tick_noise_channel(apu_t *apu) {
+    noise_channel_t *n = &apu->noise;
     if (n->freq_counter > 0)
         --n->freq_counter;
     else {
@@ -755,9 +1044,9 @@ static void tick_noise_channel(void) {
     }
 }
 
-static uint8_t noise_output(void) {
+static uint8_t noise_output(apu_t *apu) {
     uint8_t output = 0;
-    noise_channel_t *noise = &apu.noise;
+    noise_channel_t *noise = &apu->noise;
     if ((noise->shift_reg & 1) == 0 && noise->length_counter != 0) {
         if(noise->reg.constant_volume) 
             output = noise->reg.envelope;
@@ -767,8 +1056,8 @@ static uint8_t noise_output(void) {
     return output;
 }
 
-static void tick_dmc_channel(void) {
-    dmc_channel_t *dmc = &apu.dmc;
+static void tick_dmc_channel(apu_t *apu) {
+    dmc_channel_t *dmc = &apu->dmc;
     if (dmc->freq_counter > 0)
         --dmc->freq_counter;
     else {
@@ -799,7 +1088,16 @@ static void tick_dmc_channel(void) {
 
         // NOTE(shaw): this causes some cpu cycle delays, but I am ignoring them here
         // see: https://www.nesdev.org/wiki/APU_DMC
-        dmc->sample_buffer = bus_read(dmc->sample_addr);
+        if (apu->synth) {
+            // the emulation thread did the actual read on this same cycle
+            assert(apu->dmc_fetch_ready);
+            dmc->sample_buffer = apu->dmc_fetched_byte;
+            apu->dmc_fetch_ready = false;
+        } else {
+            dmc->sample_buffer = bus_read(dmc->sample_addr);
+            if (apu_logging())
+                apu_log_push(APU_LOG_DMC_FETCH, apu->cycle, dmc->sample_addr, dmc->sample_buffer);
+        }
 
         dmc->sample_buffer_empty = false;
         dmc->sample_addr = (dmc->sample_addr + 1) | 0x8000;     // wrap $FFFF to $8000
@@ -817,11 +1115,12 @@ static void tick_dmc_channel(void) {
 
 }
 
-static void write_sound(float *buffer, int count) {
+#ifndef NES_NO_AUDIO_DEVICE
+static void write_sound(float *buffer, uint64_t *stamps, int count) {
     int wait_count = 0;
     while (count) {
         while (ad_buffer_in == ad_buffer_size) {
-            SDL_Delay(1); wait_count++;
+            sleep_ms(1); wait_count++;
 
             if ( wait_count > 1000 ) {
                 fprintf(stderr, "[AUDIO] Error: Sound sink is not draining... Breaking out of audio loop to prevent lockup.\n");
@@ -829,83 +1128,380 @@ static void write_sound(float *buffer, int count) {
             }
         }
 
-        ad_buffer[ad_buffer_write] = *buffer;
-        count--;
-        ad_buffer_write = (ad_buffer_write + 1) % ad_buffer_size;
+        // copy as much as fits, then publish it to the callback in one go
+        int n = MIN(count, (int)(ad_buffer_size - ad_buffer_in));
+        for (int i=0; i<n; ++i) {
+            ad_buffer[ad_buffer_write] = buffer[i];
+            if (ad_stamp) ad_stamp[ad_buffer_write] = stamps[i];
+            ad_buffer_write = (ad_buffer_write + 1) % ad_buffer_size;
+        }
 
-        SDL_LockAudio();
-        ad_buffer_in++;
-        SDL_UnlockAudio();
+        SDL_LockAudioDevice(audio.audio_device);
+        ad_buffer_in += n;
+        SDL_UnlockAudioDevice(audio.audio_device);
 
-        buffer++;
+        buffer += n;
+        stamps += n;
+        count -= n;
     }
 }
+#endif
 
 bool apu_request_frame(void) {
-    return ad_buffer_in <= apu.spec_obtained.samples;
+    if (apu_log.running && atomic_get(&apu_log.frames_in_flight) >= APU_MAX_FRAMES_IN_FLIGHT)
+        return false;
+#ifdef NES_NO_AUDIO_DEVICE
+    return true;
+#else
+    return ad_buffer_in <= (uint32_t)atomic_get(&ad_target_fill);
+#endif
+}
+
+static void init_mixer(void) {
+    pulse_table[0] = 0;
+    for (int n=1; n<31; ++n)
+        pulse_table[n] = 95.52f / (8128.0f / n + 100);
+
+    tnd_table[0] = 0;
+    for (int n=1; n<TND_TABLE_SIZE; ++n)
+        tnd_table[n] = 163.67f / (24329.0f / (0.5f * n) + 100);
+
+    // first order filter coefficients for the output sample rate
+    float dt = 1.0f / sample_rate;
+    float two_pi = 6.2831853f;
+    float rc90 = 1.0f / (two_pi * 90);
+    float rc440 = 1.0f / (two_pi * 440);
+    float rc14k = 1.0f / (two_pi * 14000);
+    hp90_coef = rc90 / (rc90 + dt);
+    hp440_coef = rc440 / (rc440 + dt);
+    lp14k_coef = dt / (rc14k + dt);
+
+    mixer_initialized = true;
 }
 
+static void high_pass(output_filter_t *f, float coef, float *samples, int count) {
+    float prev_in = f->prev_in, prev_out = f->prev_out;
+    for (int i=0; i<count; ++i) {
+        float in = samples[i];
+        prev_out = coef * (prev_out + in - prev_in);
+        prev_in = in;
+        samples[i] = prev_out;
+    }
+    f->prev_in = prev_in;
+    f->prev_out = prev_out;
+}
 
-void apu_flush_sound_buffer(void) {
-    write_sound(wave, wave_index);
+static void low_pass(output_filter_t *f, float coef, float *samples, int count) {
+    float prev_out = f->prev_out;
+    for (int i=0; i<count; ++i) {
+        prev_out += coef * (samples[i] - prev_out);
+        samples[i] = prev_out;
+    }
+    f->prev_out = prev_out;
+}
+
+/* Mixes the channel levels recorded since the last flush into wave and runs
+ * the result through the output filters. */
+static void mix_wave(apu_t *apu) {
+    if (!mixer_initialized) init_mixer();
+
+    // NOTE(shaw): keep this loop free of branches and loop carried
+    // dependencies so the compiler can vectorize it
+    for (int i=0; i<wave_index; ++i) {
+        int pulse = wave_pulse1[i] + wave_pulse2[i];
+        int tnd = 3*wave_triangle[i] + 4*wave_noise[i] + 2*wave_dmc[i];
+        wave[i] = pulse_table[pulse] + tnd_table[tnd];
+    }
+
+    // the filters are recursive, so they run as separate sequential passes
+    high_pass(&apu->hp90, hp90_coef, wave, wave_index);
+    high_pass(&apu->hp440, hp440_coef, wave, wave_index);
+    low_pass(&apu->lp14k, lp14k_coef, wave, wave_index);
+}
+
+/* ticks is the host performance counter value at which apu->cycle was
+ * reached on the emulation thread, used to timestamp the samples for the
+ * latency stats */
+static void flush_wave(apu_t *apu, uint64_t ticks) {
+    mix_wave(apu);
+    if (sound_sink) {
+        sound_sink(wave, wave_index, sound_sink_userdata);
+    } else {
+#ifdef NES_NO_AUDIO_DEVICE
+        (void)ticks; // no device to play it on
+#else
+        if (latency_stats) {
+            uint64_t freq = 1000000000u;
+            for (int i=0; i<wave_index; ++i)
+                wave_stamp[i] = ticks - (apu->cycle - wave_cycle[i]) * freq / APU_CPU_FREQ;
+        }
+        write_sound(wave, wave_stamp, wave_index);
+#endif
+    }
     wave_index = 0;
 }
 
+void apu_flush_sound_buffer(void) {
+    if (apu_speculating)
+        return; // the shadow apu generates no samples
+    if (apu_log.running) {
+        atomic_add(&apu_log.frames_in_flight, 1);
+        apu_log_push(APU_LOG_SYNC, apu_state.cycle, 0, 0);
+        semaphore_post(apu_log.sync_sem);
+    } else {
+        flush_wave(&apu_state, time_ns());
+    }
+}
+
+/* Throws away the samples generated since the last flush, used when running
+ * faster than real time. The apu state itself keeps running. */
+void apu_discard_sound_buffer(void) {
+    if (apu_speculating)
+        return; // the shadow apu generates no samples
+    if (apu_log.running) {
+        atomic_add(&apu_log.frames_in_flight, 1);
+        apu_log_push(APU_LOG_SYNC, apu_state.cycle, 0, 1);
+        semaphore_post(apu_log.sync_sem);
+    } else {
+        wave_index = 0;
+    }
+}
+
 bool apu_irq_pending(void) {
-	return apu.frame_sequencer.irq_pending;
+	return apu_state.frame_sequencer.irq_pending;
 }
 
 void apu_irq_clear(void) {
-	apu.frame_sequencer.irq_pending = false;
+	apu_state.frame_sequencer.irq_pending = false;
 }
 
-void apu_tick(void) {
-    static int downsample_counter = -1;
-    static bool downsample_even = 0;
-    static bool even_cycle = true;
+static void tick_shadow(apu_t *apu) {
+    if (!apu->odd_cycle)
+        tick_dmc_channel(apu);
+    tick_frame_sequencer(apu);
+    apu->odd_cycle = !apu->odd_cycle;
+    ++apu->cycle;
+}
+
+static void tick_synth(apu_t *apu) {
+    if (!apu->odd_cycle) {
+        tick_pulse_channel(&apu->pulse1);
+        tick_pulse_channel(&apu->pulse2);
 
-    uint8_t pulse1   = 0;
-    uint8_t pulse2   = 0;
-    float triangle   = 0;
-    uint8_t noise    = 0;
-    uint8_t dmc      = 0;
+        tick_noise_channel(apu);
 
-    if (even_cycle) {
-        tick_pulse_channel(&apu.pulse1);
-        tick_pulse_channel(&apu.pulse2);
+        tick_dmc_channel(apu);
+    }
 
-        tick_noise_channel();
+    tick_triangle_channel(apu);
 
-        tick_dmc_channel();
+    tick_frame_sequencer(apu);
+
+    // downsample from the cpu clock rate to the output sample rate by taking
+    // a sample every APU_CPU_FREQ/sample_rate ticks, carrying the remainder
+    // so the average rate is exact. only the channel levels are recorded
+    // here, mix_wave does the mixing for the whole frame at flush time
+    apu->downsample_counter += sample_rate;
+    if (apu->downsample_counter >= APU_CPU_FREQ) {
+        assert(wave_index < WAVE_BUFFER_SIZE);
+        wave_cycle[wave_index]    = apu->cycle;
+        wave_pulse1[wave_index]   = pulse_output(apu, &apu->pulse1);
+        wave_pulse2[wave_index]   = pulse_output(apu, &apu->pulse2);
+        wave_triangle[wave_index] = (uint8_t)(2 * triangle_output(apu));
+        wave_noise[wave_index]    = noise_output(apu);
+        wave_dmc[wave_index]      = apu->dmc.output;
+        ++wave_index;
+        apu->downsample_counter -= APU_CPU_FREQ;
+    }
+
+    apu->odd_cycle = !apu->odd_cycle;
+    ++apu->cycle;
+}
+
+void apu_tick(void) {
+    if (apu_log.running || apu_speculating)
+        tick_shadow(&apu_state);
+    else
+        tick_synth(&apu_state);
+}
+
+static int apu_thread_main(void *userdata) {
+    (void)userdata;
+    apu_t *apu = &apu_synth;
+    sample_rate = apu_log.sample_rate;
+    sound_sink = apu_log.sound_sink;
+    sound_sink_userdata = apu_log.sound_sink_userdata;
+
+    for (;;) {
+        semaphore_wait(apu_log.sync_sem);
+
+        // replay records until the sync or load record that woke us up
+        bool synced = false;
+        while (!synced) {
+            int tail = atomic_get(&apu_log.tail);
+            assert(tail != atomic_get(&apu_log.head));
+            apu_log_record_t rec = apu_log.records[tail];
+            atomic_set(&apu_log.tail, (tail + 1) & (APU_LOG_SIZE - 1));
+
+            // a record tagged with cycle c is applied right before tick c,
+            // which is the order things happen on the emulation thread
+            while (apu->cycle < rec.cycle)
+                tick_synth(apu);
+
+            switch (rec.type) {
+            case APU_LOG_WRITE:
+                apu_write_register(apu, rec.addr, rec.data);
+                break;
+            case APU_LOG_DMC_FETCH:
+                apu->dmc_fetched_byte = rec.data;
+                apu->dmc_fetch_ready = true;
+                break;
+            case APU_LOG_SYNC:
+                if (rec.data)
+                    wave_index = 0;
+                else
+                    flush_wave(apu, rec.ticks);
+                atomic_add(&apu_log.frames_in_flight, -1);
+                synced = true;
+                break;
+            case APU_LOG_LOAD: {
+                // samples not flushed yet keep their distance to the cycle
+                uint64_t cycle = apu->cycle;
+                *apu = apu_log.loads[rec.data];
+                apu->shadow = false;
+                apu->synth = true;
+                for (int i=0; i<wave_index; ++i)
+                    wave_cycle[i] += apu->cycle - cycle;
+                atomic_add(&apu_log.loads_pending, -1);
+                synced = true;
+                break;
+            }
+            case APU_LOG_QUIT:
+                // the samples since the last sync are in this thread's wave
+                flush_wave(apu, time_ns());
+                return 0;
+            default:
+                assert(0 && "unknown apu log record");
+                break;
+            }
+        }
+    }
+}
+
+/* Moves sample generation to a dedicated thread. Must be called before any
+ * emulation happens, or at a frame boundary after apu_flush_sound_buffer. */
+void apu_start_thread(void) {
+    if (apu_log.running) return;
+
+    // the synth starts as an exact copy of the current apu state
+    apu_synth = apu_state;
+    apu_synth.synth = true;
+    apu_state.shadow = true;
+
+    atomic_set(&apu_log.head, 0);
+    atomic_set(&apu_log.tail, 0);
+    atomic_set(&apu_log.frames_in_flight, 0);
+    atomic_set(&apu_log.loads_pending, 0);
+    apu_log.sync_sem = semaphore_create(0);
+    if (!apu_log.sync_sem) {
+        fprintf(stderr, "[AUDIO] Failed to create semaphore\n");
+        apu_state.shadow = false;
+        return;
     }
 
-    tick_triangle_channel();
+    apu_log.running = true;
+    apu_log.sample_rate = sample_rate;
+    apu_log.sound_sink = sound_sink;
+    apu_log.sound_sink_userdata = sound_sink_userdata;
+    apu_log.thread = thread_create(apu_thread_main, NULL);
+    if (!apu_log.thread) {
+        fprintf(stderr, "[AUDIO] Failed to create apu thread\n");
+        apu_log.running = false;
+        apu_state.shadow = false;
+        semaphore_destroy(apu_log.sync_sem);
+    }
+}
 
-    tick_frame_sequencer();
+/* Waits for the apu thread to synthesize everything that has been logged and
+ * then stops it. The emulation thread apu keeps only the shadow state, so the
+ * synthesized state is copied back. */
+void apu_stop_thread(void) {
+    if (!apu_log.running) return;
+
+    apu_log_push(APU_LOG_QUIT, apu_state.cycle, 0, 0);
+    semaphore_post(apu_log.sync_sem);
+    thread_join(apu_log.thread);
+    semaphore_destroy(apu_log.sync_sem);
+    apu_log.running = false;
+
+    // the thread ran the synth up to the quit record and flushed it
+    apu_state = apu_synth;
+    apu_state.synth = false;
+}
 
-    pulse1   = pulse_output(&apu.pulse1);
-    pulse2   = pulse_output(&apu.pulse2);
-    triangle = triangle_output();
-    noise    = noise_output();
-    dmc      = apu.dmc.output;
+/* Resets the apu to its power on state. Not for use while the apu thread
+ * runs. */
+void apu_power_on(void) {
+    assert(!apu_log.running);
+    apu_state = (apu_t){ .noise.shift_reg = 1 };
+    apu_speculating = false;
+    wave_index = 0;
+}
 
-    float pulse_out = 0.00752f * (pulse1 + pulse2);
-    float tnd_out = 0.00851f * triangle + 0.00494f * noise + 0.00335f * dmc;
-    float output = pulse_out + tnd_out;
+uint32_t apu_state_size(void) {
+    return sizeof(apu_t);
+}
 
-    /*float output = pulse_lookup_table[pulse1 + pulse2];*/
-    /*float output = pulse_lookup_table[pulse1 + pulse2] + tnd_lookup_table[3*triangle + 2*noise + dmc];*/
+/* NOTE(shaw): while the apu thread is running the emulation thread only has
+ * the shadow apu, so the saved channel state is only exact for what the cpu
+ * can observe. Emulation stays exact, but the sound can glitch for a moment
+ * after loading such a state. */
+void apu_save_state(uint8_t *out) {
+    memcpy(out, &apu_state, sizeof(apu_t));
+}
 
-    // HACK: this is simulating downsampling the tick rate of the apu to approximate a 44100Hz sample rate 
-    ++downsample_counter;
-    int s = downsample_even ? 39 : 40;
-    if (downsample_counter > s) {
-        assert(wave_index < WAVE_BUFFER_SIZE);
-        wave[wave_index++] = output;
-        downsample_counter = 0;
-        downsample_even = !downsample_even;
+void apu_load_state(uint8_t *in) {
+    if (apu_speculating) {
+        // the apu thread never saw the speculation, so it's still in step
+        memcpy(&apu_state, in, sizeof(apu_t));
+        apu_state.shadow = true;
+        apu_state.synth = false;
+        return;
+    }
+
+    if (apu_log.running) {
+        // the thread's synth apu jumps to the loaded state when it gets to
+        // this point of the log, the thread keeps running
+        while (atomic_get(&apu_log.loads_pending) == APU_LOG_LOADS)
+            sleep_ms(1);
+        int slot = apu_log.next_load;
+        apu_log.next_load = (slot + 1) % APU_LOG_LOADS;
+        memcpy(&apu_log.loads[slot], in, sizeof(apu_t));
+        atomic_add(&apu_log.loads_pending, 1);
+        apu_log_push(APU_LOG_LOAD, apu_state.cycle, 0, (uint8_t)slot);
+        semaphore_post(apu_log.sync_sem);
+
+        memcpy(&apu_state, in, sizeof(apu_t));
+        apu_state.shadow = true;
+        apu_state.synth = false;
+        return;
     }
 
-    even_cycle = !even_cycle;
+    memcpy(&apu_state, in, sizeof(apu_t));
+    apu_state.shadow = false;
+    apu_state.synth = false;
 }
 
+/* Between these, the apu runs as a shadow that only keeps what the cpu can
+ * observe, so no samples are generated, nothing reaches the apu thread, and states
+ * load without disturbing either. For emulating ahead and going back to a
+ * state saved before begin, see emulate_frame_run_ahead. */
+void apu_begin_speculation(void) {
+    apu_speculating = true;
+    apu_state.shadow = true;
+}
+
+void apu_end_speculation(void) {
+    apu_speculating = false;
+    apu_state.shadow = apu_log.running;
+}
@@ -1,14 +1,37 @@
 #ifndef __APU_H__
 #define __APU_H__
 
+#define APU_DEFAULT_SAMPLE_RATE 44100
+#define APU_MIN_SAMPLE_RATE 8000
+#define APU_MAX_SAMPLE_RATE 192000
+#define APU_DEFAULT_DEVICE_SAMPLES 512
+#define APU_MIN_DEVICE_SAMPLES 32
+#define APU_MAX_DEVICE_SAMPLES 8192
+
+typedef void (*apu_sound_sink_t)(float *samples, int count, void *userdata);
+
 void apu_init(void);
+void apu_set_sample_rate(int rate);
+void apu_set_sound_sink(apu_sound_sink_t sink, void *userdata);
+void apu_set_device_buffer(int samples);
+void apu_set_latency_target(int ms);
+void apu_enable_latency_stats(void);
+void apu_start_thread(void);
+void apu_stop_thread(void);
 uint8_t apu_read(uint16_t addr);
 void apu_write(uint16_t addr, uint8_t data);
 void apu_tick(void);
 void apu_render_sound_wave(void);
 bool apu_request_frame(void);
 void apu_flush_sound_buffer(void);
+void apu_discard_sound_buffer(void);
 bool apu_irq_pending(void);
 void apu_irq_clear(void);
+uint32_t apu_state_size(void);
+void apu_save_state(uint8_t *out);
+void apu_load_state(uint8_t *in);
+void apu_power_on(void);
+void apu_begin_speculation(void);
+void apu_end_speculation(void);
 
 #endif
@@ -0,0 +1,205 @@
+/*
+ * Compressed roms, .zip and .gz.
+ *
+ * Both formats hold raw deflate streams, which are inflated with the zlib
+ * decoder that comes with stb_image, directly into a buffer of the final
+ * size. Roms are then run from that buffer like from a mapped .nes file.
+ *
+ * Only what rom sets use is supported: for zip, the first .nes entry,
+ * stored or deflated, without zip64 or encryption. The crc32 stored in the
+ * archive is checked.
+ *
+ * more info: https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+ * https://www.rfc-editor.org/rfc/rfc1952
+ */
+
+#define ARCHIVE_MAX_UNPACKED_SIZE (64*1024*1024) // far bigger than any real rom
+
+#define ZIP_LOCAL_HEADER_SIG   0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP_END_OF_CENTRAL_SIG 0x06054b50
+#define ZIP_LOCAL_HEADER_SIZE   30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_OF_CENTRAL_SIZE 22
+#define ZIP_METHOD_STORED  0
+#define ZIP_METHOD_DEFLATE 8
+
+#define GZIP_HEADER_SIZE  10
+#define GZIP_TRAILER_SIZE 8
+#define GZIP_FHCRC    0x02
+#define GZIP_FEXTRA   0x04
+#define GZIP_FNAME    0x08
+#define GZIP_FCOMMENT 0x10
+
+static bool is_zip(uint8_t *data, size_t size) {
+    return size >= ZIP_LOCAL_HEADER_SIZE && get_le32(data) == ZIP_LOCAL_HEADER_SIG;
+}
+
+static bool is_gzip(uint8_t *data, size_t size) {
+    return size >= GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE && data[0] == 0x1F && data[1] == 0x8B;
+}
+
+bool is_archive(uint8_t *data, size_t size) {
+    return is_zip(data, size) || is_gzip(data, size);
+}
+
+/* Inflates or copies packed into a new buffer of exactly unpacked_size bytes
+ * and checks it against crc. Returns NULL with the reason in *error.
+ *
+ * NOTE(shaw): stb's inflate fails when fewer than 16 bits of input are left
+ * at a huffman code, even if the code is shorter, which raw deflate streams
+ * can end with. The inflater stops at the last block anyway, so it's given
+ * everything up to the end of the file in available, which always includes
+ * the zip central directory or gzip trailer. */
+static uint8_t *unpack_stream(uint8_t *packed, size_t packed_size, size_t available, 
+    bool deflated, uint32_t unpacked_size, uint32_t crc, char **error)
+{
+    if (unpacked_size == 0 || unpacked_size > ARCHIVE_MAX_UNPACKED_SIZE || packed_size > 0x7FFFFFFF) {
+        *error = "unsupported rom size";
+        return NULL;
+    }
+    uint8_t *out = xmalloc(unpacked_size);
+    if (deflated) {
+        int input_size = (int)MIN(available, 0x7FFFFFFF);
+        int n = stbi_zlib_decode_noheader_buffer((char *)out, (int)unpacked_size, (char *)packed, input_size);
+        if (n != (int)unpacked_size) {
+            *error = "corrupt deflate stream";
+            free(out);
+            return NULL;
+        }
+    } else {
+        if (packed_size != unpacked_size) {
+            *error = "corrupt stored entry";
+            free(out);
+            return NULL;
+        }
+        memcpy(out, packed, unpacked_size);
+    }
+    if (crc32(0, out, unpacked_size) != crc) {
+        *error = "crc mismatch";
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static bool is_rom_name(uint8_t *name, size_t len) {
+    return len >= 4 && name[len-4] == '.' && tolower(name[len-3]) == 'n' &&
+        tolower(name[len-2]) == 'e' && tolower(name[len-1]) == 's';
+}
+
+static uint8_t *unpack_zip(uint8_t *data, size_t size, size_t *unpacked_size, char **error) {
+    // the end of central directory record is last, followed by a comment of
+    // up to 64KB
+    size_t end = 0;
+    bool found_end = false;
+    if (size >= ZIP_END_OF_CENTRAL_SIZE) {
+        size_t lowest = size > ZIP_END_OF_CENTRAL_SIZE + 0xFFFF ? size - ZIP_END_OF_CENTRAL_SIZE - 0xFFFF : 0;
+        for (end = size - ZIP_END_OF_CENTRAL_SIZE; ; --end) {
+            if (get_le32(data + end) == ZIP_END_OF_CENTRAL_SIG) {
+                found_end = true;
+                break;
+            }
+            if (end == lowest) break;
+        }
+    }
+    // the whole record has to fit for the reads of its fields below
+    if (!found_end || end > size - ZIP_END_OF_CENTRAL_SIZE) {
+        *error = "zip end of central directory not found";
+        return NULL;
+    }
+
+    uint16_t entries = get_le16(data + end + 10);
+    size_t offset = get_le32(data + end + 16);
+    for (uint16_t i=0; i<entries; ++i) {
+        if (size < ZIP_CENTRAL_HEADER_SIZE || offset > size - ZIP_CENTRAL_HEADER_SIZE ||
+            get_le32(data + offset) != ZIP_CENTRAL_HEADER_SIG)
+        {
+            break;
+        }
+        uint8_t *entry = data + offset;
+        uint16_t flags = get_le16(entry + 8);
+        uint16_t method = get_le16(entry + 10);
+        uint32_t crc = get_le32(entry + 16);
+        uint32_t packed_size = get_le32(entry + 20);
+        uint32_t file_size = get_le32(entry + 24);
+        uint16_t name_len = get_le16(entry + 28);
+        uint16_t extra_len = get_le16(entry + 30);
+        uint16_t comment_len = get_le16(entry + 32);
+        size_t local = get_le32(entry + 42);
+        offset += ZIP_CENTRAL_HEADER_SIZE + name_len + extra_len + comment_len;
+        if (offset > size) break;
+
+        if (!is_rom_name(entry + ZIP_CENTRAL_HEADER_SIZE, name_len))
+            continue;
+        if (flags & 1) {
+            *error = "encrypted zip entries are not supported";
+            return NULL;
+        }
+        if (method != ZIP_METHOD_STORED && method != ZIP_METHOD_DEFLATE) {
+            *error = "unsupported zip compression method";
+            return NULL;
+        }
+        if (packed_size == 0xFFFFFFFF || size < ZIP_LOCAL_HEADER_SIZE || local > size - ZIP_LOCAL_HEADER_SIZE ||
+            get_le32(data + local) != ZIP_LOCAL_HEADER_SIG)
+        {
+            *error = "corrupt or zip64 entry";
+            return NULL;
+        }
+        // the local header's name and extra field can differ from the central one
+        size_t start = local + ZIP_LOCAL_HEADER_SIZE + get_le16(data + local + 26) + get_le16(data + local + 28);
+        if (start > size || packed_size > size - start) {
+            *error = "zip file is truncated";
+            return NULL;
+        }
+        uint8_t *out = unpack_stream(data + start, packed_size, size - start, 
+            method == ZIP_METHOD_DEFLATE, file_size, crc, error);
+        if (out) *unpacked_size = file_size;
+        return out;
+    }
+    *error = "no .nes file in zip";
+    return NULL;
+}
+
+static uint8_t *unpack_gzip(uint8_t *data, size_t size, size_t *unpacked_size, char **error) {
+    if (data[2] != ZIP_METHOD_DEFLATE) {
+        *error = "unsupported gzip compression method";
+        return NULL;
+    }
+    uint8_t flags = data[3];
+    size_t offset = GZIP_HEADER_SIZE;
+    size_t limit = size - GZIP_TRAILER_SIZE;
+    if ((flags & GZIP_FEXTRA) && offset + 2 <= limit)
+        offset += 2 + get_le16(data + offset);
+    if (flags & GZIP_FNAME)
+        while (offset < limit && data[offset++]);
+    if (flags & GZIP_FCOMMENT)
+        while (offset < limit && data[offset++]);
+    if (flags & GZIP_FHCRC)
+        offset += 2;
+    if (offset > limit) {
+        *error = "gzip file is truncated";
+        return NULL;
+    }
+
+    // the trailer only has the size mod 4GB, which is plenty for roms
+    uint32_t crc = get_le32(data + limit);
+    uint32_t file_size = get_le32(data + limit + 4);
+    uint8_t *out = unpack_stream(data + offset, limit - offset, size - offset, true, file_size, crc, error);
+    if (out) *unpacked_size = file_size;
+    return out;
+}
+
+/* Returns the rom packed in a zip or gzip file in a new buffer, which the
+ * caller frees. Prints an error and returns NULL if it can't be unpacked. */
+uint8_t *unpack_archive(uint8_t *data, size_t size, char *name, size_t *unpacked_size) {
+    char *error = "not a zip or gzip file";
+    uint8_t *out = NULL;
+    if (is_zip(data, size))
+        out = unpack_zip(data, size, unpacked_size, &error);
+    else if (is_gzip(data, size))
+        out = unpack_gzip(data, size, unpacked_size, &error);
+    if (!out)
+        fprintf(stderr, "Failed to unpack %s: %s\n", name, error);
+    return out;
+}
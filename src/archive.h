@@ -0,0 +1,7 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+bool is_archive(uint8_t *data, size_t size);
+uint8_t *unpack_archive(uint8_t *data, size_t size, char *name, size_t *unpacked_size);
+
+#endif
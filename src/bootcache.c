@@ -0,0 +1,145 @@
+/*
+ * Boot snapshots
+ *
+ * Many games spend their first second or two on setup and logos before they
+ * look at the controllers. Until a game first latches them it can't tell
+ * what's pressed, see controller_polled, so those frames play out the same
+ * on every launch. The first time a rom runs, the state before each frame
+ * is kept until the game polls, and the last one from before that is
+ * written next to the rom as game.boot. Later launches load it in place of
+ * booting.
+ *
+ * Only launches from power on that nothing interferes with take or use a
+ * snapshot. Movies start from power on and play without one. Games with
+ * battery ram don't get one either, the ram is part of the power on state
+ * and is different by the next launch. Resetting, rewinding or stepping
+ * instructions before the game polls gives up on taking one.
+ *
+ * Save states only load into the build that saved them, and a different
+ * build may boot differently anyway, so the file is keyed to the build
+ * along with the rom and is taken again when either changes.
+ *
+ * Format, header values little endian:
+ *    0-7: "NESBOOT\0"
+ *    8-11: version, BOOTCACHE_VERSION
+ *    12-15: the build, see bootcache_build
+ *    16-19: crc of the rom, see cart_rom_crc
+ *    20-23: frames from power on the snapshot skips
+ *    24-: save state, see state.c
+ */
+
+#define BOOTCACHE_VERSION 1
+#define BOOTCACHE_HEADER_SIZE 24
+#define BOOTCACHE_MAX_FRAMES (60*60) // games that haven't polled after a minute don't get one
+
+static struct {
+    bool watching;
+    char *path;
+    uint8_t *state;       // the state before the last frame
+    size_t state_size;
+    uint32_t frame;       // the frame state is before, frames counted from power on
+    bool has_state;
+} bootcache;
+
+// identifies the build, the compile time of the unity build
+static uint32_t bootcache_build(void) {
+    char *build = __DATE__ " " __TIME__;
+    return crc32(0, (uint8_t *)build, strlen(build));
+}
+
+/* Stops watching for the boot snapshot, when the machine does something
+ * that isn't booting on its own */
+void bootcache_stop(void) {
+    free(bootcache.path);
+    free(bootcache.state);
+    memset(&bootcache, 0, sizeof(bootcache));
+}
+
+/* Loads the snapshot at path into the machine if it's one of this rom taken
+ * by this build. A missing or stale file is not an error, it's replaced once
+ * the game polls. */
+static bool bootcache_load(cpu_t *cpu, char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    size_t state_size = nes_state_size();
+    size_t size = BOOTCACHE_HEADER_SIZE + state_size;
+    uint8_t *data = xmalloc(size + 1);
+    size_t got = fread(data, 1, size + 1, fp);
+    fclose(fp);
+
+    bool ok = got == size &&
+        0 == memcmp(data, "NESBOOT\0", 8) &&
+        get_le32(data + 8) == BOOTCACHE_VERSION &&
+        get_le32(data + 12) == bootcache_build() &&
+        get_le32(data + 16) == cart_rom_crc();
+    if (ok)
+        ok = nes_load_state(cpu, data + BOOTCACHE_HEADER_SIZE, state_size);
+    if (ok)
+        printf("Skipped %u frames of booting with %s\n", get_le32(data + 20), path);
+    free(data);
+    return ok;
+}
+
+static void bootcache_write(void) {
+    uint8_t header[BOOTCACHE_HEADER_SIZE];
+    memcpy(header, "NESBOOT\0", 8);
+    put_le32(header + 8, BOOTCACHE_VERSION);
+    put_le32(header + 12, bootcache_build());
+    put_le32(header + 16, cart_rom_crc());
+    put_le32(header + 20, bootcache.frame);
+
+    FILE *fp = fopen(bootcache.path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to create boot snapshot %s: %s\n", bootcache.path, strerror(errno));
+        return;
+    }
+    fwrite(header, 1, BOOTCACHE_HEADER_SIZE, fp);
+    fwrite(bootcache.state, 1, bootcache.state_size, fp);
+    bool failed = ferror(fp);
+    if (fclose(fp) != 0) failed = true;
+    if (failed)
+        fprintf(stderr, "Failed to write boot snapshot %s\n", bootcache.path);
+    else
+        printf("Saved a boot snapshot %u frames in to %s\n", bootcache.frame, bootcache.path);
+}
+
+/* Called right after power on and reset, before the first frame. Loads the
+ * rom's boot snapshot if it has a usable one, otherwise starts watching the
+ * frames to take it. */
+void bootcache_start(cpu_t *cpu) {
+    bootcache_stop();
+    if (cart_has_battery())
+        return;
+    char *path = cart_sibling_path(".boot");
+    if (!path)
+        return;
+    if (bootcache_load(cpu, path)) {
+        free(path);
+        return;
+    }
+    bootcache.watching = true;
+    bootcache.path = path;
+    bootcache.state_size = nes_state_size();
+    bootcache.state = xmalloc(bootcache.state_size);
+}
+
+/* Called right before each frame the game plays, like movie_frame. Once the
+ * game has polled, the state from before the frame it did is written out.
+ * A game that polls during its first frame has nothing to skip. */
+void bootcache_frame(cpu_t *cpu) {
+    if (!bootcache.watching) return;
+    if (controller_polled()) {
+        if (bootcache.has_state && bootcache.frame > 0)
+            bootcache_write();
+        bootcache_stop();
+        return;
+    }
+    if (bootcache.has_state && bootcache.frame + 1 >= BOOTCACHE_MAX_FRAMES) {
+        bootcache_stop();
+        return;
+    }
+    if (bootcache.has_state)
+        ++bootcache.frame;
+    nes_save_state(cpu, bootcache.state, bootcache.state_size);
+    bootcache.has_state = true;
+}
@@ -0,0 +1,10 @@
+#ifndef __BOOTCACHE_H__
+#define __BOOTCACHE_H__
+
+struct cpu_t;
+
+void bootcache_start(struct cpu_t *cpu);
+void bootcache_frame(struct cpu_t *cpu);
+void bootcache_stop(void);
+
+#endif
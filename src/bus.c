@@ -1,6 +1,12 @@
 #define MAX_MEMORY 65536
 
-static uint8_t cpu_ram[2048];
+static THREAD_LOCAL uint8_t cpu_ram[2048];
+
+// the buttons held on each controller, CONTROLLER_* bits, and the parallel to
+// serial shift registers the game reads them through
+static THREAD_LOCAL uint8_t controller_input[2];
+static THREAD_LOCAL uint8_t controller_registers[2];
+static THREAD_LOCAL bool controller_latched; // since power on, see controller_polled
 
 
 /*
@@ -78,3 +84,52 @@ void system_reset(cpu_t *cpu) {
     cpu_reset(cpu);
 }
 
+/* Puts everything but the cart in its power on state, whatever ran on this
+ * thread before. Follow with loading a cart and system_reset. */
+void system_power_on(cpu_t *cpu) {
+    memset(cpu, 0, sizeof(*cpu));
+    memset(cpu_ram, 0, sizeof(cpu_ram));
+    memset(controller_input, 0, sizeof(controller_input));
+    memset(controller_registers, 0, sizeof(controller_registers));
+    controller_latched = false;
+    ppu_power_on();
+    apu_power_on();
+    sched_clear();
+}
+
+/* The buttons the game sees, set between frames by the front end */
+void controller_set_input(int controller_index, uint8_t buttons) {
+    controller_input[controller_index] = buttons;
+}
+
+uint8_t controller_get_input(int controller_index) {
+    return controller_input[controller_index];
+}
+
+void controller_write(int controller_index, uint8_t data) {
+    assert(controller_index == 0 || controller_index == 1);
+    if (data & 1) {
+        /* 1 means continually poll controller for current button states, since
+         * the input only changes between frames, we do nothing here */
+    } else {
+        /* 0 means switch to serial mode, and we simulate this by making a copy
+         * of the button states when a 0 is written, that can be used as a
+         * shift register */
+        controller_registers[controller_index] = controller_input[controller_index];
+        controller_latched = true;
+    }
+}
+
+/* Whether the game has latched the controllers since power on. Until it
+ * does it only ever reads zeros from them, so nothing it did so far can
+ * depend on the input. */
+bool controller_polled(void) {
+    return controller_latched;
+}
+
+uint8_t controller_read(int controller_index) {
+    uint8_t result = (controller_registers[controller_index] >> 7) & 1;
+    controller_registers[controller_index] <<= 1;
+    return result;
+}
+
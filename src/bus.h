@@ -8,5 +8,11 @@ void load_memory(uint16_t addr, uint8_t *data, uint32_t size);
 uint8_t bus_read(uint16_t addr);
 void bus_write(uint16_t addr, uint8_t data);
 void system_reset(struct cpu_t *cpu);
+void system_power_on(struct cpu_t *cpu);
+void controller_set_input(int controller_index, uint8_t buttons);
+uint8_t controller_get_input(int controller_index);
+void controller_write(int controller_index, uint8_t data);
+uint8_t controller_read(int controller_index);
+bool controller_polled(void);
 
 #endif
@@ -18,17 +18,26 @@
     10: Flags 10 - TV system, PRG-RAM presence (unofficial, rarely used extension)
     11-15: Unused padding (should be filled with zero, but some rippers put their name across bytes 7-15)
 
+    NES 2.0 headers (byte 7 bits 2-3 == 2) reuse bytes 8-15 for the upper bits
+    of the mapper and rom sizes, the submapper, ram sizes and timing.
+    Headers are often wrong either way, so a rom found in the rom database
+    by its crc gets the database's values instead, see romdb.c.
+
     more info: https://www.nesdev.org/wiki/INES
+    https://www.nesdev.org/wiki/NES_2.0
 */
 
-#define PRG_RAM_SIZE 8192
+#define PRG_RAM_WINDOW 8192 // size of the cpu's view of prg ram at $6000-$7FFF
+#define SAVE_SYNC_FRAMES 60  // battery ram is written back at most this often
+#define SAVE_PAGE_SIZE 4096  // and only in the pages of this size that changed
 
 typedef struct {
 	uint16_t mapper;
-	uint8_t prg_rom_banks; // in 16KB units
-	uint8_t chr_rom_banks; // in 8KB units
+	uint8_t submapper;
 	uint32_t prg_rom_size;
 	uint32_t chr_rom_size;
+	uint32_t prg_ram_size; // including battery backed ram
+	uint32_t chr_ram_size;
 	MirrorMode mirror;
 	bool battery_ram;
 	bool trainer;
@@ -36,177 +45,629 @@ typedef struct {
 	bool vs_unisystem;
 	bool playchoice_10;
 	bool nes2_0;
+	tv_timing_t timing;
+	uint32_t crc;          // of prg rom followed by chr rom, see correct_header
+	uint8_t hints;         // ROMDB_HINT_*, only known from the rom database
+	bool from_romdb;
 } ines_header_t;
 
+/* The rom image is everything loaded from the rom file, which never changes
+ * while the cart runs. It's reference counted and shared by every cart
+ * running the same file, so hosting many sessions of one game keeps a single
+ * copy of its prg and chr rom. */
+struct rom_image_t {
+    char *path;          // NULL for images made from a buffer, which aren't shared
+    int refs;            // guarded by rom_images_lock
+    ines_header_t header;
+    uint8_t *prg_rom;    // points into file or unpacked
+    uint8_t *chr_rom;    // NULL if the board uses chr ram
+    mapped_file_t file;  // the rom file when opened with open_rom_image
+    uint8_t *unpacked;   // or the rom unpacked from a .zip or .gz
+    rom_image_t *next;   // in the list of shared images
+};
+
+static rom_image_t *rom_images;
+static spin_lock_t rom_images_lock;
+
+/* The cart is the mutable part of one running game: its mapper state and
+ * ram. Everything else is in the shared image. */
 typedef struct {
-	ines_header_t header;
+    rom_image_t *image;
     uint8_t *prg_ram;
-    uint8_t *prg_rom;
-    uint8_t *chr_rom;
+    uint32_t prg_ram_size; // 0 if the cart has none
+    uint8_t *chr_rom;    // the image's chr rom, or this cart's chr ram
+    bool chr_is_ram;
+    mapped_file_t save;  // backs prg_ram for battery carts, see attach_save_file
+    uint64_t save_dirty; // a bit per SAVE_PAGE_SIZE of prg_ram changed since the
+                         // last sync, the last bit covers the rest of a larger ram
+    uint32_t frames_since_save_sync;
     mapper_t *mapper;
+    bank_slots_t *slots; // the mapper's current banking, see mappers.c
+    bool rendering;      // ppu rendering enabled, for mapper_sync
+    bool irq_line;       // the predicted mapper irq fired and isn't cleared yet
 } cart_t;
 
-static cart_t cart;
+static THREAD_LOCAL cart_t cart;
+
+/* NES 2.0 rom sizes: msb 0-E extends the lsb to a 12 bit count of units,
+ * msb F means the lsb is 2^E * (MM*2 + 1) bytes for oddly sized roms */
+static uint32_t nes2_rom_size(uint8_t lsb, uint8_t msb, uint32_t unit) {
+	if (msb == 0xF) {
+		uint8_t exponent = lsb >> 2, multiplier = (lsb & 3)*2 + 1;
+		// anything over 4GB can't be a real rom, the size check rejects it
+		return exponent < 30 ? (1u << exponent) * multiplier : UINT32_MAX;
+	}
+	return ((uint32_t)msb << 8 | lsb) * unit;
+}
 
 static ines_header_t 
 make_ines_header(uint8_t bytes[16]) {
 	ines_header_t header = {
-		.mapper = (bytes[6] >> 4) | (bytes[7] & 0xF0),
-		.prg_rom_banks = bytes[4],
-		.chr_rom_banks = bytes[5],
+		.mapper = bytes[6] >> 4,
 		.prg_rom_size = (uint32_t)bytes[4] << 14,
 		.chr_rom_size = (uint32_t)bytes[5] << 13,
 		.mirror = bytes[6] & 0x1,
 		.battery_ram = bytes[6] & 0x2,
 		.trainer = bytes[6] & 0x4,
-		.four_screen = bytes[6] & 0x2,
+		.four_screen = bytes[6] & 0x8,
 		.vs_unisystem = bytes[7] & 0x1,
 		.playchoice_10 = bytes[7] & 0x2,
 		.nes2_0 = ((bytes[7] >> 2) & 0x3) == 2,
 	};
+
+	if (header.nes2_0) {
+		header.mapper |= (bytes[7] & 0xF0) | (uint16_t)(bytes[8] & 0xF) << 8;
+		header.submapper = bytes[8] >> 4;
+		header.prg_rom_size = nes2_rom_size(bytes[4], bytes[9] & 0xF, _16KB);
+		header.chr_rom_size = nes2_rom_size(bytes[5], bytes[9] >> 4, _8KB);
+		// NES 2.0 gives volatile and battery backed sizes as 64 << n, 0 means none
+		uint8_t ram = bytes[10] & 0xF, nvram = bytes[10] >> 4;
+		uint8_t chr_ram = bytes[11] & 0xF, chr_nvram = bytes[11] >> 4;
+		header.prg_ram_size = (ram ? 64u << ram : 0) + (nvram ? 64u << nvram : 0);
+		header.chr_ram_size = (chr_ram ? 64u << chr_ram : 0) + (chr_nvram ? 64u << chr_nvram : 0);
+		header.timing = bytes[12] & 0x3;
+	} else {
+		// old rippers wrote their name across bytes 7-15, in which case only
+		// bytes 4-6 can be trusted
+		bool dirty = (bytes[7] & 0xC) || bytes[12] || bytes[13] || bytes[14] || bytes[15];
+		if (!dirty)
+			header.mapper |= bytes[7] & 0xF0;
+		// iNES byte 8 is prg ram in 8KB units, 0 infers 8KB for compatibility
+		header.prg_ram_size = !dirty && bytes[8] ? (uint32_t)bytes[8] * PRG_RAM_WINDOW : PRG_RAM_WINDOW;
+		header.chr_ram_size = header.chr_rom_size ? 0 : _8KB;
+		header.timing = !dirty && (bytes[9] & 1) ? TIMING_PAL : TIMING_NTSC;
+	}
 	return header;
 }
 
-void read_rom_file(char *filepath) {
-    bool cart_uses_chr_ram = false;
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s: %s\n", filepath, strerror(errno));
-        exit(1);
-    }
+/* Looks the rom up in the rom database by the crc of its prg and chr rom, and
+ * replaces whatever the header said with the database's values. */
+static void correct_header(ines_header_t *header, uint8_t *roms, size_t size) {
+	header->crc = crc32(0, roms, size);
+	romdb_entry_t entry;
+	if (!romdb_lookup(header->crc, &entry))
+		return;
+
+	header->mapper = entry.mapper;
+	header->submapper = entry.submapper;
+	header->four_screen = entry.mirroring == ROMDB_MIRROR_FOUR_SCREEN;
+	if (!header->four_screen)
+		header->mirror = entry.mirroring == ROMDB_MIRROR_VERTICAL ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+	header->battery_ram = entry.battery;
+	header->prg_ram_size = entry.prg_ram_size;
+	header->chr_ram_size = entry.chr_ram_size;
+	header->timing = entry.timing;
+	header->hints = entry.hints;
+	header->from_romdb = true;
+}
 
-    /* read header */
-	uint8_t header_bytes[16];
-    if (fread(header_bytes, 1, 16, fp) != 16) {
-        fprintf(stderr, "Failed to read %s: %s\n", filepath, strerror(errno));
-        exit(1);
+static void flush_save_file_at_exit(void) {
+    flush_mapped_file(&cart.save, true);
+}
+
+/* Backs prg ram with a shared mapping of the save file, so the battery
+ * backed ram survives the emulator exiting or the machine losing power. The
+ * frame loop never waits on the disk, see cart_end_frame. */
+static uint8_t *attach_save_file(char *save_path, uint32_t size) {
+    static bool registered;
+    if (!map_file_readwrite(save_path, size, &cart.save))
+        return NULL;
+    if (!registered) {
+        atexit(flush_save_file_at_exit);
+        registered = true;
     }
+    printf("Battery ram saved to %s\n", save_path);
+    return cart.save.data;
+}
 
+/* Parses the header of a rom image, checks the image holds the roms it
+ * describes and corrects the header from the rom database. The prg rom starts
+ * at data + *prg_offset, followed by the chr rom. Returns an error message if
+ * the image is unusable. Touches no cart state, so it's also used to inspect
+ * roms without loading them, see romindex.c. */
+static char *inspect_rom(uint8_t *data, size_t size, ines_header_t *header, size_t *prg_offset) {
     /* verify magic */
-    if (0 != strncmp((char *)header_bytes, "NES\x1A", 4)) {
-        fprintf(stderr, "Invalid .nes file %s\n", filepath);
-        exit(1);
+    if (size < 16 || 0 != memcmp(data, "NES\x1A", 4))
+        return "not an iNES file";
+
+    *header = make_ines_header(data);
+
+    size_t offset = 16;
+    if (header->trainer)
+        offset += 512;
+
+    uint32_t prg_rom_size = header->prg_rom_size;
+    uint32_t chr_rom_size = header->chr_rom_size;
+    if (prg_rom_size == 0 || size < offset || prg_rom_size > size - offset)
+        return "PRG ROM is truncated";
+    if (chr_rom_size > size - offset - prg_rom_size)
+        return "CHR ROM is truncated";
+    // the mappers bank in whole 16KB and 8KB units
+    if (prg_rom_size % _16KB || chr_rom_size % _8KB)
+        return "rom sizes are not a multiple of the bank size";
+
+    correct_header(header, data + offset, (size_t)prg_rom_size + chr_rom_size);
+    *prg_offset = offset;
+    return NULL;
+}
+
+// shared by all threads, set before any start opening roms
+static bool cart_verbose = true;
+
+/* Whether rom information and warnings are printed when an image is made.
+ * Errors are printed either way. */
+void cart_set_verbose(bool verbose) {
+    cart_verbose = verbose;
+}
+
+static void print_rom_info(ines_header_t *header) {
+    if (!cart_verbose) return;
+    printf("%u * 16kB ROM, %u * 8kB VROM, mapper %u, %s mirroring, crc %08X%s\n", 
+			header->prg_rom_size >> 14,
+			header->chr_rom_size >> 13,
+			header->mapper,
+			header->mirror ? "vertical" : "horizontal",
+			header->crc,
+			header->from_romdb ? " (rom database)" : "");
+    /* ignore trainer for now */
+    /* TODO(shaw): implement trainer ?? */
+    if (header->trainer)
+        printf("Warning: cart contains trainer but this emulator does not support them.\n");
+    // TODO(shaw): four screen needs 2KB more nametable ram on the cart
+    if (header->four_screen)
+        printf("Warning: cart uses four screen mirroring which this emulator does not support.\n");
+    if (header->timing == TIMING_PAL || header->timing == TIMING_DENDY)
+        printf("Warning: cart is for PAL or Dendy consoles, running it with NTSC timing.\n");
+}
+
+/* Checks the rom in data and makes an image of it. The image takes over file
+ * and unpacked, it frees them when the last reference is released. */
+static rom_image_t *make_image(uint8_t *data, size_t size, char *name, mapped_file_t *file, uint8_t *unpacked) {
+    ines_header_t header;
+    size_t offset;
+    char *error = inspect_rom(data, size, &header, &offset);
+    if (error) {
+        fprintf(stderr, "Failed to load %s: %s\n", name, error);
+        if (file) unmap_file(file);
+        free(unpacked);
+        return NULL;
     }
 
-	cart.header = make_ines_header(header_bytes);
+    rom_image_t *image = xcalloc(1, sizeof(rom_image_t));
+    image->refs = 1;
+    image->header = header;
+    image->prg_rom = data + offset;
+    if (header.chr_rom_size)
+        image->chr_rom = data + offset + header.prg_rom_size;
+    if (file) image->file = *file;
+    image->unpacked = unpacked;
+    // printed once per image, however many carts run it
+    print_rom_info(&header);
+    return image;
+}
 
-    uint32_t prg_rom_size = cart.header.prg_rom_size;
-    uint32_t chr_rom_size = cart.header.chr_rom_size;
+/* Makes an unshared image that runs directly from a rom in memory. Nothing is
+ * copied, prg rom and chr rom point into data, so it must stay valid and
+ * unchanged until the image is released. name is only used in messages.
+ * Returns NULL if the rom is unusable. */
+rom_image_t *make_rom_image(uint8_t *data, size_t size, char *name) {
+    return make_image(data, size, name, NULL, NULL);
+}
 
-    if (chr_rom_size == 0) {
-        cart_uses_chr_ram = true;
-        chr_rom_size = PRG_RAM_SIZE; 
+/* Like make_rom_image, but the image runs from its own copy of data, which
+ * can also be a zipped or gzipped rom. */
+rom_image_t *copy_rom_image(uint8_t *data, size_t size, char *name) {
+    uint8_t *copy;
+    if (is_archive(data, size)) {
+        copy = unpack_archive(data, size, name, &size);
+        if (!copy) return NULL;
+    } else {
+        copy = xmalloc(size);
+        memcpy(copy, data, size);
     }
+    return make_image(copy, size, name, NULL, copy);
+}
 
-    cart.prg_rom = malloc(prg_rom_size);
-    cart.chr_rom = malloc(chr_rom_size);
-    /* TODO(shaw): this will probably depend on mapper */
-    cart.prg_ram = malloc(PRG_RAM_SIZE); 
+/* Returns the image of the rom file, sharing it if the file is already open.
+ * The file is mapped read only and the cart runs straight from the mapping,
+ * zipped and gzipped roms are unpacked into memory instead, see archive.c.
+ * Returns NULL if the file can't be loaded. */
+rom_image_t *open_rom_image(char *filepath) {
+    spin_lock(&rom_images_lock);
+    for (rom_image_t *image = rom_images; image; image = image->next) {
+        if (0 == strcmp(image->path, filepath)) {
+            ++image->refs;
+            spin_unlock(&rom_images_lock);
+            return image;
+        }
+    }
+    spin_unlock(&rom_images_lock);
+
+    mapped_file_t file;
+    if (!map_file_readonly(filepath, &file))
+        return NULL;
+    uint8_t *data = file.data;
+    size_t size = file.size;
+    uint8_t *unpacked = NULL;
+    if (is_archive(data, size)) {
+        unpacked = unpack_archive(data, size, filepath, &size);
+        unmap_file(&file);
+        if (!unpacked)
+            return NULL;
+        data = unpacked;
+    }
 
-    cart.mapper = make_mapper(
-		cart.header.mapper,
-		cart.header.prg_rom_banks,
-		cart.header.chr_rom_banks,
-		cart.header.mirror);
+    rom_image_t *image = make_image(data, size, filepath, unpacked ? NULL : &file, unpacked);
+    if (!image)
+        return NULL;
+    image->path = xmalloc(strlen(filepath) + 1);
+    strcpy(image->path, filepath);
+
+    // another thread may have opened the same file meanwhile, keep theirs
+    spin_lock(&rom_images_lock);
+    for (rom_image_t *other = rom_images; other; other = other->next) {
+        if (0 == strcmp(other->path, filepath)) {
+            ++other->refs;
+            spin_unlock(&rom_images_lock);
+            release_rom_image(image);
+            return other;
+        }
+    }
+    image->next = rom_images;
+    rom_images = image;
+    spin_unlock(&rom_images_lock);
+    return image;
+}
 
-    printf("%u * 16kB ROM, %u * 8kB VROM, mapper %u, %s mirroring\n", 
-			cart.header.prg_rom_banks,
-			cart.header.chr_rom_banks,
-			cart.header.mapper,
-			cart.header.mirror ? "vertical" : "horizontal");
+void retain_rom_image(rom_image_t *image) {
+    spin_lock(&rom_images_lock);
+    ++image->refs;
+    spin_unlock(&rom_images_lock);
+}
 
-    /* ignore trainer for now */
-    /* TODO(shaw): implement trainer ?? */
-    if (cart.header.trainer) {
-        printf("Warning: cart contains trainer but this emulator does not support them.\n");
-        if(fseek(fp, 512, SEEK_CUR) < 0) {
-            perror("fseek");
-            exit(1);
+void release_rom_image(rom_image_t *image) {
+    if (!image) return;
+    spin_lock(&rom_images_lock);
+    if (--image->refs > 0) {
+        spin_unlock(&rom_images_lock);
+        return;
+    }
+    for (rom_image_t **link = &rom_images; *link; link = &(*link)->next) {
+        if (*link == image) {
+            *link = image->next;
+            break;
         }
     }
+    spin_unlock(&rom_images_lock);
 
-    /* read prg rom */
-    if (fread(cart.prg_rom, 1, prg_rom_size, fp) != prg_rom_size) {
-        fprintf(stderr, "Failed to read PRG ROM from %s: %s\n", filepath, strerror(errno));
-        exit(1);
+    unmap_file(&image->file);
+    free(image->unpacked);
+    free(image->path);
+    free(image);
+}
+
+/* Sets up the cart to run image, taking over the caller's reference to it.
+ * Battery ram is kept in the file at save_path, or not persisted if it's
+ * NULL. */
+void load_rom_image(rom_image_t *image, char *save_path) {
+    ines_header_t *header = &image->header;
+    cart.image = image;
+
+    uint32_t prg_rom_size = header->prg_rom_size;
+    uint32_t chr_rom_size = header->chr_rom_size;
+
+    if (chr_rom_size == 0) {
+        // the board uses chr ram instead, the mappers bank it in 8KB units
+        uint32_t chr_ram_size = MAX(header->chr_ram_size, _8KB);
+        chr_rom_size = (chr_ram_size + _8KB-1) & ~(uint32_t)(_8KB-1);
+        cart.chr_rom = xcalloc(1, chr_rom_size);
+        cart.chr_is_ram = true;
+    } else {
+        cart.chr_rom = image->chr_rom;
+        cart.chr_is_ram = false;
+    }
+
+    // NOTE(shaw): the cpu only sees one 8KB window of prg ram at $6000, carts
+    // with less ram are given the full window without mirroring it
+    uint32_t prg_ram_size = MAX(header->prg_ram_size, PRG_RAM_WINDOW);
+    cart.prg_ram = NULL;
+    cart.prg_ram_size = 0;
+    if (header->prg_ram_size) {
+        if (header->battery_ram && save_path)
+            cart.prg_ram = attach_save_file(save_path, prg_ram_size);
+        // without a save file the battery ram just doesn't persist
+        if (!cart.prg_ram)
+            cart.prg_ram = xcalloc(1, prg_ram_size);
+        cart.prg_ram_size = prg_ram_size;
     }
- 
-    /* read chr rom */
-    if (!cart_uses_chr_ram && fread(cart.chr_rom, 1, chr_rom_size, fp) != chr_rom_size) {
-        fprintf(stderr, "Failed to read CHR ROM from %s: %s\n", filepath, strerror(errno));
+
+    cart_memory_t mem = {
+        .prg_rom = image->prg_rom,
+        .prg_rom_size = prg_rom_size,
+        .chr = cart.chr_rom,
+        .chr_size = chr_rom_size,
+        .chr_is_ram = cart.chr_is_ram,
+        .prg_ram = cart.prg_ram,
+    };
+    cart.mapper = make_mapper(header->mapper, &mem, header->mirror);
+    cart.slots = &cart.mapper->slots;
+    cart.rendering = ppu_rendering_enabled();
+    cart.irq_line = false;
+    sched_set(SCHED_CART_IRQ, SCHED_NEVER);
+
+}
+
+/* Sets up the cart to run directly from a rom in memory, see make_rom_image.
+ * Battery ram is not persisted. */
+void load_rom_buffer(uint8_t *data, size_t size, char *name) {
+    rom_image_t *image = make_rom_image(data, size, name);
+    if (!image)
         exit(1);
+    load_rom_image(image, NULL);
+}
+
+/* The path of a file that goes with the rom at filepath, with its
+ * extension replaced by ext: game.nes, game.zip or game.nes.gz -> game.sav */
+static char *rom_sibling_path(rom_image_t *image, char *filepath, char *ext) {
+    size_t len = strlen(filepath);
+    char *path = xmalloc(len + strlen(ext) + 1);
+    strcpy(path, filepath);
+    char *base = path;
+    for (char *p = path; *p; ++p)
+        if (*p == '/' || *p == '\\') base = p + 1;
+    char *dot = strrchr(base, '.');
+    if (dot && image->unpacked && 0 == strcmp(dot, ".gz")) {
+        *dot = 0;
+        dot = strrchr(base, '.');
     }
+    if (dot) *dot = 0;
+    strcat(path, ext);
+    return path;
+}
+
+/* Loads the rom file, see open_rom_image. Battery ram is kept in a .sav file
+ * next to the rom. */
+void read_rom_file(char *filepath) {
+    rom_image_t *image = open_rom_image(filepath);
+    if (!image)
+        exit(1);
+
+    char *save_path = rom_sibling_path(image, filepath, ".sav");
+    load_rom_image(image, save_path);
+    free(save_path);
+}
+
+/* Like rom_sibling_path for the loaded cart, NULL if its rom wasn't opened
+ * from a file. Free the result. */
+char *cart_sibling_path(char *ext) {
+    if (!cart.image->path) return NULL;
+    return rom_sibling_path(cart.image, cart.image->path, ext);
+}
 
-    if (fp) fclose(fp);
+static void mark_save_dirty(uint32_t offset) {
+    cart.save_dirty |= 1ull << MIN(offset / SAVE_PAGE_SIZE, 63);
+}
+
+/* Called once per emulated frame. The pages of battery ram written during
+ * the last SAVE_SYNC_FRAMES frames get their write back scheduled without
+ * blocking, the atexit handler does the final synchronous flush. */
+void cart_end_frame(void) {
+    if (!cart.save.data) return;
+    if (++cart.frames_since_save_sync < SAVE_SYNC_FRAMES) return;
+    for (int page=0; cart.save_dirty; ++page) {
+        if (cart.save_dirty & 1) {
+            size_t offset = (size_t)page * SAVE_PAGE_SIZE;
+            size_t size = page == 63 ? cart.save.size : SAVE_PAGE_SIZE;
+            flush_mapped_range(&cart.save, offset, size, false);
+        }
+        cart.save_dirty >>= 1;
+    }
+    cart.frames_since_save_sync = 0;
 }
 
 void delete_cart() {
-    free(cart.prg_rom);
-    free(cart.chr_rom);
-    free(cart.prg_ram);
+    if (cart.chr_is_ram)
+        free(cart.chr_rom);
+    if (cart.save.data) {
+        flush_mapped_file(&cart.save, true);
+        unmap_file(&cart.save);
+    } else {
+        free(cart.prg_ram);
+    }
+    free(cart.mapper);
+    release_rom_image(cart.image);
     memset(&cart, 0, sizeof(cart_t));
 }
 
-uint8_t cart_cpu_read(uint16_t addr) {
-    uint32_t mapped_addr = mapper_read(cart.mapper, addr);
+// for mappers with irq timing
+static void cart_schedule_irq(void) {
+	uint64_t time = cart.irq_line ? SCHED_NEVER : mapper_next_irq(cart.mapper, cart.rendering);
+	sched_set(SCHED_CART_IRQ, time);
+}
 
-	if (addr < 0x4020) {
+uint8_t cart_cpu_read(uint16_t addr) {
+	if (addr >= 0x8000) {
+        return cart.slots->prg[(addr >> 13) & 3][addr & 0x1FFF];
+	} else if (addr >= 0x6000) { /* $6000 - $7FFF */
+        return cart.slots->prg_ram ? cart.slots->prg_ram[addr & 0x1FFF] : 0;
+	} else if (addr >= 0x4020) {
+        // few carts have anything here, so they only pay for one branch
+        // https://www.nesdev.org/wiki/Category:Mappers_using_$4020-$5FFF
+        if (!cart.mapper->has_expansion)
+            return open_bus(addr);
+        return mapper_expansion_read(cart.mapper, addr);
+    } else {
 		assert(0 && "cpu should only access cartridge from 0x4020-0xFFFF");
 		return 0;
-	} else if (addr < 0x6000) {
-        // NOTE(shaw): currently ignoring 0x4020 - 0x5FFF, but some mappers use this address space
-        // https://www.nesdev.org/wiki/Category:Mappers_using_$4020-$5FFF
-        return 0;
-    } else if (addr < 0x8000) { /* $6000 - $7FFF */
-		assert(mapped_addr < PRG_RAM_SIZE);
-        return cart.prg_ram[mapped_addr];
-	} else {
-        /*printf("addr=0x%4X mapped_addr=0x%4X\n", addr, mapped_addr);*/
-		assert(mapped_addr < cart.header.prg_rom_size);
-        return cart.prg_rom[mapped_addr];
-    }
+	}
 }
 
 void cart_cpu_write(uint16_t addr, uint8_t data) {
-    uint32_t mapped_addr = mapper_write(cart.mapper, addr, data);
-
-    if (addr < 0x4020) 
+    if (addr >= 0x8000) {
+        if (cart.mapper->has_irq_timing) {
+            // the write can change the irq counter, so bring the mapper up to
+            // date first and predict the irq again after
+            mapper_sync(cart.mapper, ppu_timestamp(), cart.rendering);
+            mapper_write(cart.mapper, addr, data);
+            cart.irq_line = mapper_irq_pending(cart.mapper);
+            cart_schedule_irq();
+        } else {
+            mapper_write(cart.mapper, addr, data);
+        }
+    } else if (addr >= 0x6000) { /* $6000 - $7FFF */
+        if (cart.slots->prg_ram) {
+            cart.slots->prg_ram[addr & 0x1FFF] = data;
+            mark_save_dirty((uint32_t)(cart.slots->prg_ram - cart.prg_ram) + (addr & 0x1FFF));
+        }
+    } else if (addr >= 0x4020) {
+        if (cart.mapper->has_expansion)
+            mapper_expansion_write(cart.mapper, addr, data);
+    } else {
         assert(0 && "cpu should only access cartridge from 0x4020-0xFFFF");
-    else if (addr < 0x6000) {
-        // NOTE(shaw): currently ignoring 0x4020 - 0x5FFF, but some mappers use this address space
-        // https://www.nesdev.org/wiki/Category:Mappers_using_$4020-$5FFF
-    } else if (addr < 0x8000) { /* $6000 - $7FFF */
-		assert(mapped_addr < PRG_RAM_SIZE);
-        cart.prg_ram[mapped_addr] = data;
 	}
 }
 
 
 uint8_t cart_ppu_read(uint16_t addr, uint8_t vram[2048]) {
-    uint32_t mapped_addr = mapper_read(cart.mapper, addr);
-
     return addr < 0x2000
-        ? cart.chr_rom[mapped_addr]
-        : vram[mapped_addr];
+        ? cart.slots->chr[addr >> 10][addr & 0x3FF]
+        : vram[cart.slots->nametable[(addr >> 10) & 3] + (addr & 0x3FF)];
 }
 
 void cart_ppu_write(uint16_t addr, uint8_t data, uint8_t vram[2048]) {
-    uint32_t mapped_addr = mapper_write(cart.mapper, addr, data);
-
-    if (addr < 0x2000)
-        cart.chr_rom[mapped_addr] = data;
-    else 
-        vram[mapped_addr] = data;
+    if (addr < 0x2000) {
+        if (cart.chr_is_ram)
+            cart.slots->chr[addr >> 10][addr & 0x3FF] = data;
+    } else {
+        vram[cart.slots->nametable[(addr >> 10) & 3] + (addr & 0x3FF)] = data;
+    }
 }
 
+// the scanline hook and irq polling run for every scanline and cpu cycle, so
+// they are skipped entirely for mappers that don't have them. mappers with
+// irq timing aren't polled at all, their irq is a scheduled event
 void cart_scanline(void) {
-	mapper_scanline(cart.mapper);
+	if (cart.mapper->has_scanline)
+		mapper_scanline(cart.mapper);
 }
 
 bool cart_irq_pending(void) {
-	return mapper_irq_pending(cart.mapper);
+	if (!cart.mapper->has_irq)
+		return false;
+	return cart.mapper->has_irq_timing ? cart.irq_line : mapper_irq_pending(cart.mapper);
 }
 
 void cart_irq_clear(void) {
-	mapper_irq_clear(cart.mapper);
+	if (!cart.mapper->has_irq)
+		return;
+	if (cart.mapper->has_irq_timing) {
+		mapper_sync(cart.mapper, ppu_timestamp(), cart.rendering);
+		mapper_irq_clear(cart.mapper);
+		cart.irq_line = false;
+		cart_schedule_irq();
+	} else {
+		mapper_irq_clear(cart.mapper);
+	}
+}
+
+/* Scheduler handler for SCHED_CART_IRQ, the time mapper_next_irq predicted */
+void cart_irq_event(uint64_t now) {
+	mapper_sync(cart.mapper, now, cart.rendering);
+	cart.irq_line = mapper_irq_pending(cart.mapper);
+	cart_schedule_irq();
+}
+
+/* Called by the ppu when rendering is turned on or off, which starts or
+ * stops the scanline clocks of mappers that count them */
+void cart_rendering_changed(bool rendering) {
+	if (!cart.mapper || !cart.mapper->has_irq_timing) {
+		cart.rendering = rendering;
+		return;
+	}
+	mapper_sync(cart.mapper, ppu_timestamp(), cart.rendering);
+	cart.rendering = rendering;
+	cart.irq_line = mapper_irq_pending(cart.mapper);
+	cart_schedule_irq();
+}
+
+uint32_t cart_rom_crc(void) {
+	return cart.image->header.crc;
+}
+
+// NULL if no cart is loaded on this thread
+rom_image_t *cart_rom_image(void) {
+	return cart.image;
+}
+
+uint8_t cart_rom_hints(void) {
+	return cart.image->header.hints;
+}
+
+bool cart_has_battery(void) {
+	return cart.image->header.battery_ram;
+}
+
+/* The cart's part of a save state: the irq line, prg ram, chr ram and the
+ * mapper. The rom itself is identified by cart_rom_crc. */
+uint32_t cart_state_size(void) {
+	uint32_t chr_ram_size = cart.chr_is_ram ? cart.mapper->mem.chr_size : 0;
+	return 1 + cart.prg_ram_size + chr_ram_size + mapper_state_size(cart.mapper);
+}
+
+void cart_save_state(uint8_t *out) {
+	*out++ = cart.irq_line;
+	if (cart.prg_ram_size) {
+		memcpy(out, cart.prg_ram, cart.prg_ram_size);
+		out += cart.prg_ram_size;
+	}
+	if (cart.chr_is_ram) {
+		memcpy(out, cart.chr_rom, cart.mapper->mem.chr_size);
+		out += cart.mapper->mem.chr_size;
+	}
+	mapper_save_state(cart.mapper, out);
+}
+
+/* Must be called after the ppu state is loaded, the irq is scheduled from
+ * its timestamp */
+void cart_load_state(uint8_t *in) {
+	cart.irq_line = *in++ & 1;
+	// run-ahead and rewind load states all the time, usually with the same
+	// battery ram, so only pages that differ are copied and need a sync
+	for (uint32_t offset=0; offset<cart.prg_ram_size; offset+=SAVE_PAGE_SIZE) {
+		uint32_t size = MIN(SAVE_PAGE_SIZE, cart.prg_ram_size - offset);
+		if (memcmp(cart.prg_ram + offset, in + offset, size) != 0) {
+			memcpy(cart.prg_ram + offset, in + offset, size);
+			mark_save_dirty(offset);
+		}
+	}
+	in += cart.prg_ram_size;
+	if (cart.chr_is_ram) {
+		memcpy(cart.chr_rom, in, cart.mapper->mem.chr_size);
+		in += cart.mapper->mem.chr_size;
+	}
+	mapper_load_state(cart.mapper, in);
+
+	cart.rendering = ppu_rendering_enabled();
+	if (cart.mapper->has_irq_timing)
+		cart_schedule_irq();
 }
@@ -1,8 +1,21 @@
 #ifndef _CART_H_
 #define _CART_H_
 
+typedef struct rom_image_t rom_image_t;
+
+rom_image_t *open_rom_image(char *filepath);
+rom_image_t *make_rom_image(uint8_t *data, size_t size, char *name);
+rom_image_t *copy_rom_image(uint8_t *data, size_t size, char *name);
+void retain_rom_image(rom_image_t *image);
+void release_rom_image(rom_image_t *image);
+void cart_set_verbose(bool verbose);
+
+void load_rom_image(rom_image_t *image, char *save_path);
 void read_rom_file(char *filepath);
+char *cart_sibling_path(char *ext);
+void load_rom_buffer(uint8_t *data, size_t size, char *name);
 void delete_cart();
+void cart_end_frame(void);
 
 uint8_t cart_cpu_read(uint16_t addr);
 void cart_cpu_write(uint16_t addr, uint8_t data);
@@ -11,6 +24,14 @@ void cart_ppu_write(uint16_t addr, uint8_t data, uint8_t vram[2048]);
 void cart_scanline(void);
 bool cart_irq_pending(void);
 void cart_irq_clear(void);
-void cart_scanline(void);
+void cart_irq_event(uint64_t now);
+void cart_rendering_changed(bool rendering);
+rom_image_t *cart_rom_image(void);
+uint32_t cart_rom_crc(void);
+uint8_t cart_rom_hints(void);
+bool cart_has_battery(void);
+uint32_t cart_state_size(void);
+void cart_save_state(uint8_t *out);
+void cart_load_state(uint8_t *in);
 
 #endif
@@ -2,6 +2,13 @@
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
 #define MIN(x, y) ((x) <= (y) ? (x) : (y))
 
+// the state of the emulated machine is per thread, see nes.c
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 void *xmalloc(size_t size) {
     void *ptr = malloc(size);
     if (ptr == NULL) {
@@ -40,6 +47,472 @@ void fatal(char *fmt, ...) {
 }
 
 
+// threads and atomics
+// ---------------------------------------------------------------------------
+// just what the core needs to run machines on several threads, so libnes
+// doesn't depend on SDL, which the front end uses for the window and audio
+
+typedef struct {
+    volatile int value;
+} atomic_int_t;
+
+// a lock for short critical sections, zero initialized is unlocked
+typedef atomic_int_t spin_lock_t;
+
+#ifdef _WIN32
+typedef struct {
+    HANDLE handle;
+    int (*fn)(void *);
+    void *data;
+} thread_t;
+
+typedef struct {
+    HANDLE handle;
+} semaphore_t;
+#else
+typedef struct {
+    pthread_t handle;
+    int (*fn)(void *);
+    void *data;
+} thread_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int count;
+} semaphore_t;
+#endif
+
+#ifdef _MSC_VER
+int atomic_get(atomic_int_t *a) {
+    return InterlockedOr((volatile LONG *)&a->value, 0);
+}
+
+void atomic_set(atomic_int_t *a, int value) {
+    InterlockedExchange((volatile LONG *)&a->value, value);
+}
+
+// returns the value from before the add
+int atomic_add(atomic_int_t *a, int value) {
+    return InterlockedExchangeAdd((volatile LONG *)&a->value, value);
+}
+
+static int atomic_swap(atomic_int_t *a, int value) {
+    return InterlockedExchange((volatile LONG *)&a->value, value);
+}
+#else
+int atomic_get(atomic_int_t *a) {
+    return __atomic_load_n(&a->value, __ATOMIC_SEQ_CST);
+}
+
+void atomic_set(atomic_int_t *a, int value) {
+    __atomic_store_n(&a->value, value, __ATOMIC_SEQ_CST);
+}
+
+// returns the value from before the add
+int atomic_add(atomic_int_t *a, int value) {
+    return __atomic_fetch_add(&a->value, value, __ATOMIC_SEQ_CST);
+}
+
+static int atomic_swap(atomic_int_t *a, int value) {
+    return __atomic_exchange_n(&a->value, value, __ATOMIC_SEQ_CST);
+}
+#endif
+
+void spin_lock(spin_lock_t *lock) {
+    while (atomic_swap(lock, 1)) {
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+}
+
+void spin_unlock(spin_lock_t *lock) {
+    atomic_set(lock, 0);
+}
+
+void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec t = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    nanosleep(&t, NULL);
+#endif
+}
+
+// monotonic time in nanoseconds, for measuring how long things take
+uint64_t time_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)count.QuadPart / freq.QuadPart * 1000000000u +
+        (uint64_t)count.QuadPart % freq.QuadPart * 1000000000u / freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+#endif
+}
+
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI thread_start(LPVOID arg) {
+    thread_t *thread = arg;
+    return (DWORD)thread->fn(thread->data);
+}
+#else
+static void *thread_start(void *arg) {
+    thread_t *thread = arg;
+    thread->fn(thread->data);
+    return NULL;
+}
+#endif
+
+/* Runs fn(data) on a new thread. Returns NULL if the thread couldn't be
+ * started. */
+thread_t *thread_create(int (*fn)(void *), void *data) {
+    thread_t *thread = xmalloc(sizeof(*thread));
+    thread->fn = fn;
+    thread->data = data;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, thread_start, thread, 0, NULL);
+    if (!thread->handle) {
+#else
+    if (pthread_create(&thread->handle, NULL, thread_start, thread) != 0) {
+#endif
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+// waits for the thread to return and frees it
+void thread_join(thread_t *thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+    free(thread);
+}
+
+/* Returns NULL if the semaphore couldn't be created. */
+semaphore_t *semaphore_create(int count) {
+    semaphore_t *sem = xmalloc(sizeof(*sem));
+#ifdef _WIN32
+    sem->handle = CreateSemaphoreA(NULL, count, 0x7FFFFFFF, NULL);
+    if (!sem->handle) {
+        free(sem);
+        return NULL;
+    }
+#else
+    sem->count = count;
+    if (pthread_mutex_init(&sem->mutex, NULL) != 0) {
+        free(sem);
+        return NULL;
+    }
+    if (pthread_cond_init(&sem->cond, NULL) != 0) {
+        pthread_mutex_destroy(&sem->mutex);
+        free(sem);
+        return NULL;
+    }
+#endif
+    return sem;
+}
+
+void semaphore_destroy(semaphore_t *sem) {
+#ifdef _WIN32
+    CloseHandle(sem->handle);
+#else
+    pthread_cond_destroy(&sem->cond);
+    pthread_mutex_destroy(&sem->mutex);
+#endif
+    free(sem);
+}
+
+void semaphore_post(semaphore_t *sem) {
+#ifdef _WIN32
+    ReleaseSemaphore(sem->handle, 1, NULL);
+#else
+    pthread_mutex_lock(&sem->mutex);
+    ++sem->count;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->mutex);
+#endif
+}
+
+void semaphore_wait(semaphore_t *sem) {
+#ifdef _WIN32
+    WaitForSingleObject(sem->handle, INFINITE);
+#else
+    pthread_mutex_lock(&sem->mutex);
+    while (sem->count == 0)
+        pthread_cond_wait(&sem->cond, &sem->mutex);
+    --sem->count;
+    pthread_mutex_unlock(&sem->mutex);
+#endif
+}
+
+
+// memory mapped files
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} mapped_file_t;
+
+/* Maps the whole file read only. Pages are shared through the page cache
+ * with every other process mapping the same file. Prints an error and
+ * returns false on failure. */
+bool map_file_readonly(char *filepath, mapped_file_t *file) {
+    memset(file, 0, sizeof(*file));
+#ifdef _WIN32
+    file->file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, 
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to open %s: error %lu\n", filepath, GetLastError());
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file->file, &size) || size.QuadPart == 0) {
+        fprintf(stderr, "Failed to map %s: empty or unreadable file\n", filepath);
+        CloseHandle(file->file);
+        return false;
+    }
+    file->size = (size_t)size.QuadPart;
+    file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (file->mapping)
+        file->data = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!file->data) {
+        fprintf(stderr, "Failed to map %s: error %lu\n", filepath, GetLastError());
+        if (file->mapping) CloseHandle(file->mapping);
+        CloseHandle(file->file);
+        return false;
+    }
+#else
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Failed to map %s: empty or unreadable file\n", filepath);
+        close(fd);
+        return false;
+    }
+    file->size = (size_t)st.st_size;
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    file->data = data;
+#endif
+    return true;
+}
+
+/* Maps the file read/write and shared, so stores go straight to the page
+ * cache and end up in the file. The file is created if needed and grown with
+ * zeros to at least size bytes. */
+bool map_file_readwrite(char *filepath, size_t size, mapped_file_t *file) {
+    memset(file, 0, sizeof(*file));
+#ifdef _WIN32
+    file->file = CreateFileA(filepath, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL, 
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to open %s: error %lu\n", filepath, GetLastError());
+        return false;
+    }
+    LARGE_INTEGER existing;
+    if (!GetFileSizeEx(file->file, &existing)) existing.QuadPart = 0;
+    file->size = MAX((size_t)existing.QuadPart, size);
+    // mapping past the end of the file grows it, the new bytes are zero
+    file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READWRITE, 
+        (DWORD)((uint64_t)file->size >> 32), (DWORD)file->size, NULL);
+    if (file->mapping)
+        file->data = MapViewOfFile(file->mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if (!file->data) {
+        fprintf(stderr, "Failed to map %s: error %lu\n", filepath, GetLastError());
+        if (file->mapping) CloseHandle(file->mapping);
+        CloseHandle(file->file);
+        return false;
+    }
+#else
+    int fd = open(filepath, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", filepath, strerror(errno));
+        close(fd);
+        return false;
+    }
+    file->size = MAX((size_t)st.st_size, size);
+    if ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) < 0) {
+        fprintf(stderr, "Failed to resize %s: %s\n", filepath, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, file->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    file->data = data;
+#endif
+    return true;
+}
+
+/* Writes modified pages of a read/write mapping from offset to offset + size
+ * back to the file. Without wait the write back is only scheduled and this
+ * returns immediately, with wait it blocks until the data is on disk. */
+void flush_mapped_range(mapped_file_t *file, size_t offset, size_t size, bool wait) {
+    if (!file->data || offset >= file->size) return;
+    size = MIN(size, file->size - offset);
+#ifdef _WIN32
+    FlushViewOfFile(file->data + offset, size);
+    if (wait) FlushFileBuffers(file->file);
+#else
+    // msync takes whole pages, the mapping itself starts on one
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    if (msync(file->data + start, offset + size - start, wait ? MS_SYNC : MS_ASYNC) < 0)
+        perror("msync");
+#endif
+}
+
+void flush_mapped_file(mapped_file_t *file, bool wait) {
+    flush_mapped_range(file, 0, file->size, wait);
+}
+
+void unmap_file(mapped_file_t *file) {
+    if (!file->data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+    CloseHandle(file->file);
+#else
+    munmap(file->data, file->size);
+#endif
+    memset(file, 0, sizeof(*file));
+}
+
+
+// crc32
+// ---------------------------------------------------------------------------
+
+// the zip/png polynomial, reflected, so results match other tools' crc32
+#define CRC32_POLY 0xEDB88320u
+
+static uint32_t crc32_table[8][256];
+static atomic_int_t crc32_table_ready;
+static spin_lock_t crc32_table_lock;
+
+static void crc32_init_table(void) {
+    for (uint32_t i=0; i<256; ++i) {
+        uint32_t c = i;
+        for (int k=0; k<8; ++k)
+            c = (c >> 1) ^ (CRC32_POLY & (0u - (c & 1)));
+        crc32_table[0][i] = c;
+    }
+    // table k advances a byte that is followed by k more bytes
+    for (int k=1; k<8; ++k)
+        for (int i=0; i<256; ++i)
+            crc32_table[k][i] = (crc32_table[k-1][i] >> 8) ^ crc32_table[0][crc32_table[k-1][i] & 0xFF];
+}
+
+// builds the tables on first use, once, whichever threads get here first
+static void crc32_ensure_table(void) {
+    if (atomic_get(&crc32_table_ready))
+        return;
+    spin_lock(&crc32_table_lock);
+    if (!atomic_get(&crc32_table_ready)) {
+        crc32_init_table();
+        atomic_set(&crc32_table_ready, 1);
+    }
+    spin_unlock(&crc32_table_lock);
+}
+
+/* Continues a crc over size more bytes, start with crc 0. Slicing by 8: eight
+ * table lookups per 8 bytes instead of one per byte, a few hundred KB of rom
+ * is hashed in well under a millisecond. */
+uint32_t crc32(uint32_t crc, uint8_t *data, size_t size) {
+    crc32_ensure_table();
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | 
+                             (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+              crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][data[4]] ^ crc32_table[2][data[5]] ^
+              crc32_table[1][data[6]] ^ crc32_table[0][data[7]];
+        data += 8; size -= 8;
+    }
+    while (size--)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *data++) & 0xFF];
+    return ~crc;
+}
+
+
+// little endian
+// ---------------------------------------------------------------------------
+
+// the byte order of every file format the emulator reads and writes
+
+uint16_t get_le16(uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+uint32_t get_le32(uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint64_t get_le64(uint8_t *p) {
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+
 // dynamic array or "stretchy buffers", a la sean barrett
 // ---------------------------------------------------------------------------
 
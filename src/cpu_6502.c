@@ -945,8 +945,8 @@ void cpu_reset(cpu_t *cpu) {
 #define MAX_CACHED_INS 14
 // ring buffer of cached instruction addresses, used for disassembling code
 // that is a few instructions behind the current program counter
-static uint16_t cached_ins_addrs[MAX_CACHED_INS];
-static int cached_ins_index;
+static THREAD_LOCAL uint16_t cached_ins_addrs[MAX_CACHED_INS];
+static THREAD_LOCAL int cached_ins_index;
 
 void cache_ins_addr(uint16_t addr) {
 	cached_ins_addrs[cached_ins_index] = addr;
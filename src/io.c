@@ -3,7 +3,6 @@ window_state_t nes_window, debug_window, memory_window;
 SDL_GameController *controllers[2];
 platform_state_t platform_state;
 platform_state_t last_platform_state;
-uint8_t controller_registers[2];
 
 char scancode_to_char[] = {
     [SDL_SCANCODE_A] = 'a',
@@ -225,6 +224,9 @@ static void do_keyboard_input(SDL_KeyboardEvent *event) {
         case SDL_SCANCODE_GRAVE:
             platform_state.tilde = event->type == SDL_KEYDOWN;
             break;
+        case SDL_SCANCODE_TAB:
+            platform_state.tab = event->type == SDL_KEYDOWN;
+            break;
 
         /* nes controller buttons */
         case SDL_SCANCODE_UP:
@@ -354,25 +356,6 @@ static void do_controller_input(SDL_ControllerButtonEvent *event) {
     }
 }
 
-void controller_write(int controller_index, uint8_t data) {
-    assert(controller_index == 0 || controller_index == 1);
-    if (data & 1) {
-        /* 1 means continually poll controller for current button states, since
-         * this is already done every frame by do_input, we do nothing here */
-    } else {
-        /* 0 means switch to serial mode, and we simulate this by making a copy
-         * of the button states when a 0 is written, that can be used as a
-         * shift register */
-        controller_registers[controller_index] = platform_state.controller_states[controller_index];
-    }
-}
-
-uint8_t controller_read(int controller_index) {
-    uint8_t result = (controller_registers[controller_index] >> 7) & 1;
-    controller_registers[controller_index] <<= 1;
-    return result;
-}
-
 uint64_t get_ticks(void) {
     return SDL_GetTicks64();
 }
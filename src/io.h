@@ -1,9 +1,6 @@
 #ifndef __IO_H__
 #define __IO_H__
 
-/* PPU_WIDTH and HEIGHT is size output by the ppu */
-#define PPU_WIDTH  256
-#define PPU_HEIGHT 240
 /* NES_WIDTH and HEIGHT is size of section output by the ppu that is actually visible */
 #define NES_WIDTH  256
 #define NES_HEIGHT 224
@@ -52,6 +49,7 @@ typedef struct {
     bool f,w,m,g,r,p;
     bool nine;
     bool tilde;
+    bool tab;
 	int wheel_y;
 	char hex_char; // a single hex character entered per event loop iteration
 
@@ -72,7 +70,6 @@ typedef enum {
 extern window_state_t nes_window, debug_window, memory_window;
 extern platform_state_t platform_state;
 extern platform_state_t last_platform_state;
-extern uint8_t controller_registers[2]; /* parallel to serial shift registers */
 
 void io_init(void);
 void io_deinit(void);
@@ -82,8 +79,6 @@ void io_render_prepare(void);
 void io_render_sprites(void);
 void io_render_present(void);
 uint64_t get_ticks(void);
-void controller_write(int controller_index, uint8_t data);
-uint8_t controller_read(int controller_index);
 void do_input();
 sprite_t make_sprite(window_state_t *window, uint32_t *pixels, int w, int h, 
                      int dest_x, int dest_y, int dest_w, int dest_h);
@@ -94,5 +89,9 @@ void register_sprite(window_state_t *window, sprite_t *sprite);
 void render_text(window_state_t *window, char *text, int x, int y);
 void render_text_color(window_state_t *window, char *text, int x, int y, uint32_t color_mod);
 
+/* debug views of the ppu, see main.c */
+void update_palettes(sprite_t palettes[8]);
+void update_pattern_tables(int selected_palette, sprite_t pattern_tables[2]);
+
 
 #endif
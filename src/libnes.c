@@ -0,0 +1,68 @@
+/*
+ * Unity build of libnes, the emulator core without the front end, see nes.h.
+ * Built into libnes.a and libnes.so by make libnes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define NES_NO_AUDIO_DEVICE // sound only goes to a sink, see nes_audio
+
+// only the zlib inflater, for archive.c, and kept out of the exports. Being
+// static, the rest of stb_image's api goes unused, which gcc reports at the
+// end of the file. The core gets those warnings from the main build.
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#define STBI_NO_STDIO
+#define STBI_NO_LINEAR
+#define STBI_NO_HDR
+#include "stb_image.h"
+
+
+#include "cpu_6502.h"
+#include "bus.h"
+#include "sched.h"
+#include "romdb.h"
+#include "archive.h"
+#include "cart.h"
+#include "ppu.h"
+#include "apu.h"
+#include "state.h"
+#include "nes.h"
+
+#include "common.c"
+#include "cpu_6502.c"
+#include "bus.c"
+#include "mappers.c"
+#include "romdb.c"
+#include "archive.c"
+#include "cart.c"
+#include "ppu.c"
+#include "apu.c"
+#include "sched.c"
+#include "state.c"
+#include "nes.c"
+#include "nes_batch.c"
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -9,6 +10,20 @@
 #include <math.h>
 #include <signal.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
 #define STB_IMAGE_IMPLEMENTATION
@@ -23,24 +38,46 @@
 
 #include "cpu_6502.h"
 #include "bus.h"
+#include "sched.h"
+#include "romdb.h"
+#include "archive.h"
 #include "cart.h"
 #include "io.h"
 #include "ppu.h"
 #include "apu.h"
+#include "wav.h"
+#include "romindex.h"
+#include "state.h"
+#include "rewind.h"
+#include "movie.h"
+#include "bootcache.h"
+#include "nes.h"
 
 #include "common.c"
 #include "cpu_6502.c"
 #include "bus.c"
 #include "mappers.c"
+#include "romdb.c"
+#include "archive.c"
 #include "cart.c"
 #include "io.c"
 #include "ppu.c"
 #include "apu.c"
+#include "wav.c"
+#include "sched.c"
+#include "romindex.c"
+#include "state.c"
+#include "rewind.c"
+#include "movie.c"
+#include "bootcache.c"
+#include "nes.c"
 
 #define MS_PER_FRAME (1000/60)
 #define MAX_CPU_STATE_LINES 36
 #define MAX_DEBUG_LINE_CHARS 34
 #define MAX_CODE_LINES 14
+#define TURBO_UNCAPPED 0
+#define MAX_RUN_AHEAD 4
 
 
 typedef enum {
@@ -60,27 +97,211 @@ static int debug_selected_palette;
 static uint64_t elapsed_time, last_frame_time;
 static bool frame_prepared;
 
+// fast forward, speed is a multiple of 60 fps or TURBO_UNCAPPED
+static int turbo_speeds[] = { 1, 2, 4, 8, TURBO_UNCAPPED };
+static int turbo_speed = 1;
+static uint64_t turbo_start_time, turbo_frames;
+
+// frames emulated ahead of the real one and shown in its place, see
+// emulate_frame_run_ahead
+static int run_ahead;
+static bool run_ahead_render_all;
+static uint8_t *run_ahead_state;
+static size_t run_ahead_state_size;
+
 
 char **get_dasm_lines(Arena *arena, uint16_t pc);
 void init_debug_chr_viewer(sprite_t pattern_tables[2], sprite_t palettes[8]);
 void render_memory_window(void);
 void render_debug_window(Arena *arena, cpu_t *cpu);
-void do_interrupts(cpu_t *cpu);
+void set_run_ahead(int frames);
+void emulate_frame_run_ahead(cpu_t *cpu, bool keep_audio);
+void set_turbo_speed(int speed);
+int dump_audio(cpu_t *cpu, char *wav_path, int frames, int sample_rate, wav_format_t format, bool audio_thread, bool ram_only);
 void emulation_mode_run(cpu_t *cpu);
 void emulation_mode_step_instruction(cpu_t *cpu);
 void emulation_mode_step_frame(cpu_t *cpu);
 void update_memory_window(void);
 
+void print_usage(char *program) {
+    printf("Usage: %s [options] ROM_FILE\n"
+           "Options:\n"
+           "  --dump-audio FILE     render audio to a WAV file without opening a window or audio device\n"
+           "  --frames N            number of frames to render with --dump-audio (default 600, or the whole movie)\n"
+           "  --sample-rate HZ      output sample rate (default %d)\n"
+           "  --audio-format FMT    WAV sample format for --dump-audio, f32 or s16 (default f32)\n"
+           "  --audio-thread        synthesize audio on a separate thread\n"
+           "  --ram-only            don't draw the picture with --dump-audio, only what the cpu can see is emulated\n"
+           "  --audio-buffer N      audio device buffer size in samples (default %d)\n"
+           "  --audio-latency MS    audio kept queued ahead of the device (default one device buffer)\n"
+           "  --audio-stats         print an output latency histogram at exit\n"
+           "  --turbo N             start fast forwarded at 2, 4 or 8 times speed, 0 for uncapped\n"
+           "  --rewind-mb N         memory for rewinding with backspace, 0 to disable (default %d)\n"
+           "  --record-movie FILE   record the controller input from power on to FILE\n"
+           "  --play-movie FILE     play back input recorded with --record-movie, also headless with --dump-audio\n"
+           "  --run-ahead N         hide N frames of the game's input lag by emulating ahead, up to %d\n"
+           "  --no-boot-cache       boot the game instead of loading the snapshot of its boot next to the rom\n"
+           "  --romdb FILE          rom database used to correct bad headers (default romdb.bin next to the program)\n"
+           "  --build-romdb TXT OUT compile a text rom database into the binary format and exit\n"
+           "  --index DIR           index the roms under DIR for launchers and exit\n"
+           "  --index-file FILE     where --index writes the index (default DIR/romindex.bin)\n",
+           program, APU_DEFAULT_SAMPLE_RATE, APU_DEFAULT_DEVICE_SAMPLES, REWIND_DEFAULT_MB, MAX_RUN_AHEAD);
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Usage: %s ROM_FILE\n", argv[0]);
+    char *rom_path = NULL;
+    char *dump_audio_path = NULL;
+    int dump_frames = 0;
+    int sample_rate = APU_DEFAULT_SAMPLE_RATE;
+    wav_format_t dump_format = WAV_FORMAT_F32;
+    bool audio_thread = false;
+    int audio_buffer = APU_DEFAULT_DEVICE_SAMPLES;
+    int audio_latency = 0;
+    bool audio_stats = false;
+    bool ram_only = false;
+    bool boot_cache = true;
+    int turbo = 1;
+    int rewind_mb = REWIND_DEFAULT_MB;
+    int run_ahead_frames = 0;
+    char *record_movie_path = NULL;
+    char *play_movie_path = NULL;
+    char *romdb_path = NULL;
+    char *index_dir = NULL;
+    char *index_path = NULL;
+
+    for (int i=1; i<argc; ++i) {
+        char *arg = argv[i];
+        bool has_value = i+1 < argc;
+        if (0 == strcmp(arg, "--dump-audio") && has_value) {
+            dump_audio_path = argv[++i];
+        } else if (0 == strcmp(arg, "--frames") && has_value) {
+            dump_frames = atoi(argv[++i]);
+        } else if (0 == strcmp(arg, "--sample-rate") && has_value) {
+            sample_rate = atoi(argv[++i]);
+            if (sample_rate < APU_MIN_SAMPLE_RATE || sample_rate > APU_MAX_SAMPLE_RATE) {
+                fprintf(stderr, "Sample rate must be between %d and %d\n", APU_MIN_SAMPLE_RATE, APU_MAX_SAMPLE_RATE);
+                exit(1);
+            }
+        } else if (0 == strcmp(arg, "--audio-format") && has_value) {
+            char *format = argv[++i];
+            if (0 == strcmp(format, "f32"))
+                dump_format = WAV_FORMAT_F32;
+            else if (0 == strcmp(format, "s16"))
+                dump_format = WAV_FORMAT_S16;
+            else {
+                fprintf(stderr, "Unknown audio format '%s', expected f32 or s16\n", format);
+                exit(1);
+            }
+        } else if (0 == strcmp(arg, "--audio-thread")) {
+            audio_thread = true;
+        } else if (0 == strcmp(arg, "--audio-buffer") && has_value) {
+            audio_buffer = atoi(argv[++i]);
+            if (audio_buffer < APU_MIN_DEVICE_SAMPLES || audio_buffer > APU_MAX_DEVICE_SAMPLES) {
+                fprintf(stderr, "Audio buffer must be between %d and %d samples\n", APU_MIN_DEVICE_SAMPLES, APU_MAX_DEVICE_SAMPLES);
+                exit(1);
+            }
+        } else if (0 == strcmp(arg, "--audio-latency") && has_value) {
+            audio_latency = atoi(argv[++i]);
+            if (audio_latency < 0 || audio_latency > 1000) {
+                fprintf(stderr, "Audio latency must be between 0 and 1000 ms\n");
+                exit(1);
+            }
+        } else if (0 == strcmp(arg, "--audio-stats")) {
+            audio_stats = true;
+        } else if (0 == strcmp(arg, "--ram-only")) {
+            ram_only = true;
+        } else if (0 == strcmp(arg, "--no-boot-cache")) {
+            boot_cache = false;
+        } else if (0 == strcmp(arg, "--turbo") && has_value) {
+            turbo = atoi(argv[++i]);
+            if (turbo != 1 && turbo != 2 && turbo != 4 && turbo != 8 && turbo != TURBO_UNCAPPED) {
+                fprintf(stderr, "Turbo speed must be 1, 2, 4, 8 or 0 for uncapped\n");
+                exit(1);
+            }
+        } else if (0 == strcmp(arg, "--rewind-mb") && has_value) {
+            rewind_mb = atoi(argv[++i]);
+            if (rewind_mb < 0 || rewind_mb > 4096) {
+                fprintf(stderr, "Rewind memory must be between 0 and 4096 MB\n");
+                exit(1);
+            }
+        } else if (0 == strcmp(arg, "--run-ahead") && has_value) {
+            run_ahead_frames = atoi(argv[++i]);
+            if (run_ahead_frames < 0 || run_ahead_frames > MAX_RUN_AHEAD) {
+                fprintf(stderr, "Run-ahead must be between 0 and %d frames\n", MAX_RUN_AHEAD);
+                exit(1);
+            }
+        } else if (0 == strcmp(arg, "--record-movie") && has_value) {
+            record_movie_path = argv[++i];
+        } else if (0 == strcmp(arg, "--play-movie") && has_value) {
+            play_movie_path = argv[++i];
+        } else if (0 == strcmp(arg, "--romdb") && has_value) {
+            romdb_path = argv[++i];
+        } else if (0 == strcmp(arg, "--build-romdb") && i+2 < argc) {
+            bool ok = romdb_build(argv[i+1], argv[i+2]);
+            return ok ? 0 : 1;
+        } else if (0 == strcmp(arg, "--index") && has_value) {
+            index_dir = argv[++i];
+        } else if (0 == strcmp(arg, "--index-file") && has_value) {
+            index_path = argv[++i];
+        } else if (arg[0] == '-' && arg[1] == '-') {
+            print_usage(argv[0]);
+            exit(1);
+        } else {
+            rom_path = arg;
+        }
+    }
+
+    if (romdb_path) {
+        if (!romdb_open(romdb_path))
+            exit(1);
+    } else {
+        // the default database is optional
+        char default_path[256];
+        if (!base_path) base_path = SDL_GetBasePath();
+        snprintf(default_path, 256, "%s%s", base_path ? base_path : "", "romdb.bin");
+        FILE *fp = fopen(default_path, "rb");
+        if (fp) {
+            fclose(fp);
+            romdb_open(default_path);
+        }
+    }
+
+    if (index_dir) {
+        char *default_index = index_path ? NULL : join_path(index_dir, "romindex.bin");
+        bool ok = index_rom_directory(index_dir, index_path ? index_path : default_index);
+        free(default_index);
+        return ok ? 0 : 1;
+    }
+
+    if (!rom_path) {
+        print_usage(argv[0]);
         exit(1);
     }
 
     cpu_t cpu;
-    read_rom_file(argv[1]);
+    read_rom_file(rom_path);
+    apu_set_sample_rate(sample_rate);
+    apu_set_device_buffer(audio_buffer);
+    apu_set_latency_target(audio_latency);
+    if (audio_stats)
+        apu_enable_latency_stats();
+
+    if (record_movie_path && play_movie_path) {
+        fprintf(stderr, "A movie can't be recorded and played at the same time\n");
+        exit(1);
+    }
+    if (play_movie_path && !movie_play(play_movie_path))
+        exit(1);
+    if (!dump_frames)
+        dump_frames = movie_playing() ? (int)MIN(movie_length(), 0x7FFFFFFF) : 600;
+
+    if (dump_audio_path)
+        return dump_audio(&cpu, dump_audio_path, dump_frames, sample_rate, dump_format, audio_thread, ram_only);
+
     io_init();
 	io_init_window(&nes_window, "NES", (int)WINDOW_WIDTH, (int)WINDOW_HEIGHT);
+    if (audio_thread)
+        apu_start_thread();
 
 
     /* LEAK: 
@@ -108,6 +329,12 @@ int main(int argc, char **argv) {
     ppu_init(nes_quad.pixels);
 
 	system_reset(&cpu);
+	rewind_init((size_t)rewind_mb * 1024 * 1024);
+	set_run_ahead(run_ahead_frames);
+	if (record_movie_path && !movie_record(record_movie_path))
+		exit(1);
+	if (boot_cache && !movie_active())
+		bootcache_start(&cpu);
 
 #ifdef DEBUG_LOG
     logfile = fopen("nestest.log", "w");
@@ -121,16 +348,22 @@ int main(int argc, char **argv) {
     elapsed_time = 0;
     last_frame_time = get_ticks();
 	emulation_mode_t emulation_mode = EM_RUN;
+	set_turbo_speed(turbo);
 
     for (;;) {
 		char *pos = arena_get_pos(&frame_arena);
 
         last_platform_state = platform_state;
         do_input();
+        controller_set_input(0, platform_state.controller_states[0]);
+        controller_set_input(1, platform_state.controller_states[1]);
 	
 		// reset
-		if (platform_state.r && !last_platform_state.r)
+		if (platform_state.r && !last_platform_state.r && !movie_playing()) {
 			system_reset(&cpu);
+			movie_reset();
+			bootcache_stop();
+		}
 
 		// change selected palette in debug window
 		if (platform_state.p && !last_platform_state.p) {
@@ -139,6 +372,14 @@ int main(int argc, char **argv) {
 				update_pattern_tables(debug_selected_palette, pattern_tables);
 		}
 
+		// cycle fast forward speed
+		if (platform_state.tab && !last_platform_state.tab) {
+			int count = sizeof(turbo_speeds)/sizeof(turbo_speeds[0]);
+			int i = 0;
+			while (turbo_speeds[i] != turbo_speed) ++i;
+			set_turbo_speed(turbo_speeds[(i+1) % count]);
+		}
+
 		// activate debug window
 		if (platform_state.tilde && !last_platform_state.tilde) {
 			if (!debug_window.window) {
@@ -217,33 +458,156 @@ int main(int argc, char **argv) {
     return 0;
 }
 
-void do_interrupts(cpu_t *cpu) {
-	if (cpu->op_cycles == 0 && ppu_nmi())  {
-		cpu_nmi(cpu);
-		ppu_clear_nmi();
+void set_run_ahead(int frames) {
+	run_ahead = frames;
+	if (frames && (cart_rom_hints() & ROMDB_HINT_NO_RUN_AHEAD)) {
+		printf("Run-ahead is disabled for this game\n");
+		run_ahead = 0;
 	}
-	if (cpu->op_cycles == 0 && cart_irq_pending()) {
-		cpu_irq(cpu);
-		cart_irq_clear();
+	// with every pixel skipped, games that poll for sprite 0 hits still see
+	// them, but anything else that relies on the picture is safer rendered
+	run_ahead_render_all = cart_rom_hints() & ROMDB_HINT_NO_FRAMESKIP;
+	if (run_ahead && !run_ahead_state) {
+		run_ahead_state_size = nes_state_size();
+		run_ahead_state = xmalloc(run_ahead_state_size);
 	}
-	// if (cpu->op_cycles == 0 && apu_irq_pending()) {
-		// cpu_irq(cpu);
-		// apu_irq_clear();
-	// }
+}
+
+/* Like emulate_frame, but when running ahead the frame is followed by
+ * run_ahead more with the same input, and the last of them is presented
+ * instead. The machine then goes back to the end of the real frame, and only
+ * its audio is kept, so the game plays exactly as without run-ahead while its
+ * reaction to input shows up run_ahead frames sooner. Frames nobody sees skip
+ * pixel output. */
+void emulate_frame_run_ahead(cpu_t *cpu, bool keep_audio) {
+	if (!run_ahead) {
+		emulate_frame(cpu, keep_audio);
+		return;
+	}
+
+	ppu_skip_pixels(!run_ahead_render_all);
+	emulate_frame(cpu, keep_audio);
+	nes_save_state(cpu, run_ahead_state, run_ahead_state_size);
+
+	apu_begin_speculation();
+	for (int i=0; i<run_ahead; ++i) {
+		if (i == run_ahead-1)
+			ppu_skip_pixels(false);
+		emulate_frame(cpu, false);
+	}
+	nes_load_state(cpu, run_ahead_state, run_ahead_state_size);
+	apu_end_speculation();
+}
+
+void set_turbo_speed(int speed) {
+	turbo_speed = speed;
+	turbo_start_time = get_ticks();
+	turbo_frames = 0;
+	if (speed == TURBO_UNCAPPED)
+		printf("Speed: uncapped\n");
+	else
+		printf("Speed: %dx\n", speed);
+}
+
+static void dump_audio_sink(float *samples, int count, void *userdata) {
+	wav_write((wav_writer_t *)userdata, samples, count);
+}
+
+/* Runs the emulator headless as fast as possible for the given number of
+ * frames, streaming the apu output to a WAV file. No window, audio device or
+ * frame pacing is involved. */
+int dump_audio(cpu_t *cpu, char *wav_path, int frames, int sample_rate, wav_format_t format, bool audio_thread, bool ram_only) {
+	wav_writer_t wav;
+	if (!wav_open(&wav, wav_path, sample_rate, format))
+		return 1;
+
+	uint32_t *pixels = xmalloc(PPU_WIDTH*PPU_HEIGHT*sizeof(uint32_t));
+	ppu_init(pixels);
+	ppu_skip_pixels(ram_only);
+	apu_set_sound_sink(dump_audio_sink, &wav);
+	system_reset(cpu);
+	if (audio_thread)
+		apu_start_thread();
+
+	uint64_t start = SDL_GetPerformanceCounter();
+	for (int i=0; i<frames; ++i) {
+		movie_frame(cpu);
+		emulate_frame(cpu, true);
+	}
+	double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+	apu_stop_thread();
+
+	printf("Wrote %d frames (%u samples at %d Hz) to %s\n", 
+		frames, wav.data_bytes / (format == WAV_FORMAT_F32 ? 4 : 2), sample_rate, wav_path);
+	printf("Emulated in %.3f s, %.0f fps\n", seconds, seconds > 0 ? frames / seconds : 0.0);
+	wav_close(&wav);
+	free(pixels);
+	return 0;
 }
 
 void emulation_mode_run(cpu_t *cpu) {
 	/* update */
-	if (apu_request_frame()) {
-		while (!ppu_frame_completed()) {
-			do_interrupts(cpu);
-			cpu_tick(cpu);
-			apu_tick();
-			ppu_tick(); ppu_tick(); ppu_tick();
+	int frames = 0;
+
+	// hold backspace to rewind, one frame back per presented frame. each
+	// state is shown by emulating the frame after it, without sound
+	if (platform_state.backspace && !memory_window.goto_tooltip_active) {
+		if (movie_active()) {
+			printf("Movie stopped by rewinding\n");
+			movie_close();
+		}
+		bootcache_stop();
+		if (!frame_prepared && rewind_pop(cpu)) {
+			emulate_frame(cpu, false);
+			frames = 1;
+		}
+	} else if (turbo_speed == 1) {
+		// at normal speed the sound card paces emulation
+		if (apu_request_frame()) {
+			movie_frame(cpu);
+			bootcache_frame(cpu);
+			emulate_frame_run_ahead(cpu, true);
+			rewind_push(cpu);
+			frames = 1;
+		}
+	} else {
+		// fast forward is paced by the wall clock instead. audio keeps
+		// playing in real time by only keeping the frames the sound card asks
+		// for and dropping the rest
+		uint64_t frames_due;
+		if (turbo_speed == TURBO_UNCAPPED) {
+			frames_due = 1;
+		} else {
+			uint64_t target = (get_ticks() - turbo_start_time) * 60 * turbo_speed / 1000;
+			frames_due = target > turbo_frames ? target - turbo_frames : 0;
+			if (frames_due > (uint64_t)turbo_speed) {
+				// fell behind, don't try to catch up all at once
+				frames_due = turbo_speed;
+				turbo_frames = target - frames_due;
+			}
 		}
 
-		ppu_clear_frame_completed();
-		apu_flush_sound_buffer();
+		// only the frame that gets presented is worth drawing or running
+		// ahead of
+		for (uint64_t i=0; i<frames_due; ++i) {
+			movie_frame(cpu);
+			bootcache_frame(cpu);
+			if (i == frames_due-1) {
+				emulate_frame_run_ahead(cpu, apu_request_frame());
+			} else {
+				ppu_skip_pixels(true);
+				emulate_frame(cpu, apu_request_frame());
+				ppu_skip_pixels(false);
+			}
+			rewind_push(cpu);
+			++turbo_frames;
+			++frames;
+		}
+	}
+
+	// only the latest completed frame is presented
+	if (frames) {
 		frame_prepared = true;
 
 		if (debug_window.window) {
@@ -256,6 +620,11 @@ void emulation_mode_run(cpu_t *cpu) {
 void emulation_mode_step_instruction(cpu_t *cpu) {
 	/* update */
 	if (platform_state.space && !last_platform_state.space) {
+		if (movie_active()) {
+			printf("Movie stopped by stepping instructions\n");
+			movie_close();
+		}
+		bootcache_stop();
 		do_interrupts(cpu);
 
 		do {
@@ -266,6 +635,7 @@ void emulation_mode_step_instruction(cpu_t *cpu) {
 
 		if (ppu_frame_completed()) {
 			ppu_clear_frame_completed();
+			cart_end_frame();
 			apu_flush_sound_buffer();
 		}
 		if (debug_window.window) {
@@ -278,15 +648,10 @@ void emulation_mode_step_instruction(cpu_t *cpu) {
 void emulation_mode_step_frame(cpu_t *cpu) {
 	/* update */
 	if (!frame_prepared && platform_state.f && !last_platform_state.f) {
-		while (!ppu_frame_completed()) {
-			do_interrupts(cpu);
-			cpu_tick(cpu);
-			apu_tick();
-			ppu_tick(); ppu_tick(); ppu_tick();
-		}
-
-		ppu_clear_frame_completed();
-		apu_flush_sound_buffer();
+		movie_frame(cpu);
+		bootcache_frame(cpu);
+		emulate_frame(cpu, true);
+		rewind_push(cpu);
 		frame_prepared = true;
 
 		if (debug_window.window) {
@@ -1,10 +1,31 @@
 /*
  * Each mapper must implement:
- *     uint32_t mapperXX_read(mapper_t *head, uint16_t addr)
- *     uint32_t mapperXX_write(mapper_t *head, uint16_t addr, uint8_t data)
+ *     void mapperXX_init(mapper_t *head)
+ *     void mapperXX_write(mapper_t *head, uint16_t addr, uint8_t data)
  *
- *  These functions can do any internal operation the mapper needs and must
- *  return the translated address to the actual location on the cartridge
+ *  init sets up the power on banking. write is called for every cpu write
+ *  to $8000-$FFFF and updates the mapper registers. Neither translates
+ *  addresses, instead they point the bank slots in the head at the right
+ *  parts of the cartridge memory with the map_* helpers below, and the cart
+ *  reads and writes through the slots directly.
+ *
+ * and may implement:
+ *     void mapperXX_scanline(mapper_t *head)
+ *     bool mapperXX_irq_pending(mapper_t *head)
+ *     void mapperXX_irq_clear(mapper_t *head)
+ *     void mapperXX_sync(mapper_t *head, uint64_t now, bool rendering)
+ *     uint64_t mapperXX_next_irq(mapper_t *head, bool rendering)
+ *
+ *  Mappers whose irq time can be worked out ahead implement sync and
+ *  next_irq instead of scanline. sync catches the mapper up to ppu timestamp
+ *  now, given whether rendering was enabled since the last sync, next_irq
+ *  returns the timestamp at which irq_pending will turn true, SCHED_NEVER if
+ *  it won't without a register write. The cart syncs around every register
+ *  write and rendering change, and schedules the irq, see cart_irq_event.
+ *
+ *  A mapper is added by listing its functions in mapper_registry at the
+ *  bottom of this file. make_mapper copies them into the mapper_t head, so
+ *  every call is a single indirect call.
  *
  *
  * See "How I Program C by Eskil Steenberg" for more info on the polymorphism
@@ -22,14 +43,133 @@
 typedef enum {
 	MIRROR_HORIZONTAL,
 	MIRROR_VERTICAL,
+	MIRROR_SINGLE_LOWER,
+	MIRROR_SINGLE_UPPER,
 } MirrorMode;
 
+typedef struct mapper_t mapper_t;
+
+typedef void (*mapper_write_func_t)(mapper_t *head, uint16_t addr, uint8_t data);
+typedef void (*mapper_scanline_func_t)(mapper_t *head);
+typedef bool (*mapper_irq_pending_func_t)(mapper_t *head);
+typedef void (*mapper_irq_clear_func_t)(mapper_t *head);
+typedef uint8_t (*mapper_read_func_t)(mapper_t *head, uint16_t addr);
+typedef void (*mapper_sync_func_t)(mapper_t *head, uint64_t now, bool rendering);
+typedef uint64_t (*mapper_next_irq_func_t)(mapper_t *head, bool rendering);
+
+/* The memory on the cartridge board, owned by the cart */
 typedef struct {
+    uint8_t *prg_rom;
+    uint32_t prg_rom_size;
+    uint8_t *chr;          /* chr rom, or chr ram if chr_is_ram */
+    uint32_t chr_size;
+    bool chr_is_ram;
+    uint8_t *prg_ram;      /* 8KB, NULL if the cart has none */
+} cart_memory_t;
+
+/* 
+ * What the cpu and ppu currently see of the cartridge, at a fixed
+ * granularity. A cpu read of $8000-$FFFF is prg[(addr >> 13) & 3][addr & 0x1FFF]
+ * and a ppu read of $0000-$1FFF is chr[addr >> 10][addr & 0x3FF].
+ */
+typedef struct {
+    uint8_t *prg[4];         /* 8KB each, cpu $8000-$FFFF */
+    uint8_t *chr[8];         /* 1KB each, ppu $0000-$1FFF */
+    uint8_t *prg_ram;        /* 8KB, cpu $6000-$7FFF, NULL if not present */
+    uint16_t nametable[4];   /* offset into the 2KB of ppu vram for each
+                                1KB nametable at ppu $2000-$2FFF */
+} bank_slots_t;
+
+struct mapper_t {
     uint8_t prg_banks;    /* number of 16KB prg rom banks */
     uint8_t chr_banks;    /* number of  8KB chr rom banks */
     MirrorMode mirroring; /* 0 == horizontal 1 == vertical */
     uint16_t id;          /* mapper number */
-} mapper_t;
+
+    cart_memory_t mem;
+    bank_slots_t slots;
+
+    /* set by make_mapper from mapper_registry, the optional ones default to
+     * no-ops. has_scanline and has_irq let callers skip them altogether */
+    mapper_write_func_t write;
+    mapper_scanline_func_t scanline;
+    mapper_irq_pending_func_t irq_pending;
+    mapper_irq_clear_func_t irq_clear;
+    mapper_read_func_t expansion_read;   /* $4020-$5FFF, see cart_cpu_read */
+    mapper_write_func_t expansion_write;
+    mapper_sync_func_t sync;
+    mapper_next_irq_func_t next_irq;
+    bool has_scanline;
+    bool has_irq;
+    bool has_irq_timing;  /* irq is predicted with sync and next_irq */
+    bool has_expansion;   /* claims $4020-$5FFF, otherwise it's open bus */
+};
+
+/* NOTE(shaw): nothing drives the data bus on reads of unmapped addresses, so
+ * the cpu sees the last byte that was on it. That's usually the high byte of
+ * the address, the last operand byte fetched, which is close enough for
+ * games that depend on open bus. */
+static uint8_t open_bus(uint16_t addr) {
+    return addr >> 8;
+}
+
+
+/***************************************************************************** 
+ * Banking helpers
+ *
+ * Bank numbers are in units of the bank size and wrap around the size of the
+ * memory, so banks not used by the cartridge are mirrored over banks that are.
+ ****************************************************************************/
+static void
+map_prg_8k(mapper_t *head, int slot, uint32_t bank) {
+    uint32_t count = head->mem.prg_rom_size / _8KB;
+    head->slots.prg[slot] = head->mem.prg_rom + (bank % count) * _8KB;
+}
+
+static void
+map_prg_16k(mapper_t *head, int slot, uint32_t bank) {
+    map_prg_8k(head, 2*slot,   2*bank);
+    map_prg_8k(head, 2*slot+1, 2*bank+1);
+}
+
+static void
+map_prg_32k(mapper_t *head, uint32_t bank) {
+    map_prg_16k(head, 0, 2*bank);
+    map_prg_16k(head, 1, 2*bank+1);
+}
+
+static void
+map_chr_1k(mapper_t *head, int slot, uint32_t bank) {
+    uint32_t count = head->mem.chr_size / _KB;
+    head->slots.chr[slot] = head->mem.chr + (bank % count) * _KB;
+}
+
+static void
+map_chr_4k(mapper_t *head, int slot, uint32_t bank) {
+    for (int i=0; i<4; ++i)
+        map_chr_1k(head, 4*slot + i, 4*bank + i);
+}
+
+static void
+map_chr_8k(mapper_t *head, uint32_t bank) {
+    map_chr_4k(head, 0, 2*bank);
+    map_chr_4k(head, 1, 2*bank+1);
+}
+
+static void
+set_mirroring(mapper_t *head, MirrorMode mirroring) {
+    static const uint16_t layouts[4][4] = {
+        [MIRROR_HORIZONTAL]   = { 0x000, 0x000, 0x400, 0x400 },
+        [MIRROR_VERTICAL]     = { 0x000, 0x400, 0x000, 0x400 },
+        [MIRROR_SINGLE_LOWER] = { 0x000, 0x000, 0x000, 0x000 },
+        [MIRROR_SINGLE_UPPER] = { 0x400, 0x400, 0x400, 0x400 },
+    };
+    head->mirroring = mirroring;
+    memcpy(head->slots.nametable, layouts[mirroring], sizeof(head->slots.nametable));
+}
+
+static uint32_t last_prg_16k(mapper_t *head) { return head->mem.prg_rom_size / _16KB - 1; }
+static uint32_t last_prg_8k(mapper_t *head)  { return head->mem.prg_rom_size / _8KB - 1; }
 
 
 /***************************************************************************** 
@@ -39,43 +179,17 @@ typedef struct {
     mapper_t head;
 } mapper0_t;
 
-static uint32_t
-mapper0_map_addr(mapper_t *head, uint16_t addr) {
-    if (addr < 0x2000) 
-        return addr;
-
-    /* horizontal and vertical nametable mirroring */
-    else if (addr < 0x3F00) {
-        uint32_t mapped_addr = addr & 0x0FFF;
-        if (head->mirroring == MIRROR_VERTICAL)
-            return mapped_addr & 0x07FF;
-        else {
-            return (mapped_addr < 0x0800)
-                ? (mapped_addr & 0x03FF)
-                : ((mapped_addr-0x0800) & 0x03FF) + 0x0400;
-        }
-    } 
-
-    else if (addr < 0x6000) 
-        return addr;
-    else if (addr < 0x8000) /* $6000 - $7FFF */
-        return addr - 0x6000;
-    else if (addr < 0xC000) /* $8000 - $BFFF */
-        return addr - 0x8000;
-    else                    /* $C000 - $FFFF */
-        /* mirror the first 16KB of prg_rom if NROM-128 */
-        return head->prg_banks == 1 ? addr - 0xC000 : addr - 0x8000;
-}
-
-static uint32_t 
-mapper0_read(mapper_t *head, uint16_t addr) {
-    return mapper0_map_addr(head, addr);
+static void
+mapper0_init(mapper_t *head) {
+    /* mirror the first 16KB of prg_rom if NROM-128 */
+    map_prg_16k(head, 0, 0);
+    map_prg_16k(head, 1, last_prg_16k(head));
+    map_chr_8k(head, 0);
 }
 
-static uint32_t 
+static void
 mapper0_write(mapper_t *head, uint16_t addr, uint8_t data) {
-    (void)data;
-    return mapper0_map_addr(head, addr);
+    (void)head; (void)addr; (void)data;
 }
 
 /***************************************************************************** 
@@ -84,152 +198,96 @@ mapper0_write(mapper_t *head, uint16_t addr, uint8_t data) {
 typedef struct {
     mapper_t head;
     uint8_t shift_reg;
+    uint8_t shift_count;
     uint8_t control; 
     uint8_t chr_bank0;
     uint8_t chr_bank1;
     uint8_t prg_bank;
 } mapper1_t;
 
-static uint32_t
-mapper1_map_addr(mapper_t *head, uint16_t addr) {
+static void
+mapper1_update_banks(mapper_t *head) {
     mapper1_t *mapper = (mapper1_t *)head;
 
-    if (addr < 0x2000) { 
-        // CHR ROM bank mode
-        if ((mapper->control >> 4) & 1) {
+    // CHR ROM bank mode, banks are in 4KB units
+    if ((mapper->control >> 4) & 1) {
         //switch two separate 4KB banks
-            if (addr < 0x1000)
-                return addr + mapper->chr_bank0 * _4KB;
-            else 
-                return (addr - 0x1000) + mapper->chr_bank1 * _4KB; // TODO(shaw): make sure this is correct
-        } else {
-        //switch 8KB at a time
-            return addr + mapper->chr_bank0 * _8KB;
-        }
+        map_chr_4k(head, 0, mapper->chr_bank0);
+        map_chr_4k(head, 1, mapper->chr_bank1);
+    } else {
+        //switch 8KB at a time, ignoring low bit of bank number
+        map_chr_8k(head, mapper->chr_bank0 >> 1);
     }
 
     // nametable mirroring
-    else if (addr < 0x3F00) {
-        uint32_t mapped_addr = addr & 0x0FFF;
-        uint8_t mirror_mode = mapper->control & 0x3;
-
-        switch (mirror_mode) {
-        case 0: // one-screen, lower bank
-            return mapped_addr & 0x03FF;
-        case 1: // one-screen, upper bank
-            return (mapped_addr & 0x03FF) + 0x0400;
-        case 2: // vertical
-            return mapped_addr & 0x07FF;
-        case 3: // horizontal
-            return mapped_addr < 0x0800
-                ? mapped_addr & 0x03FF
-                : ((mapped_addr-0x0800) & 0x03FF) + 0x0400;
-        default:
-            assert(0 && "unknown mirror mode");
-			return 0;
-        }
-    } 
-
-    else if (addr < 0x6000) 
-        return addr;
-    else if (addr < 0x8000)   /* $6000 - $7FFF */
-        return addr - 0x6000;
-
-    // first 16KB bank (or 32KB if in that mode)
-    else if (addr < 0xC000) { /* $8000 - $BFFF */
-        uint8_t prg_bank_mode = (mapper->control >> 2) & 0x3;
-        switch (prg_bank_mode) {
-            case 0:
-            case 1: // switch 32 KB at $8000, ignoring low bit of bank number
-            {
-                uint8_t prg_bank = mapper->prg_bank & 0x0F;
-                return (addr - 0x8000) + (prg_bank * _32KB);
-            }
-            case 2: // fix first bank at $8000 
-                return (addr - 0x8000);
-            case 3: // switch 16 KB bank at $8000
-            {
-                uint8_t prg_bank = mapper->prg_bank & 0x0F;
-                return (addr - 0x8000) + (prg_bank * _16KB);
-            }
-            default:
-                assert(0 && "unknown prg_bank_mode");
-                return 0;
-        }
-    }
-
-    // second 16KB bank (or 32KB if in that mode)
-    else { /* $C000 - $FFFF */
-        uint8_t prg_bank_mode = (mapper->control >> 2) & 0x3;
-        switch (prg_bank_mode) {
-            case 0:
-            case 1: // switch 32 KB at $8000, ignoring low bit of bank number
-            {
-                uint8_t prg_bank = mapper->prg_bank & 0x0F;
-                return (addr - 0x8000) + (prg_bank * _32KB);
-            }
-            case 2: // switch 16 KB bank at $C000
-            {
-                uint8_t prg_bank = mapper->prg_bank & 0x0F;
-                return (addr - 0xC000) + (prg_bank * _16KB);
-            }
-            case 3: // fix last bank at $C000
-                return (addr - 0xC000) + ((head->prg_banks-1) * _16KB);
-            default:
-                assert(0 && "unknown prg_bank_mode");
-				return 0;
-        }
+    static const MirrorMode mirror_modes[4] = {
+        MIRROR_SINGLE_LOWER, MIRROR_SINGLE_UPPER, MIRROR_VERTICAL, MIRROR_HORIZONTAL
+    };
+    set_mirroring(head, mirror_modes[mapper->control & 0x3]);
+
+    uint8_t prg_bank = mapper->prg_bank & 0x0F;
+    uint8_t prg_bank_mode = (mapper->control >> 2) & 0x3;
+    switch (prg_bank_mode) {
+        case 0:
+        case 1: // switch 32 KB at $8000, ignoring low bit of bank number
+            map_prg_32k(head, prg_bank >> 1);
+            break;
+        case 2: // fix first bank at $8000, switch 16 KB bank at $C000
+            map_prg_16k(head, 0, 0);
+            map_prg_16k(head, 1, prg_bank);
+            break;
+        case 3: // switch 16 KB bank at $8000, fix last bank at $C000
+            map_prg_16k(head, 0, prg_bank);
+            map_prg_16k(head, 1, last_prg_16k(head));
+            break;
     }
 }
 
-static uint32_t 
-mapper1_read(mapper_t *head, uint16_t addr) {
-    return mapper1_map_addr(head, addr);
+static void
+mapper1_init(mapper_t *head) {
+    mapper1_update_banks(head);
 }
 
-static uint32_t 
+static void
 mapper1_write(mapper_t *head, uint16_t addr, uint8_t data) {
-    static uint8_t shift_count = 0;
-    if (addr >= 0x8000) {
-        mapper1_t *mapper = (mapper1_t *)head;
+    mapper1_t *mapper = (mapper1_t *)head;
 
-        if ((data >> 7) & 1) {
-            // clear shift register to its initial state
-            mapper->shift_reg = 0;
-            shift_count = 0;
-
-            // set 16k PRG mode, $8000 swappable
-            // NOTE(shaw): Disch includes this in his mapper notes, but I can't
-            // find it on the nesdev wiki anywhere. I am inclined to believe
-            // Disch though.
-            // https://www.romhacking.net/download/documents/362/
-            mapper->control |= 0xC;
-        } else {
-            // shift bit 0 of data into shift register
-            mapper->shift_reg = (mapper->shift_reg & 0x1F) | ((data & 1) << 5);
-            mapper->shift_reg >>= 1;
-            ++shift_count;
-
-            // on fifth write, copy to an internal register
-            if (shift_count == 5) {
-
-                if (addr < 0xA000) {         // $8000 - $9FFF
-                    mapper->control = mapper->shift_reg;
-                } else if (addr < 0xC000) {  // $A000 - $BFFF
-                    mapper->chr_bank0 = mapper->shift_reg;
-                } else if (addr < 0xE000) {  // $C000 - $DFFF
-                    mapper->chr_bank1 = mapper->shift_reg;
-                } else {                     // $E000 - $FFFF
-                    mapper->prg_bank = mapper->shift_reg;
-                }
-
-                mapper->shift_reg = 0;
-                shift_count = 0;
+    if ((data >> 7) & 1) {
+        // clear shift register to its initial state
+        mapper->shift_reg = 0;
+        mapper->shift_count = 0;
+
+        // set 16k PRG mode, $8000 swappable
+        // NOTE(shaw): Disch includes this in his mapper notes, but I can't
+        // find it on the nesdev wiki anywhere. I am inclined to believe
+        // Disch though.
+        // https://www.romhacking.net/download/documents/362/
+        mapper->control |= 0xC;
+        mapper1_update_banks(head);
+    } else {
+        // shift bit 0 of data into shift register
+        mapper->shift_reg = (mapper->shift_reg & 0x1F) | ((data & 1) << 5);
+        mapper->shift_reg >>= 1;
+        ++mapper->shift_count;
+
+        // on fifth write, copy to an internal register
+        if (mapper->shift_count == 5) {
+
+            if (addr < 0xA000) {         // $8000 - $9FFF
+                mapper->control = mapper->shift_reg;
+            } else if (addr < 0xC000) {  // $A000 - $BFFF
+                mapper->chr_bank0 = mapper->shift_reg;
+            } else if (addr < 0xE000) {  // $C000 - $DFFF
+                mapper->chr_bank1 = mapper->shift_reg;
+            } else {                     // $E000 - $FFFF
+                mapper->prg_bank = mapper->shift_reg;
             }
+
+            mapper->shift_reg = 0;
+            mapper->shift_count = 0;
+            mapper1_update_banks(head);
         }
     }
-
-    return mapper1_map_addr(head, addr);
 }
 
 
@@ -243,47 +301,20 @@ typedef struct {
     uint8_t prg_bank; // mapper2 has up to 4096K of bank switchable prg rom
 } mapper2_t;
 
-static uint32_t
-mapper2_map_addr(mapper_t *head, uint16_t addr) {
-    mapper2_t *mapper = (mapper2_t *)head;
+static void
+mapper2_init(mapper_t *head) {
+    map_prg_16k(head, 0, 0);
+    /* fixed to the last bank */
+    map_prg_16k(head, 1, last_prg_16k(head));
+    map_chr_8k(head, 0);
+}
 
-    if (addr < 0x2000) 
-        return addr;
-
-    /* horizontal and vertical nametable mirroring */
-    else if (addr < 0x3F00) {
-        uint32_t mapped_addr = addr & 0x0FFF;
-        if (head->mirroring == MIRROR_VERTICAL)
-            return mapped_addr & 0x07FF;
-        else
-            return mapped_addr < 0x0800
-                ? mapped_addr & 0x03FF
-                : ((mapped_addr-0x0800) & 0x03FF) + 0x0400;
-    } 
-
-    else if (addr < 0x6000) 
-        return addr;
-    else if (addr < 0x8000) /* $6000 - $7FFF */
-        return addr - 0x6000;
-    else if (addr < 0xC000) /* $8000 - $BFFF */
-        return (addr - 0x8000) + (mapper->prg_bank * _16KB);
-    else                    /* $C000 - $FFFF */
-        /* fixed to the last bank */
-        return (addr - 0xC000) + ((head->prg_banks-1) * _16KB);
-}
-
-static uint32_t 
-mapper2_read(mapper_t *head, uint16_t addr) {
-    return mapper2_map_addr(head, addr);
-}
-
-static uint32_t 
+static void
 mapper2_write(mapper_t *head, uint16_t addr, uint8_t data) {
-    if (addr >= 0x8000) {
-        mapper2_t *mapper = (mapper2_t *)head;
-        mapper->prg_bank = data;
-    }
-    return mapper2_map_addr(head, addr);
+    (void)addr;
+    mapper2_t *mapper = (mapper2_t *)head;
+    mapper->prg_bank = data;
+    map_prg_16k(head, 0, mapper->prg_bank);
 }
 
 
@@ -296,52 +327,23 @@ typedef struct {
     uint8_t chr_bank; // mapper 3 has up to 2048K of bank switchable CHR rom
 } mapper3_t;
 
-static uint32_t
-mapper3_map_addr(mapper_t *head, uint16_t addr) {
-    mapper3_t *mapper = (mapper3_t *)head;
-
-    if (addr < 0x2000) {
-        // ppu bank switchable chr rom
-        // NOTE(shaw): banks not used by the cartridge are mirrored over banks
-        // that are used
-        return addr + ((mapper->chr_bank % head->chr_banks) * _8KB);
-    }
+static void
+mapper3_init(mapper_t *head) {
+    /* mirror the first 16KB of prg_rom if PRG ROM capacity is 16KB */
+    map_prg_16k(head, 0, 0);
+    map_prg_16k(head, 1, last_prg_16k(head));
+    map_chr_8k(head, 0);
+}
 
-    /* horizontal and vertical nametable mirroring */
-    else if (addr < 0x3F00) {
-        uint32_t mapped_addr = addr & 0x0FFF;
-        if (head->mirroring == MIRROR_VERTICAL)
-            return mapped_addr & 0x07FF;
-        else
-            return mapped_addr < 0x0800
-                ? mapped_addr & 0x03FF
-                : ((mapped_addr-0x0800) & 0x03FF) + 0x0400;
-        return addr;
-    } 
-
-    else if (addr < 0x6000) 
-        return addr;
-    else if (addr < 0x8000) /* $6000 - $7FFF */
-        return addr - 0x6000;
-    else if (addr < 0xC000) /* $8000 - $BFFF */
-        return (addr - 0x8000);
-    else                    /* $C000 - $FFFF */
-        /* mirror the first 16KB of prg_rom if PRG ROM capacity is 16KB */
-        return head->prg_banks == 1 ? addr - 0xC000 : addr - 0x8000;
-}
-
-static uint32_t 
-mapper3_read(mapper_t *head, uint16_t addr) {
-    return mapper3_map_addr(head, addr);
-}
-
-static uint32_t 
+static void
 mapper3_write(mapper_t *head, uint16_t addr, uint8_t data) {
-    if (addr >= 0x8000) {
-        mapper3_t *mapper = (mapper3_t *)head;
-        mapper->chr_bank = data;
-    }
-    return mapper3_map_addr(head, addr);
+    (void)addr;
+    mapper3_t *mapper = (mapper3_t *)head;
+    mapper->chr_bank = data;
+    // ppu bank switchable chr rom
+    // NOTE(shaw): banks not used by the cartridge are mirrored over banks
+    // that are used
+    map_chr_8k(head, mapper->chr_bank);
 }
 
 
@@ -365,14 +367,13 @@ typedef struct {
     mapper_t head;
     uint8_t bank_select; 
 	uint8_t bank_regs[8];
-	uint32_t prg_bank[4];
-	uint32_t chr_bank[8];
 	uint8_t prg_bank_mode;
 	uint8_t chr_inversion;
 	uint8_t irq_counter;
 	uint8_t irq_load;
 	bool irq_enabled;
 	bool irq_pending;
+	uint64_t synced_at;  // ppu timestamp the irq counter is up to date with
 
 	// NOTE: Though these bits are functional on the MMC3, their main purpose
 	// is to write-protect save RAM during power-off. Many emulators choose not
@@ -382,110 +383,59 @@ typedef struct {
 	bool prg_ram_enable;
 } mapper4_t;
 
-static uint32_t
-mapper4_map_addr(mapper_t *head, uint16_t addr) {
+static void
+mapper4_update_banks(mapper_t *head) {
+	mapper4_t *mapper = (mapper4_t *)head;
+
+	// CHR Banks, in 1KB units
+	int lo = mapper->chr_inversion ? 4 : 0; // 2KB banks
+	int hi = mapper->chr_inversion ? 0 : 4; // 1KB banks
+	map_chr_1k(head, lo+0, mapper->bank_regs[0] & 0xFE);
+	map_chr_1k(head, lo+1, mapper->bank_regs[0] | 1);
+	map_chr_1k(head, lo+2, mapper->bank_regs[1] & 0xFE);
+	map_chr_1k(head, lo+3, mapper->bank_regs[1] | 1);
+	map_chr_1k(head, hi+0, mapper->bank_regs[2]);
+	map_chr_1k(head, hi+1, mapper->bank_regs[3]);
+	map_chr_1k(head, hi+2, mapper->bank_regs[4]);
+	map_chr_1k(head, hi+3, mapper->bank_regs[5]);
+
+	// PRG Banks, in 8KB units
+	uint32_t last = last_prg_8k(head);
+	uint32_t second_last = last - 1;
+
+	if (mapper->prg_bank_mode) {
+		map_prg_8k(head, 0, second_last);
+		map_prg_8k(head, 1, mapper->bank_regs[7] & 0x3F);
+		map_prg_8k(head, 2, mapper->bank_regs[6] & 0x3F);
+		map_prg_8k(head, 3, last);
+	} else {
+		map_prg_8k(head, 0, mapper->bank_regs[6] & 0x3F);
+		map_prg_8k(head, 1, mapper->bank_regs[7] & 0x3F);
+		map_prg_8k(head, 2, second_last);
+		map_prg_8k(head, 3, last);
+	}
+}
+
+static void
+mapper4_init(mapper_t *head) {
     mapper4_t *mapper = (mapper4_t *)head;
+	mapper->bank_regs[7] = 1;
+	mapper4_update_banks(head);
+}
 
-	// CHR Banks
-	if (addr < 0x0400)                               // $0000-$03FF
-		return mapper->chr_bank[0] + (addr & 0x03FF);
-	else if (addr < 0x0800)                          // $0400-$07FF
-		return mapper->chr_bank[1] + (addr & 0x03FF);
-	else if (addr < 0x0C00)                          // $0800-$0BFF
-		return mapper->chr_bank[2] + (addr & 0x03FF);
-	else if (addr < 0x1000)                          // $0C00-$0FFF
-		return mapper->chr_bank[3] + (addr & 0x03FF);
-	else if (addr < 0x1400)                          // $1000-$13FF
-		return mapper->chr_bank[4] + (addr & 0x03FF);
-	else if (addr < 0x1800)                          // $1400-$17FF
-		return mapper->chr_bank[5] + (addr & 0x03FF);
-	else if (addr < 0x1C00)                          // $1800-$1BFF
-		return mapper->chr_bank[6] + (addr & 0x03FF);
-	else if (addr < 0x2000)                          // $1C00-$1FFF
-		return mapper->chr_bank[7] + (addr & 0x03FF);
-
-    /* horizontal and vertical nametable mirroring */
-	else if (addr < 0x3F00) {
-        uint32_t mapped_addr = addr & 0x0FFF;
-        if (head->mirroring == MIRROR_VERTICAL)
-            return mapped_addr & 0x07FF;
-        else
-            return mapped_addr < 0x0800
-                ? mapped_addr & 0x03FF
-                : ((mapped_addr-0x0800) & 0x03FF) + 0x0400;
-    } 
-
-    else if (addr < 0x6000) 
-        return addr;
-    else if (addr < 0x8000) // $6000-$7FFF 
-        return addr & 0x1FFF;
-
-	// PRG Banks
-    else if (addr < 0xA000)                          // $8000-$9FFF
-		return mapper->prg_bank[0] + (addr & 0x1FFF);
-    else if (addr < 0xC000)                          // $A000-$BFFF
-		return mapper->prg_bank[1] + (addr & 0x1FFF);
-    else if (addr < 0xE000)                          // $C000-$DFFF
-		return mapper->prg_bank[2] + (addr & 0x1FFF);
-    else                                             // $E000-$FFFF
-		return mapper->prg_bank[3] + (addr & 0x1FFF);
-}
-
-static uint32_t 
-mapper4_read(mapper_t *head, uint16_t addr) {
-    return mapper4_map_addr(head, addr);
-}
-
-static uint32_t 
+static void
 mapper4_write(mapper_t *head, uint16_t addr, uint8_t data) {
 	mapper4_t *mapper = (mapper4_t *)head;
 
-	if (addr < 0x8000) {
-		// do nothing
-	} else if (addr < 0xA000) { // $8000-$9FFF
+	if (addr < 0xA000) { // $8000-$9FFF
 		if (addr & 1) { // odd
 			mapper->bank_regs[mapper->bank_select] = data;
-
-			if (mapper->chr_inversion) {
-				mapper->chr_bank[0] = mapper->bank_regs[2] * _KB;
-				mapper->chr_bank[1] = mapper->bank_regs[3] * _KB;
-				mapper->chr_bank[2] = mapper->bank_regs[4] * _KB;
-				mapper->chr_bank[3] = mapper->bank_regs[5] * _KB;
-				mapper->chr_bank[4] = (mapper->bank_regs[0] & 0xFE) * _KB;
-				mapper->chr_bank[5] = (mapper->bank_regs[0] + 1)    * _KB;
-				mapper->chr_bank[6] = (mapper->bank_regs[1] & 0xFE) * _KB;
-				mapper->chr_bank[7] = (mapper->bank_regs[1] + 1)    * _KB;
-			} else {
-				mapper->chr_bank[0] = (mapper->bank_regs[0] & 0xFE) * _KB;
-				mapper->chr_bank[1] = (mapper->bank_regs[0] + 1)    * _KB;
-				mapper->chr_bank[2] = (mapper->bank_regs[1] & 0xFE) * _KB;
-				mapper->chr_bank[3] = (mapper->bank_regs[1] + 1)    * _KB;
-				mapper->chr_bank[4] = mapper->bank_regs[2] * _KB;
-				mapper->chr_bank[5] = mapper->bank_regs[3] * _KB;
-				mapper->chr_bank[6] = mapper->bank_regs[4] * _KB;
-				mapper->chr_bank[7] = mapper->bank_regs[5] * _KB;
-			}
-
-			// last and second last prg banks (in 8KB chunks)
-			uint8_t last = head->prg_banks*2 - 1;
-			uint8_t second_last = last - 1;
-
-			if (mapper->prg_bank_mode) {
-				mapper->prg_bank[0] = second_last * _8KB;
-				mapper->prg_bank[1] = (mapper->bank_regs[7] & 0x3F) * _8KB;
-				mapper->prg_bank[2] = (mapper->bank_regs[6] & 0x3F) * _8KB;
-				mapper->prg_bank[3] = last * _8KB;
-			} else {
-				mapper->prg_bank[0] = (mapper->bank_regs[6] & 0x3F) * _8KB;
-				mapper->prg_bank[1] = (mapper->bank_regs[7] & 0x3F) * _8KB;
-				mapper->prg_bank[2] = second_last * _8KB;
-				mapper->prg_bank[3] = last * _8KB;
-			}
 		} else { // even
 			mapper->bank_select = data & 0x7;
 			mapper->prg_bank_mode = (data >> 6) & 1;
 			mapper->chr_inversion = (data >> 7) & 1;
 		}
+		mapper4_update_banks(head);
 
 	} else if (addr < 0xC000) { // $A000-$BFFF
 		if (addr & 1) { // odd
@@ -497,7 +447,7 @@ mapper4_write(mapper_t *head, uint16_t addr, uint8_t data) {
 			// to avoid an incompatibility with the MMC6.
 
 		} else { //even
-			head->mirroring = (data & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL;
+			set_mirroring(head, (data & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
 			// NOTE: This bit has no effect on cartridges with hardwired
 			// 4-screen VRAM. In the iNES and NES 2.0 formats, this can be
 			// identified through bit 3 of byte $06 of the header.
@@ -517,17 +467,16 @@ mapper4_write(mapper_t *head, uint16_t addr, uint8_t data) {
 			mapper->irq_pending = false;
 		}
 	}
-
-    return mapper4_map_addr(head, addr);
 }
 
-void mapper4_scanline(mapper_t *head) {
-    mapper4_t *mapper = (mapper4_t *)head;
-	if (mapper->irq_counter > 0)
-		--mapper->irq_counter;
-	else 
-		mapper->irq_counter = mapper->irq_load;
+/* Clocks the irq counter as if n scanlines went by */
+static void 
+mapper4_clock(mapper4_t *mapper, uint64_t n) {
+	if (n == 0) return;
 
+	// each clock decrements the counter, or reloads it when it's 0, and the
+	// irq fires whenever it is 0 after that
+	//
 	// NOTE(shaw): this check must happen AFTER decrementing/reloading
 	//
 	// FUCKING THANK YOU BLARGG!! for pointing this out in your mmc3 test roms
@@ -536,17 +485,56 @@ void mapper4_scanline(mapper_t *head) {
 	// TODO(shaw): blargg also says: "The IRQ flag is not set when the counter is cleared by writing to $C001"
 	// so i need to look into that, currently there is no differentiation
 	// between counter reaching zero by clocking and by a write to $C001
-	if (mapper->irq_counter == 0 && mapper->irq_enabled)
+	if (mapper->irq_counter > 0) {
+		if (n < mapper->irq_counter) {
+			mapper->irq_counter -= n;
+			return;
+		}
+		n -= mapper->irq_counter;
+		mapper->irq_counter = 0;
+		if (mapper->irq_enabled)
+			mapper->irq_pending = true;
+	}
+
+	// from 0 it takes irq_load + 1 clocks to get back to 0: one to reload
+	// and irq_load to count down
+	uint64_t period = (uint64_t)mapper->irq_load + 1;
+	if (n >= period && mapper->irq_enabled)
 		mapper->irq_pending = true;
+	uint64_t rest = n % period;
+	mapper->irq_counter = rest ? mapper->irq_load - (uint8_t)(rest - 1) : 0;
 }
 
+static void
+mapper4_sync(mapper_t *head, uint64_t now, bool rendering) {
+	mapper4_t *mapper = (mapper4_t *)head;
+	// the counter is clocked by the ppu fetching sprite tiles, so only while
+	// rendering
+	if (rendering)
+		mapper4_clock(mapper, ppu_scanline_clocks_before(now) - ppu_scanline_clocks_before(mapper->synced_at));
+	mapper->synced_at = now;
+}
 
-bool mapper4_irq_pending(mapper_t *head) {
+static uint64_t
+mapper4_next_irq(mapper_t *head, bool rendering) {
+	mapper4_t *mapper = (mapper4_t *)head;
+	if (!rendering || !mapper->irq_enabled)
+		return SCHED_NEVER;
+	uint64_t clocks = mapper->irq_counter > 0 ? mapper->irq_counter : (uint64_t)mapper->irq_load + 1;
+	uint64_t clock = ppu_scanline_clocks_before(mapper->synced_at) + clocks - 1;
+	// the flag is set during the dot, so it is seen from the next one
+	return ppu_scanline_clock_time(clock) + 1;
+}
+
+
+static bool 
+mapper4_irq_pending(mapper_t *head) {
     mapper4_t *mapper = (mapper4_t *)head;
 	return mapper->irq_pending;
 }
 
-void mapper4_irq_clear(mapper_t *head) {
+static void 
+mapper4_irq_clear(mapper_t *head) {
     mapper4_t *mapper = (mapper4_t *)head;
 	mapper->irq_pending = false;
 }
@@ -587,44 +575,62 @@ typedef struct {
                  // up to 512K roms
 } mapper7_t;
 
-static uint32_t
-mapper7_map_addr(mapper_t *head, uint16_t addr) {
+static void
+mapper7_update_banks(mapper_t *head) {
     mapper7_t *mapper = (mapper7_t *)head;
+    map_prg_32k(head, mapper->reg & 0xF);
+    set_mirroring(head, ((mapper->reg >> 4) & 1) ? MIRROR_SINGLE_UPPER : MIRROR_SINGLE_LOWER);
+}
 
-    if (addr < 0x2000)
-        return addr;
+static void
+mapper7_init(mapper_t *head) {
+    mapper7_update_banks(head);
+    map_chr_8k(head, 0);
+}
 
-    // nametable mirroring
-    else if (addr < 0x3F00) {
-        uint32_t mapped_addr = addr & 0x0FFF;
-        if ((mapper->reg >> 4) & 1)
-            return (mapped_addr & 0x03FF) + 0x0400; // one-screen, upper bank
-        else
-            return mapped_addr & 0x03FF;            // one-screen, lower bank
-    } 
-
-    else if (addr < 0x6000)
-        return addr;
-    else if (addr < 0x8000) /* $6000 - $7FFF */
-        return addr - 0x6000;
-    else {                  /* $8000 - $FFFF */
-        uint8_t prg_bank = (mapper->reg & 0xF) % (head->prg_banks/2);
-        return (addr - 0x8000) + (prg_bank * _32KB);
-    }
+static void
+mapper7_write(mapper_t *head, uint16_t addr, uint8_t data) {
+    (void)addr;
+    mapper7_t *mapper = (mapper7_t *)head;
+    mapper->reg = data;
+    mapper7_update_banks(head);
 }
 
-static uint32_t 
-mapper7_read(mapper_t *head, uint16_t addr) {
-    return mapper7_map_addr(head, addr);
+
+/***************************************************************************** 
+ * MAPPER 79 (AVE NINA-03/NINA-06)
+ *
+ * One register in the expansion area, at $4100-$5FFF wherever A8 is set and
+ * mirrored every 512 bytes:
+ * 7  bit  0
+ * ---- ----
+ * xxxx PCCC
+ *      ||||
+ *      |+++- select 8 KB CHR ROM bank for PPU $0000-$1FFF
+ *      +---- select 32 KB PRG ROM bank for CPU $8000-$FFFF
+ *
+ * Mirroring is hardwired. https://www.nesdev.org/wiki/NINA-003-006
+ ****************************************************************************/
+typedef struct {
+    mapper_t head;
+} mapper79_t;
+
+static void
+mapper79_init(mapper_t *head) {
+    map_prg_32k(head, 0);
+    map_chr_8k(head, 0);
 }
 
-static uint32_t 
-mapper7_write(mapper_t *head, uint16_t addr, uint8_t data) {
-    if (addr >= 0x8000) {
-        mapper7_t *mapper = (mapper7_t *)head;
-        mapper->reg = data;
-    }
-    return mapper7_map_addr(head, addr);
+static void
+mapper79_write(mapper_t *head, uint16_t addr, uint8_t data) {
+    (void)head; (void)addr; (void)data;
+}
+
+static void
+mapper79_expansion_write(mapper_t *head, uint16_t addr, uint8_t data) {
+    if ((addr & 0xE100) != 0x4100) return;
+    map_prg_32k(head, (data >> 3) & 1);
+    map_chr_8k(head, data & 7);
 }
 
 
@@ -632,113 +638,197 @@ mapper7_write(mapper_t *head, uint16_t addr, uint8_t data) {
 
 
 /***************************************************************************** 
- * External API
+ * Registry
  ****************************************************************************/
-mapper_t *make_mapper(uint16_t mapper_id, uint8_t prg_banks, uint8_t chr_banks, uint8_t mirroring) {
-    mapper_t *mapper;
+typedef struct {
+    uint16_t id;
+    size_t size;                       /* sizeof(mapperXX_t) */
+    void (*init)(mapper_t *head);
+    mapper_write_func_t write;
+    mapper_scanline_func_t scanline;   /* optional */
+    mapper_irq_pending_func_t irq_pending; /* optional, along with irq_clear */
+    mapper_irq_clear_func_t irq_clear;
+    mapper_read_func_t expansion_read;   /* optional, $4020-$5FFF */
+    mapper_write_func_t expansion_write; /* optional, $4020-$5FFF */
+    mapper_sync_func_t sync;             /* optional, along with next_irq */
+    mapper_next_irq_func_t next_irq;
+} mapper_desc_t;
+
+static const mapper_desc_t mapper_registry[] = {
+    { .id = 0, .size = sizeof(mapper0_t), .init = mapper0_init, .write = mapper0_write },
+    { .id = 1, .size = sizeof(mapper1_t), .init = mapper1_init, .write = mapper1_write },
+    { .id = 2, .size = sizeof(mapper2_t), .init = mapper2_init, .write = mapper2_write },
+    { .id = 3, .size = sizeof(mapper3_t), .init = mapper3_init, .write = mapper3_write },
+    { .id = 4, .size = sizeof(mapper4_t), .init = mapper4_init, .write = mapper4_write,
+      .irq_pending = mapper4_irq_pending, .irq_clear = mapper4_irq_clear,
+      .sync = mapper4_sync, .next_irq = mapper4_next_irq },
+    { .id = 7, .size = sizeof(mapper7_t), .init = mapper7_init, .write = mapper7_write },
+    { .id = 79, .size = sizeof(mapper79_t), .init = mapper79_init, .write = mapper79_write,
+      .expansion_write = mapper79_expansion_write },
+};
+
+static void mapper_nop(mapper_t *head) { (void)head; }
+static bool mapper_no_irq(mapper_t *head) { (void)head; return false; }
+static uint8_t mapper_open_bus(mapper_t *head, uint16_t addr) { (void)head; return open_bus(addr); }
+static void mapper_no_sync(mapper_t *head, uint64_t now, bool rendering) { (void)head; (void)now; (void)rendering; }
+static uint64_t mapper_no_next_irq(mapper_t *head, bool rendering) { (void)head; (void)rendering; return SCHED_NEVER; }
+static void mapper_ignore_write(mapper_t *head, uint16_t addr, uint8_t data) { (void)head; (void)addr; (void)data; }
+
+static const mapper_desc_t *find_mapper_desc(uint16_t mapper_id) {
+    for (size_t i=0; i<sizeof(mapper_registry)/sizeof(mapper_registry[0]); ++i)
+        if (mapper_registry[i].id == mapper_id)
+            return &mapper_registry[i];
+    return NULL;
+}
 
-    switch(mapper_id) {
-        case 0: {
-            mapper0_t *mapper0 = calloc(1, sizeof(mapper0_t));
-            mapper = (mapper_t *)mapper0;
-            break;
-        }
-        case 1: {
-            mapper1_t *mapper1 = calloc(1, sizeof(mapper1_t));
-            mapper = (mapper_t *)mapper1;
-            break;
-        }
-        case 2: {
-            mapper2_t *mapper2 = calloc(1, sizeof(mapper2_t));
-            mapper = (mapper_t *)mapper2;
-            break;
-        }
-        case 3: {
-            mapper3_t *mapper3 = calloc(1, sizeof(mapper3_t));
-            mapper = (mapper_t *)mapper3;
-            break;
-        }
-        case 4: {
-            mapper4_t *mapper4 = calloc(1, sizeof(mapper4_t));
 
-			uint8_t last = prg_banks*2 - 1;
-			uint8_t second_last = last - 1;
+/***************************************************************************** 
+ * External API
+ ****************************************************************************/
+bool mapper_supported(uint16_t mapper_id) {
+    return find_mapper_desc(mapper_id) != NULL;
+}
 
-			mapper4->prg_bank[0] = 0;
-			mapper4->prg_bank[1] = _8KB;
-			mapper4->prg_bank[2] = second_last * _8KB;
-			mapper4->prg_bank[3] = last * _8KB;
-            mapper = (mapper_t *)mapper4;
-            break;
-		}
-        case 7: {
-            mapper7_t *mapper7 = calloc(1, sizeof(mapper7_t));
-            mapper = (mapper_t *)mapper7;
-            break;
-        }
-        default:
-            fprintf(stderr, "Unsupported mapper %d\n", mapper_id);
-            exit(1);
-            break;
+/* mem must stay valid for the lifetime of the mapper, the bank slots point
+ * into it. prg_rom_size must be a multiple of 16KB and chr_size of 8KB. */
+mapper_t *make_mapper(uint16_t mapper_id, cart_memory_t *mem, MirrorMode mirroring) {
+    const mapper_desc_t *desc = find_mapper_desc(mapper_id);
+    if (!desc) {
+        fprintf(stderr, "Unsupported mapper %d\n", mapper_id);
+        exit(1);
     }
+    assert(mem->prg_rom_size >= _16KB && mem->prg_rom_size % _16KB == 0);
+    assert(mem->chr_size >= _8KB && mem->chr_size % _8KB == 0);
 
-    mapper->prg_banks = prg_banks;
-    mapper->chr_banks = chr_banks;
-    mapper->mirroring = mirroring;
+    mapper_t *mapper = xcalloc(1, desc->size);
+    mapper->prg_banks = mem->prg_rom_size / _16KB;
+    mapper->chr_banks = mem->chr_is_ram ? 0 : mem->chr_size / _8KB;
     mapper->id = mapper_id;
+    mapper->mem = *mem;
+    mapper->slots.prg_ram = mem->prg_ram;
+    set_mirroring(mapper, mirroring);
+
+    mapper->write = desc->write;
+    mapper->scanline = desc->scanline ? desc->scanline : mapper_nop;
+    mapper->irq_pending = desc->irq_pending ? desc->irq_pending : mapper_no_irq;
+    mapper->irq_clear = desc->irq_clear ? desc->irq_clear : mapper_nop;
+    mapper->has_scanline = desc->scanline != NULL;
+    mapper->has_irq = desc->irq_pending != NULL;
+    mapper->expansion_read = desc->expansion_read ? desc->expansion_read : mapper_open_bus;
+    mapper->expansion_write = desc->expansion_write ? desc->expansion_write : mapper_ignore_write;
+    mapper->has_expansion = desc->expansion_read || desc->expansion_write;
+    mapper->sync = desc->sync ? desc->sync : mapper_no_sync;
+    mapper->next_irq = desc->next_irq ? desc->next_irq : mapper_no_next_irq;
+    mapper->has_irq_timing = desc->next_irq != NULL;
+
+    desc->init(mapper);
 
     return mapper;
 }
 
 
-uint32_t mapper_read(mapper_t *mapper, uint16_t addr) {
-    switch (mapper->id) {
-        case 0: return mapper0_read(mapper, addr);
-        case 1: return mapper1_read(mapper, addr);
-        case 2: return mapper2_read(mapper, addr);
-        case 3: return mapper3_read(mapper, addr);
-        case 4: return mapper4_read(mapper, addr);
-        case 7: return mapper7_read(mapper, addr);
-        default:
-            fprintf(stderr, "Unsupported mapper %d\n", mapper->id);
-            exit(1);
-            break;
-    }
+/*
+ * Save states
+ *
+ * The state of a mapper is its current banking followed by the fields of
+ * its mapperXX_t after the head, which are plain data. Bank slots are saved
+ * as offsets into the cart memory they point at, so a state can be loaded
+ * into a mapper made from the same rom at any address.
+ */
+#define MAPPER_SLOT_COUNT (4 + 8) // prg and chr slots
+
+enum { SLOT_NONE, SLOT_PRG_ROM, SLOT_CHR, SLOT_PRG_RAM };
+
+typedef struct {
+    uint32_t slots[MAPPER_SLOT_COUNT]; // memory << 28 | offset, see slot_to_offset
+    uint16_t nametable[4];
+    uint8_t mirroring;
+} mapper_state_t;
+
+static uint8_t **mapper_slot(mapper_t *head, int i) {
+    if (i < 4) return &head->slots.prg[i];
+    return &head->slots.chr[i - 4];
 }
 
-uint32_t mapper_write(mapper_t *mapper, uint16_t addr, uint8_t data) {
-    switch (mapper->id) {
-        case 0: return mapper0_write(mapper, addr, data);
-        case 1: return mapper1_write(mapper, addr, data);
-        case 2: return mapper2_write(mapper, addr, data);
-        case 3: return mapper3_write(mapper, addr, data);
-        case 4: return mapper4_write(mapper, addr, data);
-        case 7: return mapper7_write(mapper, addr, data);
-        default:
-            fprintf(stderr, "Unsupported mapper %d\n", mapper->id);
-            exit(1);
-            break;
+static uint32_t slot_to_offset(mapper_t *head, uint8_t *p) {
+    cart_memory_t *mem = &head->mem;
+    if (!p)
+        return SLOT_NONE << 28;
+    if (p >= mem->prg_rom && p < mem->prg_rom + mem->prg_rom_size)
+        return SLOT_PRG_ROM << 28 | (uint32_t)(p - mem->prg_rom);
+    if (p >= mem->chr && p < mem->chr + mem->chr_size)
+        return SLOT_CHR << 28 | (uint32_t)(p - mem->chr);
+    assert(mem->prg_ram && p >= mem->prg_ram && p < mem->prg_ram + _8KB);
+    return SLOT_PRG_RAM << 28 | (uint32_t)(p - mem->prg_ram);
+}
+
+/* Offsets from a corrupt state are wrapped into the memory rather than
+ * rejected, so loading one can't make the cart read out of bounds. */
+static uint8_t *offset_to_slot(mapper_t *head, uint32_t offset) {
+    cart_memory_t *mem = &head->mem;
+    uint32_t n = (offset & 0x0FFFFFFF) & ~(uint32_t)(_KB-1);
+    switch (offset >> 28) {
+    case SLOT_PRG_ROM: return mem->prg_rom + n % mem->prg_rom_size;
+    case SLOT_CHR:     return mem->chr + n % mem->chr_size;
+    case SLOT_PRG_RAM: return mem->prg_ram ? mem->prg_ram + n % _8KB : NULL;
+    default:           return NULL;
     }
 }
 
+uint32_t mapper_state_size(mapper_t *mapper) {
+    return (uint32_t)(sizeof(mapper_state_t) + find_mapper_desc(mapper->id)->size - sizeof(mapper_t));
+}
+
+void mapper_save_state(mapper_t *mapper, uint8_t *out) {
+    mapper_state_t state = { .mirroring = (uint8_t)mapper->mirroring };
+    for (int i=0; i<MAPPER_SLOT_COUNT; ++i)
+        state.slots[i] = slot_to_offset(mapper, *mapper_slot(mapper, i));
+    memcpy(state.nametable, mapper->slots.nametable, sizeof(state.nametable));
+    memcpy(out, &state, sizeof(state));
+    memcpy(out + sizeof(state), (uint8_t *)mapper + sizeof(mapper_t), mapper_state_size(mapper) - sizeof(state));
+}
+
+/* in must hold mapper_state_size bytes saved from a mapper with the same id */
+void mapper_load_state(mapper_t *mapper, uint8_t *in) {
+    mapper_state_t state;
+    memcpy(&state, in, sizeof(state));
+    for (int i=0; i<MAPPER_SLOT_COUNT; ++i)
+        *mapper_slot(mapper, i) = offset_to_slot(mapper, state.slots[i]);
+    for (int i=0; i<4; ++i)
+        mapper->slots.nametable[i] = state.nametable[i] & 0x400;
+    mapper->mirroring = state.mirroring & 3;
+    memcpy((uint8_t *)mapper + sizeof(mapper_t), in + sizeof(state), mapper_state_size(mapper) - sizeof(state));
+}
+
+
+void mapper_write(mapper_t *mapper, uint16_t addr, uint8_t data) {
+    mapper->write(mapper, addr, data);
+}
+
+uint8_t mapper_expansion_read(mapper_t *mapper, uint16_t addr) {
+    return mapper->expansion_read(mapper, addr);
+}
+
+void mapper_expansion_write(mapper_t *mapper, uint16_t addr, uint8_t data) {
+    mapper->expansion_write(mapper, addr, data);
+}
+
 void mapper_scanline(mapper_t *mapper) {
-    switch (mapper->id) {
-        case 4: mapper4_scanline(mapper);
-		default: break;
-	}
+    mapper->scanline(mapper);
+}
+
+void mapper_sync(mapper_t *mapper, uint64_t now, bool rendering) {
+    mapper->sync(mapper, now, rendering);
+}
+
+uint64_t mapper_next_irq(mapper_t *mapper, bool rendering) {
+    return mapper->next_irq(mapper, rendering);
 }
 
 bool mapper_irq_pending(mapper_t *mapper) {
-    switch (mapper->id) {
-        case 4:  return mapper4_irq_pending(mapper);
-		default: return false;
-	}
+    return mapper->irq_pending(mapper);
 }
 
 void mapper_irq_clear(mapper_t *mapper) {
-    switch (mapper->id) {
-        case 4:  mapper4_irq_clear(mapper);
-		default: break;
-	}
+    mapper->irq_clear(mapper);
 }
-
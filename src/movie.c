@@ -0,0 +1,239 @@
+/*
+ * Input movies
+ *
+ * A movie is the controller input of a session from power on, one entry per
+ * emulated frame, so playing it back takes the emulator through exactly the
+ * same frames. That makes real play sessions usable as repeatable workloads
+ * for benchmarks, and lets us replay what happened on someone else's machine.
+ *
+ * The input of a frame is the two controller bytes that controller_write
+ * latches during it. They only change between frames, see
+ * controller_set_input, so movie_frame takes them right before each frame.
+ * Resets are recorded as an event on the frame they come before.
+ *
+ * Only frames run in the run and frame step modes are part of a movie.
+ * Stepping single instructions or rewinding stops it.
+ *
+ * Battery backed ram is part of the power on state, so a movie of a game
+ * with a save file only plays back the same with the same save file.
+ *
+ * Format, header values little endian:
+ *    0-7: "NESMOVIE"
+ *    8-11: version, MOVIE_VERSION
+ *    12-15: crc of the rom, see cart_rom_crc
+ *    16-: runs of frames with the same input, until the end of the file
+ *        u8: controller 1
+ *        u8: controller 2
+ *        u8: events on the first frame of the run, MOVIE_EVENT_*
+ *        varint: number of frames, at least 1
+ * Varints are encoded as in rewind.c. Input is held for many frames at a
+ * time, so ten minutes of play are usually a few KB.
+ */
+
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 16
+#define MOVIE_EVENT_RESET 0x01
+
+typedef struct {
+    uint8_t pads[2];
+    uint8_t events;
+    uint32_t frames;
+} movie_run_t;
+
+static struct {
+    bool recording;
+    bool playing;
+    char *path;
+    FILE *fp;                // recording
+    mapped_file_t file;      // playing
+    size_t offset;           // of the next run in file
+    movie_run_t run;         // being recorded, or what's left of the one playing
+    bool reset_pending;
+    uint32_t frame;
+    uint32_t length;         // frames in the movie being played
+} movie;
+
+static void movie_put_run(movie_run_t *run) {
+    uint8_t bytes[3 + 5];
+    bytes[0] = run->pads[0];
+    bytes[1] = run->pads[1];
+    bytes[2] = run->events;
+    uint8_t *end = put_varint(bytes + 3, run->frames);
+    fwrite(bytes, 1, end - bytes, movie.fp);
+}
+
+/* Reads the run at *offset in data. Returns false at the end of the data or
+ * if the run is cut off or empty. */
+static bool movie_get_run(uint8_t *data, size_t size, size_t *offset, movie_run_t *run) {
+    size_t p = *offset;
+    if (size - p < 4) return false;
+    run->pads[0] = data[p++];
+    run->pads[1] = data[p++];
+    run->events = data[p++];
+    uint64_t frames = 0;
+    for (int shift=0; ; shift += 7) {
+        if (p == size || shift > 28) return false;
+        frames |= (uint64_t)(data[p] & 0x7F) << shift;
+        if (!(data[p++] & 0x80)) break;
+    }
+    if (frames == 0 || frames > UINT32_MAX) return false;
+    run->frames = (uint32_t)frames;
+    *offset = p;
+    return true;
+}
+
+static void movie_close_at_exit(void) {
+    movie_close();
+}
+
+static void movie_register_exit(void) {
+    static bool registered;
+    if (!registered) {
+        atexit(movie_close_at_exit);
+        registered = true;
+    }
+}
+
+/* Starts recording the input of the frames from now on, which should be
+ * right after power on. Prints an error and returns false if the file can't
+ * be created. */
+bool movie_record(char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to create movie %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    uint8_t header[MOVIE_HEADER_SIZE];
+    memcpy(header, "NESMOVIE", 8);
+    put_le32(header + 8, MOVIE_VERSION);
+    put_le32(header + 12, cart_rom_crc());
+    fwrite(header, 1, MOVIE_HEADER_SIZE, fp);
+
+    memset(&movie, 0, sizeof(movie));
+    movie.recording = true;
+    movie.path = path;
+    movie.fp = fp;
+    movie_register_exit();
+    printf("Recording movie to %s\n", path);
+    return true;
+}
+
+/* Starts playing a movie, which feeds the input of the frames from now on
+ * instead of the keyboard and gamepads. The whole movie is checked first.
+ * Prints an error and returns false if it can't be played. */
+bool movie_play(char *path) {
+    mapped_file_t file;
+    if (!map_file_readonly(path, &file))
+        return false;
+
+    char *error = NULL;
+    uint64_t length = 0;
+    if (file.size < MOVIE_HEADER_SIZE || 0 != memcmp(file.data, "NESMOVIE", 8)) {
+        error = "not a movie";
+    } else if (get_le32(file.data + 8) != MOVIE_VERSION) {
+        error = "recorded by a different version";
+    } else if (get_le32(file.data + 12) != cart_rom_crc()) {
+        error = "recorded with a different rom";
+    } else {
+        size_t offset = MOVIE_HEADER_SIZE;
+        movie_run_t run;
+        while (movie_get_run(file.data, file.size, &offset, &run))
+            length += run.frames;
+        if (offset != file.size)
+            error = "corrupt or truncated";
+        else if (length > UINT32_MAX)
+            error = "too long";
+    }
+    if (error) {
+        fprintf(stderr, "Failed to play movie %s: %s\n", path, error);
+        unmap_file(&file);
+        return false;
+    }
+
+    memset(&movie, 0, sizeof(movie));
+    movie.playing = true;
+    movie.path = path;
+    movie.file = file;
+    movie.offset = MOVIE_HEADER_SIZE;
+    movie.length = (uint32_t)length;
+    movie_register_exit();
+    printf("Playing movie %s (%u frames)\n", path, movie.length);
+    return true;
+}
+
+bool movie_active(void) {
+    return movie.recording || movie.playing;
+}
+
+bool movie_playing(void) {
+    return movie.playing;
+}
+
+uint32_t movie_length(void) {
+    return movie.length;
+}
+
+/* Records a reset that was just done, it's replayed before the next frame */
+void movie_reset(void) {
+    if (movie.recording)
+        movie.reset_pending = true;
+}
+
+/* Called right before each frame that's part of the movie, to record the
+ * input for it or set it from the movie. Playback ends after the last frame
+ * and gives the controllers back to the user. */
+void movie_frame(cpu_t *cpu) {
+    if (movie.recording) {
+        uint8_t pads[2] = { controller_get_input(0), controller_get_input(1) };
+        uint8_t events = movie.reset_pending ? MOVIE_EVENT_RESET : 0;
+        movie.reset_pending = false;
+        movie_run_t *run = &movie.run;
+        if (run->frames && !events && run->frames < UINT32_MAX &&
+            run->pads[0] == pads[0] && run->pads[1] == pads[1])
+        {
+            ++run->frames;
+        } else {
+            if (run->frames)
+                movie_put_run(run);
+            *run = (movie_run_t){ .pads = { pads[0], pads[1] }, .events = events, .frames = 1 };
+        }
+        ++movie.frame;
+    } else if (movie.playing) {
+        bool first = false;
+        if (movie.run.frames == 0) {
+            if (!movie_get_run(movie.file.data, movie.file.size, &movie.offset, &movie.run)) {
+                printf("Movie finished after %u frames\n", movie.frame);
+                controller_set_input(0, 0);
+                controller_set_input(1, 0);
+                movie_close();
+                return;
+            }
+            first = true;
+        }
+        if (first && (movie.run.events & MOVIE_EVENT_RESET))
+            system_reset(cpu);
+        controller_set_input(0, movie.run.pads[0]);
+        controller_set_input(1, movie.run.pads[1]);
+        --movie.run.frames;
+        ++movie.frame;
+    }
+}
+
+/* Stops recording or playing. A recording is complete up to the last frame
+ * passed to movie_frame. */
+void movie_close(void) {
+    if (movie.recording) {
+        if (movie.run.frames)
+            movie_put_run(&movie.run);
+        bool failed = ferror(movie.fp);
+        if (fclose(movie.fp) != 0) failed = true;
+        if (failed)
+            fprintf(stderr, "Failed to write movie %s\n", movie.path);
+        else
+            printf("Recorded %u frames to %s\n", movie.frame, movie.path);
+    } else if (movie.playing) {
+        unmap_file(&movie.file);
+    }
+    movie.recording = false;
+    movie.playing = false;
+}
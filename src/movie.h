@@ -0,0 +1,15 @@
+#ifndef __MOVIE_H__
+#define __MOVIE_H__
+
+struct cpu_t;
+
+bool movie_record(char *path);
+bool movie_play(char *path);
+bool movie_active(void);
+bool movie_playing(void);
+uint32_t movie_length(void);
+void movie_reset(void);
+void movie_frame(struct cpu_t *cpu);
+void movie_close(void);
+
+#endif
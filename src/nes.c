@@ -0,0 +1,331 @@
+/*
+ * libnes
+ *
+ * The machine's state is kept in file scope variables of each module, which
+ * keeps the emulation loop free of context pointers. Those variables are
+ * thread local, so every thread has a machine of its own that it can run
+ * directly, which is what the front end does on its main thread.
+ *
+ * A nes_t is a machine that isn't tied to a thread. Between calls its state
+ * is kept as a save state, see state.c, which each call loads into the
+ * calling thread's machine and saves back afterwards. That's two copies of
+ * about 13KB, a microsecond or two, against a couple of milliseconds for a
+ * frame. Any number of nes_t can exist, and different ones can be stepped on
+ * different threads at the same time, but one nes_t must only be used by one
+ * thread at a time.
+ *
+ * Stepping a nes_t replaces the machine the thread had, so a thread either
+ * runs its own machine or steps nes_t, not both. Machines running the same
+ * rom share its image, and a thread only reloads its cart when it steps a
+ * machine with a different rom. nes_release_thread frees the cart when a
+ * thread is done with the library.
+ *
+ * nes_fork copies a machine for trying out different inputs from the same
+ * point, e.g. searching for inputs or looking ahead. The copy shares the rom
+ * and copies the save state, so it's cheap, and destroyed machines are kept
+ * in a pool to be reused, which makes forking as often as every frame cost
+ * little more than the copy.
+ */
+
+#define NES_AUDIO_MAX_SECONDS 1 // older samples not taken by nes_audio are dropped
+#define NES_POOL_MAX 32         // destroyed machines kept for reuse, about 400KB each
+
+struct nes_t {
+    rom_image_t *image;
+    cpu_t cpu;
+    uint8_t *state;       // the machine between calls
+    size_t state_size;
+    uint32_t *pixels;     // NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT, ARGB
+    int sample_rate;
+    float *audio;         // samples not taken by nes_audio yet
+    int audio_count;
+    int audio_capacity;
+    bool ram_only;        // see nes_set_ram_only
+    nes_t *next_free;     // in nes_pool
+};
+
+static nes_t *nes_pool;
+static int nes_pool_count;
+static spin_lock_t nes_pool_lock;
+
+void do_interrupts(cpu_t *cpu) {
+	uint64_t now = ppu_timestamp();
+	if (sched_due(now))
+		sched_run(now);
+	if (cpu->op_cycles == 0 && ppu_nmi())  {
+		cpu_nmi(cpu);
+		ppu_clear_nmi();
+	}
+	if (cpu->op_cycles == 0 && cart_irq_pending()) {
+		cpu_irq(cpu);
+		cart_irq_clear();
+	}
+	// if (cpu->op_cycles == 0 && apu_irq_pending()) {
+		// cpu_irq(cpu);
+		// apu_irq_clear();
+	// }
+}
+
+/* Runs this thread's machine until the ppu completes a frame. When
+ * keep_audio is false the samples generated during the frame are dropped
+ * instead of queued. */
+void emulate_frame(cpu_t *cpu, bool keep_audio) {
+	while (!ppu_frame_completed()) {
+		do_interrupts(cpu);
+		cpu_tick(cpu);
+		apu_tick();
+		ppu_tick(); ppu_tick(); ppu_tick();
+	}
+
+	ppu_clear_frame_completed();
+	cart_end_frame();
+	if (keep_audio)
+		apu_flush_sound_buffer();
+	else
+		apu_discard_sound_buffer();
+}
+
+static void nes_audio_sink(float *samples, int count, void *userdata) {
+	nes_t *nes = userdata;
+	if (count > nes->audio_capacity) {
+		samples += count - nes->audio_capacity;
+		count = nes->audio_capacity;
+	}
+	int excess = nes->audio_count + count - nes->audio_capacity;
+	if (excess > 0) {
+		nes->audio_count -= excess;
+		memmove(nes->audio, nes->audio + excess, nes->audio_count * sizeof(float));
+	}
+	memcpy(nes->audio + nes->audio_count, samples, count * sizeof(float));
+	nes->audio_count += count;
+}
+
+static void nes_load_cart(nes_t *nes) {
+	if (cart_rom_image())
+		delete_cart();
+	retain_rom_image(nes->image);
+	load_rom_image(nes->image, NULL);
+}
+
+static void nes_setup_output(nes_t *nes) {
+	ppu_init(nes->pixels);
+	ppu_skip_pixels(nes->ram_only);
+	apu_set_sample_rate(nes->sample_rate);
+	apu_set_sound_sink(nes_audio_sink, nes);
+}
+
+// loads nes into this thread's machine
+static void nes_enter(nes_t *nes) {
+	if (cart_rom_image() != nes->image)
+		nes_load_cart(nes);
+	nes_setup_output(nes);
+	nes_load_state(&nes->cpu, nes->state, nes->state_size);
+}
+
+static void nes_leave(nes_t *nes) {
+	nes_save_state(&nes->cpu, nes->state, nes->state_size);
+	apu_set_sound_sink(NULL, NULL);
+}
+
+/* Emulates frames with the same input. Without keep_audio the samples are
+ * dropped rather than queued for nes_audio. */
+static void nes_run_frames(nes_t *nes, uint8_t input[2], int frames, bool keep_audio) {
+	nes_enter(nes);
+	controller_set_input(0, input[0]);
+	controller_set_input(1, input[1]);
+	for (int i=0; i<frames; ++i)
+		emulate_frame(&nes->cpu, keep_audio);
+	nes_leave(nes);
+}
+
+/* Takes a machine from the pool, or allocates one, with its buffers sized
+ * for the sample rate. Its picture and state are left as they were. */
+static nes_t *nes_alloc(int sample_rate) {
+	spin_lock(&nes_pool_lock);
+	nes_t *nes = nes_pool;
+	if (nes) {
+		nes_pool = nes->next_free;
+		--nes_pool_count;
+	}
+	spin_unlock(&nes_pool_lock);
+
+	if (!nes) {
+		nes = xcalloc(1, sizeof(nes_t));
+		nes->pixels = xcalloc(NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT, sizeof(uint32_t));
+	}
+	int capacity = sample_rate * NES_AUDIO_MAX_SECONDS;
+	if (nes->audio_capacity != capacity) {
+		nes->audio = xrealloc(nes->audio, capacity * sizeof(float));
+		nes->audio_capacity = capacity;
+	}
+	nes->sample_rate = sample_rate;
+	nes->audio_count = 0;
+	nes->ram_only = false;
+	nes->next_free = NULL;
+	return nes;
+}
+
+static void nes_set_state_size(nes_t *nes, size_t size) {
+	if (nes->state_size != size) {
+		nes->state = xrealloc(nes->state, size);
+		nes->state_size = size;
+	}
+}
+
+/* Powers on a new machine with the image, which it takes the reference to */
+static nes_t *nes_make(rom_image_t *image) {
+	if (!image) return NULL;
+	nes_t *nes = nes_alloc(APU_DEFAULT_SAMPLE_RATE);
+	nes->image = image;
+	memset(nes->pixels, 0, NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT * sizeof(uint32_t));
+
+	// the thread's cart is reloaded even for the same rom, its ram and
+	// mapper belong to the machine that ran before
+	memset(&nes->cpu, 0, sizeof(cpu_t));
+	system_power_on(&nes->cpu);
+	nes_load_cart(nes);
+	nes_setup_output(nes);
+	system_reset(&nes->cpu);
+
+	nes_set_state_size(nes, nes_state_size());
+	nes_leave(nes);
+	return nes;
+}
+
+/* Makes a machine that runs the rom in data, a .nes file or a zipped or
+ * gzipped one, which is copied. Prints an error and returns NULL if the rom
+ * can't be run. */
+nes_t *nes_create(uint8_t *rom, size_t size) {
+	return nes_make(copy_rom_image(rom, size, "rom"));
+}
+
+/* Like nes_create, but the rom is loaded from a file, which is shared with
+ * the other machines that opened it. Battery ram is not saved. */
+nes_t *nes_open(char *path) {
+	return nes_make(open_rom_image(path));
+}
+
+/* Makes a copy of the machine as it is now, which runs exactly like it
+ * given the same input. The rom is shared, the copy gets the machine's
+ * state, picture, sample rate and ram only setting but none of its pending
+ * audio. The picture isn't copied from a ram only machine, the copy's is
+ * undefined until it draws one. */
+nes_t *nes_fork(nes_t *nes) {
+	nes_t *fork = nes_alloc(nes->sample_rate);
+	retain_rom_image(nes->image);
+	fork->image = nes->image;
+	fork->cpu = nes->cpu;
+	fork->ram_only = nes->ram_only;
+	nes_set_state_size(fork, nes->state_size);
+	memcpy(fork->state, nes->state, nes->state_size);
+	if (!nes->ram_only)
+		memcpy(fork->pixels, nes->pixels, NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT * sizeof(uint32_t));
+	return fork;
+}
+
+/* Destroys the machine. Its memory is kept for the next machine made, up
+ * to NES_POOL_MAX machines. */
+void nes_destroy(nes_t *nes) {
+	if (!nes) return;
+	release_rom_image(nes->image);
+	nes->image = NULL;
+
+	spin_lock(&nes_pool_lock);
+	bool pooled = nes_pool_count < NES_POOL_MAX;
+	if (pooled) {
+		nes->next_free = nes_pool;
+		nes_pool = nes;
+		++nes_pool_count;
+	}
+	spin_unlock(&nes_pool_lock);
+	if (pooled) return;
+
+	free(nes->state);
+	free(nes->pixels);
+	free(nes->audio);
+	free(nes);
+}
+
+/* Like pressing the reset button */
+void nes_reset(nes_t *nes) {
+	nes_enter(nes);
+	system_reset(&nes->cpu);
+	nes_leave(nes);
+}
+
+/* Emulates one frame with the buttons in input held on the two controllers,
+ * NES_BUTTON_* bits */
+void nes_step_frame(nes_t *nes, uint8_t input[2]) {
+	nes_run_frames(nes, input, 1, true);
+}
+
+/* The picture of the last frame, NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT ARGB
+ * pixels, rows top to bottom */
+uint32_t *nes_framebuffer(nes_t *nes) {
+	return nes->pixels;
+}
+
+/* The machine's NES_RAM_SIZE bytes of ram. Changes are seen by the game from
+ * the next frame on. */
+uint8_t *nes_ram(nes_t *nes) {
+	return nes_state_ram(nes->state);
+}
+
+/* Copies size bytes of what the cpu sees from addr on into buffer, without
+ * the side effects reading registers has. Only the ram and the cart's
+ * $6000-$FFFF are read, other addresses read as 0. */
+void nes_read_memory(nes_t *nes, uint16_t addr, uint8_t *buffer, size_t size) {
+	// reading doesn't change the machine, so it isn't saved back
+	nes_enter(nes);
+	for (size_t i=0; i<size; ++i) {
+		uint16_t a = (uint16_t)(addr + i);
+		if (a < 0x2000)
+			buffer[i] = cpu_ram[a & 0x7FF];
+		else if (a >= 0x6000)
+			buffer[i] = cart_cpu_read(a);
+		else
+			buffer[i] = 0;
+	}
+	apu_set_sound_sink(NULL, NULL);
+}
+
+/* Stops or resumes drawing the picture, for machines that are only watched
+ * through their ram or memory. The game runs exactly the same, but frames
+ * take a fraction of the time. nes_framebuffer keeps the last picture drawn. */
+void nes_set_ram_only(nes_t *nes, bool ram_only) {
+	nes->ram_only = ram_only;
+}
+
+/* Output sample rate, APU_DEFAULT_SAMPLE_RATE to begin with. Samples not
+ * taken yet are dropped. */
+void nes_set_sample_rate(nes_t *nes, int rate) {
+	assert(rate >= APU_MIN_SAMPLE_RATE && rate <= APU_MAX_SAMPLE_RATE);
+	nes->sample_rate = rate;
+	nes->audio_capacity = rate * NES_AUDIO_MAX_SECONDS;
+	nes->audio = xrealloc(nes->audio, nes->audio_capacity * sizeof(float));
+	nes->audio_count = 0;
+}
+
+/* Takes up to max of the mono samples generated since the last call, oldest
+ * first, and returns how many were copied into buffer. Up to a second of
+ * samples is kept. */
+int nes_audio(nes_t *nes, float *buffer, int max) {
+	int count = MIN(nes->audio_count, max);
+	memcpy(buffer, nes->audio, count * sizeof(float));
+	nes->audio_count -= count;
+	memmove(nes->audio, nes->audio + count, nes->audio_count * sizeof(float));
+	return count;
+}
+
+/* Whether rom information is printed when a machine is made, on by
+ * default. It applies to all threads, so set it before starting any. */
+void nes_set_verbose(bool verbose) {
+	cart_set_verbose(verbose);
+}
+
+/* Frees the cart of the calling thread's machine. Call it before a thread
+ * that used nes_t exits. */
+void nes_release_thread(void) {
+	if (cart_rom_image())
+		delete_cart();
+}
@@ -0,0 +1,99 @@
+#ifndef __NES_H__
+#define __NES_H__
+
+/*
+ * libnes, the emulator as a library, see nes.c
+ *
+ * A nes_t is not a self contained emulator context. The emulator runs one
+ * machine per thread, in thread local globals, and a nes_t is a save state
+ * of one. Every call that runs or inspects a nes_t loads its state into the
+ * calling thread's machine and saves it back, so each nes_step_frame costs
+ * two full state copies on top of the frame. This means:
+ * - one nes_t must only be used by one thread at a time
+ * - a thread that steps nes_t can't also run its own machine
+ * - the rom database and the cache of rom images are shared by all machines
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NES_SCREEN_WIDTH  256
+#define NES_SCREEN_HEIGHT 240
+#define NES_RAM_SIZE      2048
+
+// controller buttons, the bits of each input byte
+#define NES_BUTTON_A      0x80
+#define NES_BUTTON_B      0x40
+#define NES_BUTTON_SELECT 0x20
+#define NES_BUTTON_START  0x10
+#define NES_BUTTON_UP     0x08
+#define NES_BUTTON_DOWN   0x04
+#define NES_BUTTON_LEFT   0x02
+#define NES_BUTTON_RIGHT  0x01
+
+// make libnes compiles the core with hidden visibility, only the functions
+// declared here are exported
+#if defined(__GNUC__) && !defined(_WIN32)
+#define NES_API __attribute__((visibility("default")))
+#else
+#define NES_API
+#endif
+
+typedef struct nes_t nes_t;
+
+NES_API nes_t *nes_create(uint8_t *rom, size_t size);
+NES_API nes_t *nes_open(char *path);
+NES_API nes_t *nes_fork(nes_t *nes);
+NES_API void nes_destroy(nes_t *nes);
+NES_API void nes_reset(nes_t *nes);
+NES_API void nes_step_frame(nes_t *nes, uint8_t input[2]);
+NES_API uint32_t *nes_framebuffer(nes_t *nes);
+NES_API uint8_t *nes_ram(nes_t *nes);
+NES_API void nes_set_ram_only(nes_t *nes, bool ram_only);
+NES_API void nes_read_memory(nes_t *nes, uint16_t addr, uint8_t *buffer, size_t size);
+NES_API void nes_set_sample_rate(nes_t *nes, int rate);
+NES_API int nes_audio(nes_t *nes, float *buffer, int max);
+NES_API void nes_set_verbose(bool verbose);
+NES_API void nes_release_thread(void);
+
+// batches of machines stepped together, see nes_batch.c
+typedef enum {
+    NES_OBSERVE_RAM,      // the NES_RAM_SIZE bytes of ram
+    NES_OBSERVE_GRAY,     // brightness of the picture, averaged over downscale * downscale pixels
+    NES_OBSERVE_PALETTE,  // palette index of the picture, 0-63, of the top left pixel of each downscale * downscale block
+} nes_observation_t;
+
+#define NES_BATCH_MAX_REWARDS 8
+
+typedef struct {
+    uint16_t addr;        // in ram
+    float weight;         // the reward is the sum of weight * the change of the byte in a step
+} nes_reward_t;
+
+typedef struct {
+    nes_observation_t observation;
+    int downscale;          // 1, 2, 4, 8 or 16, picture observations are 256/downscale by 240/downscale
+    int frames_per_step;    // frames the input of a step is held for, 0 for 1
+    int boot_frames;        // frames from power on to the snapshot episodes start from
+    int max_episode_frames; // 0 for no limit
+    nes_reward_t rewards[NES_BATCH_MAX_REWARDS];
+    int reward_count;
+    uint16_t done_addr;     // an episode ends when (ram[done_addr] & done_mask) == done_value
+    uint8_t done_mask;      // 0 for no done condition
+    uint8_t done_value;
+    int threads;            // including the calling thread, 0 for one per cpu
+} nes_batch_config_t;
+
+typedef struct nes_batch_t nes_batch_t;
+
+NES_API nes_batch_t *nes_batch_create(uint8_t *rom, size_t size, int count, nes_batch_config_t *config);
+NES_API void nes_batch_destroy(nes_batch_t *batch);
+NES_API void nes_batch_reset(nes_batch_t *batch);
+NES_API void nes_batch_step(nes_batch_t *batch, uint8_t *input);
+NES_API size_t nes_batch_observation_size(nes_batch_t *batch);
+NES_API uint8_t *nes_batch_observations(nes_batch_t *batch);
+NES_API float *nes_batch_rewards(nes_batch_t *batch);
+NES_API uint8_t *nes_batch_dones(nes_batch_t *batch);
+
+#endif
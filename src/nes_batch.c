@@ -0,0 +1,337 @@
+/*
+ * Batches of machines, for training agents
+ *
+ * A batch is count machines running the same rom, stepped together with one
+ * call. Each step runs every machine for frames_per_step frames with its own
+ * input and leaves the results side by side in arrays the batch owns: the
+ * observations, count * nes_batch_observation_size bytes, the rewards and
+ * the done flags.
+ *
+ * The machines are spread over a pool of worker threads, which the calling
+ * thread joins while a step runs, so like stepping a nes_t it replaces the
+ * calling thread's own machine. The workers are started by nes_batch_create
+ * and wait on a semaphore between steps.
+ *
+ * Episodes start from a snapshot taken boot_frames frames after power on,
+ * so resetting a machine is copying the snapshot into it instead of booting
+ * the game again. A machine whose episode ends, by its done condition or by
+ * running max_episode_frames frames, is reset at the end of the step. Its
+ * done flag is set and its observation is already the one of the new
+ * episode.
+ *
+ * Rewards are the weighted changes of ram bytes over a step, e.g. the digits
+ * of a score with weights 1, 10, 100. Audio isn't generated for batches, and
+ * batches observing ram don't draw pictures either, see nes_set_ram_only.
+ */
+
+#define NES_BATCH_MAX_THREADS 64
+#define NES_BATCH_COLOR_SLOTS 256 // hash of the 64 palette colors, for NES_OBSERVE_PALETTE
+
+typedef enum {
+    BATCH_JOB_STEP,
+    BATCH_JOB_RESET,
+    BATCH_JOB_QUIT,
+} batch_job_t;
+
+struct nes_batch_t {
+    nes_batch_config_t config;
+    int count;
+    nes_t **machines;
+    int *episode_frames;
+    uint8_t *boot_state;        // what machines are reset to
+    uint32_t *boot_pixels;      // and the picture that goes with it
+    int width, height;          // of a picture observation
+    size_t observation_size;
+    uint8_t *observations;
+    float *rewards;
+    uint8_t *dones;
+    uint32_t color_keys[NES_BATCH_COLOR_SLOTS];
+    uint8_t color_indices[NES_BATCH_COLOR_SLOTS];
+
+    // the job of the current step, handed out a machine at a time
+    batch_job_t job;
+    uint8_t *input;
+    atomic_int_t next;
+    semaphore_t *work_sem;
+    semaphore_t *done_sem;
+    thread_t *threads[NES_BATCH_MAX_THREADS];
+    int thread_count;           // not counting the caller
+};
+
+static uint32_t batch_color_slot(uint32_t color) {
+	return ((color & 0xFFFFFF) * 2654435761u) >> 24;
+}
+
+/* Builds the map from picture colors back to palette indices. Some colors
+ * appear more than once, like black, they map to the lowest index. */
+static void batch_init_colors(nes_batch_t *batch) {
+	uint32_t *colors = ppu_get_colors();
+	memset(batch->color_keys, 0xFF, sizeof(batch->color_keys));
+	for (int i=0; i<64; ++i) {
+		uint32_t color = colors[i] & 0xFFFFFF;
+		uint32_t slot = batch_color_slot(color);
+		while (batch->color_keys[slot] != 0xFFFFFFFF && batch->color_keys[slot] != color)
+			slot = (slot + 1) % NES_BATCH_COLOR_SLOTS;
+		if (batch->color_keys[slot] == color) continue;
+		batch->color_keys[slot] = color;
+		batch->color_indices[slot] = (uint8_t)i;
+	}
+}
+
+static uint8_t batch_color_index(nes_batch_t *batch, uint32_t color) {
+	color &= 0xFFFFFF;
+	uint32_t slot = batch_color_slot(color);
+	while (batch->color_keys[slot] != color) {
+		if (batch->color_keys[slot] == 0xFFFFFFFF) return 0;
+		slot = (slot + 1) % NES_BATCH_COLOR_SLOTS;
+	}
+	return batch->color_indices[slot];
+}
+
+static void batch_observe(nes_batch_t *batch, int i) {
+	nes_t *nes = batch->machines[i];
+	uint8_t *out = batch->observations + i * batch->observation_size;
+	int scale = batch->config.downscale;
+
+	switch (batch->config.observation) {
+	case NES_OBSERVE_RAM:
+		memcpy(out, nes_ram(nes), NES_RAM_SIZE);
+		break;
+
+	case NES_OBSERVE_GRAY:
+		for (int y=0; y<batch->height; ++y) {
+			for (int x=0; x<batch->width; ++x) {
+				uint32_t sum = 0;
+				for (int dy=0; dy<scale; ++dy) {
+					uint32_t *row = nes->pixels + (y*scale + dy) * NES_SCREEN_WIDTH + x*scale;
+					for (int dx=0; dx<scale; ++dx) {
+						uint32_t c = row[dx];
+						sum += (((c >> 16) & 0xFF) * 77 + ((c >> 8) & 0xFF) * 150 + (c & 0xFF) * 29) >> 8;
+					}
+				}
+				*out++ = (uint8_t)(sum / (scale * scale));
+			}
+		}
+		break;
+
+	case NES_OBSERVE_PALETTE:
+		for (int y=0; y<batch->height; ++y) {
+			uint32_t *row = nes->pixels + y * scale * NES_SCREEN_WIDTH;
+			for (int x=0; x<batch->width; ++x)
+				*out++ = batch_color_index(batch, row[x * scale]);
+		}
+		break;
+	}
+}
+
+static void batch_reset_machine(nes_batch_t *batch, int i) {
+	nes_t *nes = batch->machines[i];
+	memcpy(nes->state, batch->boot_state, nes->state_size);
+	memcpy(nes->pixels, batch->boot_pixels, NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT * sizeof(uint32_t));
+	batch->episode_frames[i] = 0;
+}
+
+static bool batch_episode_done(nes_batch_t *batch, int i) {
+	nes_batch_config_t *config = &batch->config;
+	uint8_t *ram = nes_ram(batch->machines[i]);
+	if (config->done_mask && (ram[config->done_addr] & config->done_mask) == config->done_value)
+		return true;
+	return config->max_episode_frames && batch->episode_frames[i] >= config->max_episode_frames;
+}
+
+static void batch_step_machine(nes_batch_t *batch, int i) {
+	nes_batch_config_t *config = &batch->config;
+	nes_t *nes = batch->machines[i];
+	uint8_t *ram = nes_ram(nes);
+
+	uint8_t before[NES_BATCH_MAX_REWARDS];
+	for (int r=0; r<config->reward_count; ++r)
+		before[r] = ram[config->rewards[r].addr];
+
+	nes_run_frames(nes, batch->input + 2*i, config->frames_per_step, false);
+	batch->episode_frames[i] += config->frames_per_step;
+
+	float reward = 0;
+	for (int r=0; r<config->reward_count; ++r)
+		reward += config->rewards[r].weight * ((int)ram[config->rewards[r].addr] - (int)before[r]);
+	batch->rewards[i] = reward;
+
+	batch->dones[i] = batch_episode_done(batch, i);
+	if (batch->dones[i])
+		batch_reset_machine(batch, i);
+	batch_observe(batch, i);
+}
+
+static void batch_run_job(nes_batch_t *batch) {
+	for (;;) {
+		int i = atomic_add(&batch->next, 1);
+		if (i >= batch->count) break;
+		if (batch->job == BATCH_JOB_STEP) {
+			batch_step_machine(batch, i);
+		} else {
+			batch_reset_machine(batch, i);
+			batch->rewards[i] = 0;
+			batch->dones[i] = 0;
+			batch_observe(batch, i);
+		}
+	}
+}
+
+static int batch_worker(void *data) {
+	nes_batch_t *batch = data;
+	for (;;) {
+		semaphore_wait(batch->work_sem);
+		if (batch->job == BATCH_JOB_QUIT) break;
+		batch_run_job(batch);
+		semaphore_post(batch->done_sem);
+	}
+	nes_release_thread();
+	return 0;
+}
+
+/* Runs job on all machines, on the workers and the calling thread */
+static void batch_run(nes_batch_t *batch, batch_job_t job) {
+	batch->job = job;
+	atomic_set(&batch->next, 0);
+	for (int t=0; t<batch->thread_count; ++t)
+		semaphore_post(batch->work_sem);
+	batch_run_job(batch);
+	for (int t=0; t<batch->thread_count; ++t)
+		semaphore_wait(batch->done_sem);
+}
+
+static bool batch_check_config(nes_batch_config_t *config) {
+	char *error = NULL;
+	int scale = config->downscale;
+	if (config->observation != NES_OBSERVE_RAM && config->observation != NES_OBSERVE_GRAY &&
+		config->observation != NES_OBSERVE_PALETTE)
+		error = "unknown observation";
+	else if (scale < 1 || NES_SCREEN_WIDTH % scale || NES_SCREEN_HEIGHT % scale)
+		error = "downscale must be 1, 2, 4, 8 or 16";
+	else if (config->frames_per_step < 1 || config->boot_frames < 0 || config->max_episode_frames < 0)
+		error = "frame counts out of range";
+	else if (config->reward_count < 0 || config->reward_count > NES_BATCH_MAX_REWARDS)
+		error = "too many rewards";
+	else if (config->done_addr >= NES_RAM_SIZE)
+		error = "done address is outside of ram";
+	for (int r=0; r<config->reward_count && !error; ++r)
+		if (config->rewards[r].addr >= NES_RAM_SIZE)
+			error = "reward address is outside of ram";
+	if (error)
+		fprintf(stderr, "Bad batch config: %s\n", error);
+	return !error;
+}
+
+/* Makes a machine running the rom in data, like nes_create, boots it for
+ * boot_frames frames to take the snapshot episodes start from, and forks
+ * it into count machines. A config of all zeros observes ram, one frame
+ * per step, with episodes that never end. Prints an error and returns NULL
+ * if the rom or the config can't be used. */
+nes_batch_t *nes_batch_create(uint8_t *rom, size_t size, int count, nes_batch_config_t *config) {
+	nes_batch_config_t c = *config;
+	if (c.downscale == 0) c.downscale = 1;
+	if (c.frames_per_step == 0) c.frames_per_step = 1;
+	if (c.threads == 0) c.threads = cpu_count();
+	if (count < 1 || !batch_check_config(&c))
+		return NULL;
+
+	rom_image_t *image = copy_rom_image(rom, size, "rom");
+	if (!image) return NULL;
+
+	nes_batch_t *batch = xcalloc(1, sizeof(nes_batch_t));
+	batch->config = c;
+	batch->count = count;
+	batch->machines = xcalloc(count, sizeof(nes_t *));
+	nes_t *first = batch->machines[0] = nes_make(image);
+	nes_set_ram_only(first, c.observation == NES_OBSERVE_RAM);
+
+	uint8_t no_input[2] = {0};
+	nes_run_frames(first, no_input, c.boot_frames, false);
+	batch->boot_state = xmalloc(first->state_size);
+	memcpy(batch->boot_state, first->state, first->state_size);
+	batch->boot_pixels = xmalloc(NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT * sizeof(uint32_t));
+	memcpy(batch->boot_pixels, first->pixels, NES_SCREEN_WIDTH * NES_SCREEN_HEIGHT * sizeof(uint32_t));
+	for (int i=1; i<count; ++i)
+		batch->machines[i] = nes_fork(first);
+
+	if (c.observation == NES_OBSERVE_RAM) {
+		batch->observation_size = NES_RAM_SIZE;
+	} else {
+		batch->width = NES_SCREEN_WIDTH / c.downscale;
+		batch->height = NES_SCREEN_HEIGHT / c.downscale;
+		batch->observation_size = batch->width * batch->height;
+	}
+	batch->observations = xmalloc(count * batch->observation_size);
+	batch->rewards = xcalloc(count, sizeof(float));
+	batch->dones = xcalloc(count, 1);
+	batch->episode_frames = xcalloc(count, sizeof(int));
+	batch_init_colors(batch);
+
+	batch->work_sem = semaphore_create(0);
+	batch->done_sem = semaphore_create(0);
+	int extra = MIN(MIN(c.threads, NES_BATCH_MAX_THREADS), count) - 1;
+	for (int t=0; t<extra; ++t) {
+		batch->threads[batch->thread_count] = thread_create(batch_worker, batch);
+		if (batch->threads[batch->thread_count]) ++batch->thread_count;
+	}
+
+	nes_batch_reset(batch);
+	return batch;
+}
+
+void nes_batch_destroy(nes_batch_t *batch) {
+	if (!batch) return;
+	batch->job = BATCH_JOB_QUIT;
+	for (int t=0; t<batch->thread_count; ++t)
+		semaphore_post(batch->work_sem);
+	for (int t=0; t<batch->thread_count; ++t)
+		thread_join(batch->threads[t]);
+	semaphore_destroy(batch->work_sem);
+	semaphore_destroy(batch->done_sem);
+
+	for (int i=0; i<batch->count; ++i)
+		nes_destroy(batch->machines[i]);
+	free(batch->machines);
+	free(batch->episode_frames);
+	free(batch->boot_state);
+	free(batch->boot_pixels);
+	free(batch->observations);
+	free(batch->rewards);
+	free(batch->dones);
+	free(batch);
+}
+
+/* Starts a new episode on every machine. Rewards and dones are cleared and
+ * the observations are of the snapshot. */
+void nes_batch_reset(nes_batch_t *batch) {
+	batch_run(batch, BATCH_JOB_RESET);
+}
+
+/* Steps every machine with its input, two NES_BUTTON_* bytes per machine
+ * for its two controllers, count * 2 bytes in all */
+void nes_batch_step(nes_batch_t *batch, uint8_t *input) {
+	batch->input = input;
+	batch_run(batch, BATCH_JOB_STEP);
+	batch->input = NULL;
+}
+
+/* The bytes of one machine's observation */
+size_t nes_batch_observation_size(nes_batch_t *batch) {
+	return batch->observation_size;
+}
+
+/* The observation of each machine after the last step or reset, one after
+ * the other. For pictures, rows are top to bottom. */
+uint8_t *nes_batch_observations(nes_batch_t *batch) {
+	return batch->observations;
+}
+
+float *nes_batch_rewards(nes_batch_t *batch) {
+	return batch->rewards;
+}
+
+/* 1 for the machines whose episode ended in the last step and that were
+ * reset, 0 for the others */
+uint8_t *nes_batch_dones(nes_batch_t *batch) {
+	return batch->dones;
+}
@@ -0,0 +1,382 @@
+/*
+ * nes-test, runs test roms headless on a pool of threads and reports the
+ * results as TAP on stdout and optionally as JUnit XML.
+ *
+ * Usage: nes-test [options] [ROM_OR_DIR...]
+ * Without arguments it runs the apu and ppu tests in test-programs.
+ *
+ * Each rom runs on a libnes machine, see nes.h, until it reports a result or
+ * runs out of frames. Two ways of reporting are understood:
+ *
+ * Most of blargg's tests write their status to $6000: $80 while running, $81
+ * when the reset button should be pressed at least 100ms later, and the
+ * result code when done, 0 for passed. $DE $B0 $61 at $6001-$6003 marks the
+ * status as valid, and the text the test printed is at $6004, zero
+ * terminated.
+ *
+ * The older tests in blargg-ppu-tests only show their result on screen and
+ * beep it. They keep it at $F0, 1 for passed, and then loop forever, so
+ * those are done once $F0 is set and the ram has stopped changing.
+ */
+
+#include "libnes.c"
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#define TEST_DEFAULT_FRAMES  3600 // a minute of emulated time
+#define TEST_RESET_DELAY     7    // frames to wait before pressing reset, more than 100ms
+#define TEST_SETTLE_FRAMES   60   // frames without ram changes that end an old style test
+#define TEST_MAX_THREADS     64
+#define TEST_TEXT_SIZE       (0x8000 - 0x6004)
+
+typedef enum {
+    TEST_PASSED,
+    TEST_FAILED,
+    TEST_TIMED_OUT,
+    TEST_NOT_LOADED,
+} test_outcome_t;
+
+typedef struct {
+    char *path;
+    test_outcome_t outcome;
+    int code;            // result code the rom reported, -1 if none
+    char *text;          // what the rom printed at $6004, or NULL
+    int frames;
+    double seconds;      // wall time
+} test_result_t;
+
+typedef struct {
+    test_result_t *results;
+    int count;
+    int max_frames;
+    atomic_int_t next;   // next index into results to hand out
+} test_job_t;
+
+static char *default_test_dirs[] = {
+    "test-programs/apu_test/rom_singles",
+    "test-programs/blargg-ppu-tests",
+};
+
+/* Reads the text at $6004 into a new string */
+static char *read_test_text(nes_t *nes) {
+    char *text = xmalloc(TEST_TEXT_SIZE + 1);
+    nes_read_memory(nes, 0x6004, (uint8_t *)text, TEST_TEXT_SIZE);
+    text[TEST_TEXT_SIZE] = 0;
+    return text;
+}
+
+static void run_test(test_result_t *result, int max_frames) {
+    uint64_t start = time_ns();
+    result->code = -1;
+    nes_t *nes = nes_open(result->path);
+    if (!nes) {
+        result->outcome = TEST_NOT_LOADED;
+        return;
+    }
+    nes_set_ram_only(nes, true);
+
+    uint8_t input[2] = {0};
+    uint8_t last_ram[NES_RAM_SIZE] = {0};
+    bool has_status = false;
+    int reset_frame = -1;    // when to press reset, -1 if not waiting to
+    bool reset_done = false;
+    int still_frames = 0;    // frames since the ram last changed
+    result->outcome = TEST_TIMED_OUT;
+
+    while (result->frames < max_frames) {
+        nes_step_frame(nes, input);
+        ++result->frames;
+
+        uint8_t status[4];
+        nes_read_memory(nes, 0x6000, status, sizeof(status));
+        if (status[1] == 0xDE && status[2] == 0xB0 && status[3] == 0x61) {
+            has_status = true;
+            if (status[0] < 0x80) {
+                result->code = status[0];
+                result->outcome = status[0] == 0 ? TEST_PASSED : TEST_FAILED;
+                break;
+            } else if (status[0] == 0x81) {
+                if (reset_frame < 0 && !reset_done)
+                    reset_frame = result->frames + TEST_RESET_DELAY;
+                if (result->frames == reset_frame) {
+                    nes_reset(nes);
+                    reset_frame = -1;
+                    reset_done = true;
+                }
+            } else {
+                reset_done = false;
+            }
+            continue;
+        }
+
+        uint8_t *ram = nes_ram(nes);
+        if (0 == memcmp(ram, last_ram, NES_RAM_SIZE)) {
+            ++still_frames;
+        } else {
+            still_frames = 0;
+            memcpy(last_ram, ram, NES_RAM_SIZE);
+        }
+        if (!has_status && ram[0xF0] && still_frames >= TEST_SETTLE_FRAMES) {
+            result->code = ram[0xF0];
+            result->outcome = ram[0xF0] == 1 ? TEST_PASSED : TEST_FAILED;
+            break;
+        }
+    }
+
+    if (has_status)
+        result->text = read_test_text(nes);
+    nes_destroy(nes);
+    result->seconds = (time_ns() - start) / 1e9;
+}
+
+static int test_worker(void *data) {
+    test_job_t *job = data;
+    for (;;) {
+        int i = atomic_add(&job->next, 1);
+        if (i >= job->count) break;
+        run_test(&job->results[i], job->max_frames);
+    }
+    nes_release_thread();
+    return 0;
+}
+
+static bool is_test_rom_name(char *name) {
+    size_t len = strlen(name);
+    char *exts[] = { ".nes", ".zip", ".gz" };
+    for (size_t i=0; i<array_count(exts); ++i) {
+        size_t ext_len = strlen(exts[i]);
+        if (len < ext_len) continue;
+        bool match = true;
+        for (size_t j=0; j<ext_len; ++j)
+            if (tolower((unsigned char)name[len - ext_len + j]) != exts[i][j]) match = false;
+        if (match) return true;
+    }
+    return false;
+}
+
+static void add_test(test_result_t **results, char *dir, char *name) {
+    test_result_t result = {0};
+    if (dir) {
+        result.path = xmalloc(strlen(dir) + strlen(name) + 2);
+        sprintf(result.path, "%s/%s", dir, name);
+    } else {
+        result.path = xmalloc(strlen(name) + 1);
+        strcpy(result.path, name);
+    }
+    da_push(*results, result);
+}
+
+static int compare_test_paths(const void *a, const void *b) {
+    return strcmp(((test_result_t *)a)->path, ((test_result_t *)b)->path);
+}
+
+/* Adds the roms directly in dir, sorted by name. Returns false if dir isn't a
+ * directory. */
+static bool add_test_dir(test_result_t **results, char *dir) {
+    int first = da_len(*results);
+#ifdef _WIN32
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+    WIN32_FIND_DATAA found;
+    HANDLE find = FindFirstFileA(pattern, &found);
+    if (find == INVALID_HANDLE_VALUE)
+        return false;
+    do {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && is_test_rom_name(found.cFileName))
+            add_test(results, dir, found.cFileName);
+    } while (FindNextFileA(find, &found));
+    FindClose(find);
+#else
+    DIR *handle = opendir(dir);
+    if (!handle)
+        return false;
+    struct dirent *ent;
+    while ((ent = readdir(handle)))
+        if (is_test_rom_name(ent->d_name))
+            add_test(results, dir, ent->d_name);
+    closedir(handle);
+#endif
+    int added = da_len(*results) - first;
+    if (added > 1)
+        qsort(*results + first, added, sizeof(test_result_t), compare_test_paths);
+    return true;
+}
+
+static char *outcome_names[] = {
+    [TEST_PASSED]     = "passed",
+    [TEST_FAILED]     = "failed",
+    [TEST_TIMED_OUT]  = "timed out",
+    [TEST_NOT_LOADED] = "could not be loaded",
+};
+
+static void print_test_text(FILE *fp, char *prefix, char *text) {
+    for (char *line = text; *line; ) {
+        char *end = strchr(line, '\n');
+        int len = end ? (int)(end - line) : (int)strlen(line);
+        if (len) fprintf(fp, "%s%.*s\n", prefix, len, line);
+        line += len + (end ? 1 : 0);
+    }
+}
+
+static void print_tap(test_result_t *results, int count) {
+    printf("TAP version 13\n1..%d\n", count);
+    for (int i=0; i<count; ++i) {
+        test_result_t *r = &results[i];
+        printf("%s %d - %s (%d frames, %.3f s)\n", r->outcome == TEST_PASSED ? "ok" : "not ok",
+            i+1, r->path, r->frames, r->seconds);
+        if (r->outcome != TEST_PASSED) {
+            if (r->code >= 0)
+                printf("# %s with result %d\n", outcome_names[r->outcome], r->code);
+            else
+                printf("# %s\n", outcome_names[r->outcome]);
+            if (r->text)
+                print_test_text(stdout, "#   ", r->text);
+        }
+    }
+}
+
+static void write_xml_text(FILE *fp, char *text) {
+    for (unsigned char *c = (unsigned char *)text; *c; ++c) {
+        switch (*c) {
+        case '&': fputs("&amp;", fp); break;
+        case '<': fputs("&lt;", fp); break;
+        case '>': fputs("&gt;", fp); break;
+        case '"': fputs("&quot;", fp); break;
+        default:
+            // xml 1.0 allows no other control characters
+            if (*c >= 0x20 || *c == '\n' || *c == '\t') fputc(*c, fp);
+            break;
+        }
+    }
+}
+
+static bool write_junit(char *path, test_result_t *results, int count, double seconds) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    int failures = 0;
+    for (int i=0; i<count; ++i)
+        if (results[i].outcome != TEST_PASSED) ++failures;
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(fp, "<testsuite name=\"nes-test\" tests=\"%d\" failures=\"%d\" time=\"%.3f\">\n", count, failures, seconds);
+    for (int i=0; i<count; ++i) {
+        test_result_t *r = &results[i];
+        fprintf(fp, "  <testcase name=\"");
+        write_xml_text(fp, r->path);
+        fprintf(fp, "\" time=\"%.3f\">\n", r->seconds);
+        fprintf(fp, "    <properties><property name=\"frames\" value=\"%d\"/></properties>\n", r->frames);
+        if (r->outcome != TEST_PASSED) {
+            fprintf(fp, "    <failure message=\"%s", outcome_names[r->outcome]);
+            if (r->code >= 0) fprintf(fp, " with result %d", r->code);
+            fprintf(fp, "\">");
+            if (r->text) write_xml_text(fp, r->text);
+            fprintf(fp, "</failure>\n");
+        } else if (r->text) {
+            fprintf(fp, "    <system-out>");
+            write_xml_text(fp, r->text);
+            fprintf(fp, "</system-out>\n");
+        }
+        fprintf(fp, "  </testcase>\n");
+    }
+    fprintf(fp, "</testsuite>\n");
+
+    bool failed = ferror(fp);
+    if (fclose(fp) != 0) failed = true;
+    if (failed)
+        fprintf(stderr, "Failed to write %s\n", path);
+    return !failed;
+}
+
+static void print_usage(char *program) {
+    printf("Usage: %s [options] [ROM_OR_DIR...]\n"
+           "Runs test roms and prints the results as TAP. Directories run the roms in them.\n"
+           "Without arguments the apu and ppu tests in test-programs are run.\n"
+           "Options:\n"
+           "  --threads N           number of roms run at once (default one per cpu)\n"
+           "  --frames N            frames a rom gets to finish (default %d)\n"
+           "  --junit FILE          also write the results as JUnit XML to FILE\n",
+           program, TEST_DEFAULT_FRAMES);
+}
+
+int main(int argc, char **argv) {
+    test_result_t *results = NULL;
+    int thread_count = cpu_count();
+    int max_frames = TEST_DEFAULT_FRAMES;
+    char *junit_path = NULL;
+
+    for (int i=1; i<argc; ++i) {
+        char *arg = argv[i];
+        if (0 == strcmp(arg, "--threads") && i+1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (0 == strcmp(arg, "--frames") && i+1 < argc) {
+            max_frames = atoi(argv[++i]);
+        } else if (0 == strcmp(arg, "--junit") && i+1 < argc) {
+            junit_path = argv[++i];
+        } else if (arg[0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else if (!add_test_dir(&results, arg)) {
+            add_test(&results, NULL, arg);
+        }
+    }
+    if (!results) {
+        for (size_t i=0; i<array_count(default_test_dirs); ++i)
+            if (!add_test_dir(&results, default_test_dirs[i]))
+                fprintf(stderr, "Failed to read directory %s\n", default_test_dirs[i]);
+    }
+    int count = da_len(results);
+    if (count == 0) {
+        fprintf(stderr, "No test roms found\n");
+        return 1;
+    }
+    if (thread_count < 1 || max_frames < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    test_job_t job = {
+        .results = results,
+        .count = count,
+        .max_frames = max_frames,
+    };
+    atomic_set(&job.next, 0);
+
+    nes_set_verbose(false);
+
+    // the calling thread works too, extra threads are an optimization
+    uint64_t start = time_ns();
+    thread_t *threads[TEST_MAX_THREADS];
+    int extra = MIN(MIN(thread_count, TEST_MAX_THREADS), count) - 1;
+    int started = 0;
+    for (int i=0; i<extra; ++i) {
+        threads[started] = thread_create(test_worker, &job);
+        if (threads[started]) ++started;
+    }
+    test_worker(&job);
+    for (int i=0; i<started; ++i)
+        thread_join(threads[i]);
+    double seconds = (time_ns() - start) / 1e9;
+
+    print_tap(results, count);
+    int passed = 0;
+    for (int i=0; i<count; ++i)
+        if (results[i].outcome == TEST_PASSED) ++passed;
+    printf("# %d of %d passed in %.3f s on %d thread%s\n", passed, count, seconds,
+        started + 1, started ? "s" : "");
+
+    bool ok = passed == count;
+    if (junit_path && !write_junit(junit_path, results, count, seconds))
+        ok = false;
+
+    for (int i=0; i<count; ++i) {
+        free(results[i].path);
+        free(results[i].text);
+    }
+    da_free(results);
+    return ok ? 0 : 1;
+}
@@ -30,6 +30,12 @@ typedef union {
 #define SPR_ATTR_FLIP_HORIZ     (1 << 6)
 #define SPR_ATTR_FLIP_VERT      (1 << 7)
 
+#define PPU_DOTS_PER_LINE   341
+#define PPU_LINES_PER_FRAME 262
+#define PPU_DOTS_PER_FRAME  (PPU_DOTS_PER_LINE*PPU_LINES_PER_FRAME)
+#define PPU_SCANLINE_CLOCK_DOT 260          // when mappers see a scanline
+#define PPU_SCANLINE_CLOCKS_PER_FRAME 241   // scanlines 0-240
+
 typedef struct {
     uint8_t y, tile_id, attr, x;
 } oam_entry_t;
@@ -57,12 +63,11 @@ typedef struct {
     uint8_t spr_shifter_pat_hi[8];
     bool sprite_zero_hit_possible;
 
-    uint32_t colors[64];
-    uint32_t *screen_pixels;
     bool odd;
     bool frame_completed;
     bool nmi_occured;
     uint16_t cycle, scanline;
+    uint64_t timestamp; /* dots since power on, see ppu_timestamp */
 
     loopy_t vram_addr, vram_temp;
     uint8_t fine_x;
@@ -74,8 +79,15 @@ typedef struct {
     uint16_t bg_shifter_pat_hi;
     uint16_t bg_shifter_attr_lo;
     uint16_t bg_shifter_attr_hi;
+
+    /* host side, everything above is machine state, see ppu_save_state */
+    uint32_t colors[64];
+    uint32_t *screen_pixels;
+    bool skip_pixels;   /* see ppu_skip_pixels */
 } ppu_t;
 
+#define PPU_STATE_SIZE offsetof(ppu_t, colors)
+
 enum {
    PPUCTRL = 0,         /* $2000 */
    PPUMASK,             /* $2001 */
@@ -88,7 +100,7 @@ enum {
 };
 
 
-static ppu_t ppu = {
+static THREAD_LOCAL ppu_t ppu = {
 	/* palette generated from http://drag.wootest.net/misc/palgen.html this format is ARGB */
 	.colors = { 0x464646, 0x000154, 0x000070, 0x07006b, 0x280048, 0x3c000e, 0x3e0000, 0x2c0000, 0x0d0300, 0x001500, 0x001f00, 0x001f00, 0x001420, 0x000000, 0x000000, 0x000000, 0x9d9d9d, 0x0041b0, 0x1825d5, 0x4a0dcf, 0x75009f, 0x900153, 0x920f00, 0x7b2800, 0x514400, 0x205c00, 0x006900, 0x006916, 0x005a6a, 0x000000, 0x000000, 0x000000, 0xfeffff, 0x4896ff, 0x626dff, 0x8e5bff, 0xd45eff, 0xf160b4, 0xf36f5e, 0xdc8817, 0xb2a400, 0x7fbd00, 0x53ca28, 0x38ca76, 0x36bbcb, 0x2b2b2b, 0x000000, 0x000000, 0xfeffff, 0xb0d2ff, 0xb6bbff, 0xcbb4ff, 0xedbcff, 0xf9bde0, 0xfac3bd, 0xf0ce9f, 0xdfd990, 0xcae393, 0xb8e9a6, 0xade9c6, 0xace3e9, 0xa7a7a7, 0x000000, 0x000000 } };
 
@@ -329,8 +341,13 @@ void ppu_write(uint16_t addr, uint8_t data) {
             break;
         }
         case PPUMASK: 
+        {
+            bool was_rendering = MASK_SHOW_BG || MASK_SHOW_SPR;
             ppu.registers[PPUMASK] = data;
+            if ((MASK_SHOW_BG || MASK_SHOW_SPR) != was_rendering)
+                cart_rendering_changed(!was_rendering);
             break;
+        }
         case PPUSTATUS:
             break;
         case OAMADDR:
@@ -390,16 +407,25 @@ void ppu_write(uint16_t addr, uint8_t data) {
  *  +--------------- 0: Pattern table is at $0000-$1FFF
  */
 void rendering_tick(void) {
+    /* without pixel output the shifters and the background fetches only
+     * matter for sprite zero hits. the pre-render line and the start of line 0
+     * always fetch, so the picture is right when pixel output comes back on
+     * with the next frame, see ppu_tick */
+    bool need_pixels = !ppu.skip_pixels || ppu.sprite_zero_hit_possible || 
+        ppu.scanline == 261 || ppu.scanline == 0;
+    if (!need_pixels && (ppu.cycle & 7) && ppu.cycle != 257)
+        return; /* v only changes every 8 dots and sprites are evaluated at 257 */
+
     /* load low 8 bits of bg shift registers */
     if ((ppu.cycle > 1 && ppu.cycle < 258) || (ppu.cycle > 321 && ppu.cycle < 338)) {
-        if (MASK_SHOW_BG) {
+        if (MASK_SHOW_BG && need_pixels) {
             ppu.bg_shifter_pat_lo <<= 1; ppu.bg_shifter_pat_hi <<= 1;
             ppu.bg_shifter_attr_lo <<= 1; ppu.bg_shifter_attr_hi <<= 1;
         }
     }
 
     if (ppu.cycle > 0 && (ppu.cycle < 256 || ppu.cycle > 320) && ppu.cycle < 337) {
-        if (MASK_SHOW_SPR && ppu.cycle < 256) {
+        if (MASK_SHOW_SPR && ppu.cycle < 256 && need_pixels) {
             oam_entry_t *sprite;
             for (int i=0; i<ppu.sprite_count_scanline; ++i) {
                 sprite = ppu.oam2+i;
@@ -413,7 +439,10 @@ void rendering_tick(void) {
         }
 
         loopy_t *v = &ppu.vram_addr;
-        switch ((ppu.cycle - 1) % 8) {
+        int step = (ppu.cycle - 1) % 8;
+        if (!need_pixels && step != 7)
+            step = -1; /* only the increment of v is seen by the cpu */
+        switch (step) {
         case 0:
             /* load current tile into shifters */
             ppu.bg_shifter_attr_lo = (ppu.bg_shifter_attr_lo & 0xFF00) | ((ppu.at_byte & 1) ? 0xFF : 0);
@@ -493,7 +522,7 @@ void rendering_tick(void) {
 
         ppu_evaluate_sprites();
 
-    } else if (ppu.cycle == 337 || ppu.cycle == 339) {
+    } else if ((ppu.cycle == 337 || ppu.cycle == 339) && need_pixels) {
         /* unused nametable fetch */
         loopy_t *v = &ppu.vram_addr;
         ppu.nt_byte = ppu_bus_read(0x2000 | (v->reg & 0x0FFF));
@@ -574,13 +603,39 @@ void render_pixel(void) {
     }
 
     uint32_t pixel = get_color_from_palette(pal_num, pal_index);
-    ppu.screen_pixels[ppu.scanline * NES_WIDTH + ppu.cycle] = pixel;
+    ppu.screen_pixels[ppu.scanline * PPU_WIDTH + ppu.cycle] = pixel;
+}
+
+/* What's left of render_pixel without pixel output, the only part the cpu
+ * can see. Sprite zero is first in secondary oam when it can hit. */
+static void check_sprite_zero_hit(void) {
+    if (ppu.oam2[0].x != 0)
+        return;
+    uint8_t fg_pal_index = 
+        ((ppu.spr_shifter_pat_lo[0] >> 7) & 1) |
+        (((ppu.spr_shifter_pat_hi[0] >> 7) & 1) << 1);
+
+    uint8_t bitnum = 15 - ppu.fine_x;
+    uint8_t bg_pal_index = 
+        ((ppu.bg_shifter_pat_lo >> bitnum) & 1) |
+        (((ppu.bg_shifter_pat_hi >> bitnum) & 1) << 1);
+    if (ppu.cycle < 8 && !MASK_SHOW_BG_LEFT)
+        bg_pal_index = 0;
+
+    do_sprite_zero_hit(fg_pal_index, bg_pal_index);
 }
 
 void ppu_tick(void) {
     if (ppu.scanline < 240) {
         if (MASK_SHOW_SPR || MASK_SHOW_BG) rendering_tick();
-        if (ppu.cycle < 256) render_pixel();
+        if (ppu.cycle < 256) {
+            // the frame ends in the middle of a cpu cycle, so the first dots
+            // of line 0 are emulated with the frame before
+            if (!ppu.skip_pixels || (ppu.scanline == 0 && ppu.cycle < 4))
+                render_pixel();
+            else if (ppu.sprite_zero_hit_possible && MASK_SHOW_SPR && MASK_SHOW_BG)
+                check_sprite_zero_hit();
+        }
     } else if (ppu.scanline == 241 && ppu.cycle == 1) {
         ppu.registers[PPUSTATUS] |= 0x80;      /* set vblank */
         ppu.nmi_occured = true;
@@ -611,15 +666,18 @@ void ppu_tick(void) {
             ppu.scanline = 0;
             ppu.frame_completed = true;
             ppu.odd = !ppu.odd;
+            ppu.timestamp += 2;
             return;
         }
     }
 
-	if ((MASK_SHOW_SPR || MASK_SHOW_BG) && (ppu.scanline < 241 && ppu.cycle == 260)) {
+	if ((MASK_SHOW_SPR || MASK_SHOW_BG) && 
+		(ppu.scanline < PPU_SCANLINE_CLOCKS_PER_FRAME && ppu.cycle == PPU_SCANLINE_CLOCK_DOT)) {
 		// NOTE(shaw): this allows mappers to keep track of ppu scanlines
 		cart_scanline();
 	}
 
+    ++ppu.timestamp;
     if (++ppu.cycle > 340) {
         ppu.cycle = 0;
         if (++ppu.scanline > 261) {
@@ -658,9 +716,72 @@ uint8_t *ppu_get_oam(void) {
     return ppu.oam;
 }
 
+/* The ARGB color of each of the 64 palette entries */
+uint32_t *ppu_get_colors(void) {
+    return ppu.colors;
+}
+
 void ppu_reset(void) {
+	bool was_rendering = MASK_SHOW_BG || MASK_SHOW_SPR;
 	memset(ppu.registers, 0, sizeof(ppu.registers));
 	ppu.odd = 0;
+	if (was_rendering)
+		cart_rendering_changed(false);
 }
 
+/* The time in ppu dots, frame * PPU_DOTS_PER_FRAME + scanline * 341 + cycle.
+ * Every frame counts as the full 341 * 262 dots, including odd frames that
+ * skip a dot, so times within a frame can be computed ahead, see
+ * ppu_scanline_clock_time. */
+uint64_t ppu_timestamp(void) {
+	return ppu.timestamp;
+}
 
+bool ppu_rendering_enabled(void) {
+	return MASK_SHOW_BG || MASK_SHOW_SPR;
+}
+
+/* Mappers that count scanlines are clocked at dot PPU_SCANLINE_CLOCK_DOT of
+ * scanlines 0-240 while rendering is enabled, see cart_scanline in ppu_tick.
+ * Returns the number of such clock points before timestamp. */
+uint64_t ppu_scanline_clocks_before(uint64_t timestamp) {
+	uint64_t frame = timestamp / PPU_DOTS_PER_FRAME;
+	uint64_t dot = timestamp % PPU_DOTS_PER_FRAME;
+	uint64_t in_frame = dot > PPU_SCANLINE_CLOCK_DOT 
+		? MIN((dot - PPU_SCANLINE_CLOCK_DOT - 1) / PPU_DOTS_PER_LINE + 1, PPU_SCANLINE_CLOCKS_PER_FRAME)
+		: 0;
+	return frame * PPU_SCANLINE_CLOCKS_PER_FRAME + in_frame;
+}
+
+/* The timestamp of scanline clock point number index, counting from 0 */
+uint64_t ppu_scanline_clock_time(uint64_t index) {
+	return (index / PPU_SCANLINE_CLOCKS_PER_FRAME) * PPU_DOTS_PER_FRAME +
+		(index % PPU_SCANLINE_CLOCKS_PER_FRAME) * PPU_DOTS_PER_LINE + PPU_SCANLINE_CLOCK_DOT;
+}
+
+
+
+/* Clears everything but the host side */
+void ppu_power_on(void) {
+	memset(&ppu, 0, PPU_STATE_SIZE);
+}
+
+/* Frames emulated with skip set leave the screen untouched, while everything
+ * the cpu can see, like sprite zero hits, stays exact. Used for frames that
+ * are never shown, see emulate_frame_run_ahead, and machines that are only
+ * watched through their ram. */
+void ppu_skip_pixels(bool skip) {
+	ppu.skip_pixels = skip;
+}
+
+uint32_t ppu_state_size(void) {
+	return PPU_STATE_SIZE;
+}
+
+void ppu_save_state(uint8_t *out) {
+	memcpy(out, &ppu, PPU_STATE_SIZE);
+}
+
+void ppu_load_state(uint8_t *in) {
+	memcpy(&ppu, in, PPU_STATE_SIZE);
+}
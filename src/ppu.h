@@ -1,6 +1,10 @@
 #ifndef _PPU_H
 #define _PPU_H
 
+/* PPU_WIDTH and HEIGHT is size output by the ppu */
+#define PPU_WIDTH  256
+#define PPU_HEIGHT 240
+
 void ppu_init(uint32_t *pixels);
 uint8_t ppu_read(uint16_t addr);
 void ppu_write(uint16_t addr, uint8_t data);
@@ -9,9 +13,17 @@ bool ppu_frame_completed(void);
 void ppu_clear_frame_completed(void);
 bool ppu_nmi(void);
 void ppu_clear_nmi(void);
-void update_palettes(sprite_t palettes[8]);
-void update_pattern_tables(int selected_palette, sprite_t pattern_tables[2]);
 void ppu_reset(void);
+void ppu_power_on(void);
+uint64_t ppu_timestamp(void);
+bool ppu_rendering_enabled(void);
+uint64_t ppu_scanline_clocks_before(uint64_t timestamp);
+uint64_t ppu_scanline_clock_time(uint64_t index);
+void ppu_skip_pixels(bool skip);
+uint32_t ppu_state_size(void);
+void ppu_save_state(uint8_t *out);
+void ppu_load_state(uint8_t *in);
+uint32_t *ppu_get_colors(void);
 
 /* for debug sidebar to render oam info */
 uint8_t *ppu_get_oam(void);
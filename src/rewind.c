@@ -0,0 +1,196 @@
+/*
+ * Rewind
+ *
+ * A save state is recorded every frame into a ring buffer with a fixed
+ * memory budget, the oldest states are dropped to make room.
+ *
+ * Only the newest state is kept whole. Every older state is stored as the
+ * xor of itself and its successor, run length encoded: most of a state is
+ * ram that barely changes from one frame to the next, so the deltas are a
+ * few hundred bytes. Stepping back one frame decodes a single delta onto the
+ * newest state, so it costs the same however far back the ring goes and no
+ * key frames are needed.
+ *
+ * Delta encoding, repeated until the whole state is covered:
+ *    varint: number of unchanged bytes to skip
+ *    varint: number of changed bytes n
+ *    n bytes: old ^ new
+ * Varints are 7 bits per byte, low bits first, high bit set if more follow.
+ */
+
+#define REWIND_MAX_FRAMES (60*60*30) // 30 minutes of frames, whatever the budget
+#define REWIND_MIN_SKIP 4            // shorter unchanged runs are kept in the literal
+
+typedef struct {
+    size_t offset; // in rewind_ring.data
+    size_t size;
+} rewind_entry_t;
+
+static struct {
+    bool enabled;
+    uint8_t *data;            // ring of encoded deltas
+    size_t capacity;
+    size_t head;              // where the next delta goes
+    rewind_entry_t *entries;  // ring of REWIND_MAX_FRAMES, oldest at first
+    uint32_t first, count;
+    size_t state_size;
+    uint8_t *newest;          // the last state pushed, or reached by rewind_pop
+    uint8_t *next;            // the state being pushed
+    uint8_t *scratch;         // encoded delta, before it's copied into the ring
+    bool has_newest;
+} rewind_ring;
+
+void rewind_init(size_t budget) {
+    if (budget == 0) return;
+    rewind_ring.enabled = true;
+    rewind_ring.capacity = budget;
+    rewind_ring.data = xmalloc(budget);
+    rewind_ring.entries = xmalloc(REWIND_MAX_FRAMES * sizeof(rewind_entry_t));
+}
+
+static uint64_t rewind_load_u64(uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint8_t *put_varint(uint8_t *p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static uint8_t *get_varint(uint8_t *p, size_t *v) {
+    *v = 0;
+    for (int shift=0; ; shift += 7) {
+        *v |= (size_t)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
+}
+
+/* Encodes the delta from a to b into out, which must have room for
+ * 2*size + 16 bytes. Returns the encoded size. */
+static size_t encode_delta(uint8_t *a, uint8_t *b, size_t size, uint8_t *out) {
+    uint8_t *start = out;
+    size_t i = 0;
+    while (i < size) {
+        size_t changed = i;
+        while (changed + 8 <= size && rewind_load_u64(a + changed) == rewind_load_u64(b + changed))
+            changed += 8;
+        while (changed < size && a[changed] == b[changed])
+            ++changed;
+
+        // the literal runs until REWIND_MIN_SKIP unchanged bytes in a row
+        size_t end = changed;
+        while (end < size) {
+            size_t same = 0;
+            while (end + same < size && same < REWIND_MIN_SKIP && a[end + same] == b[end + same])
+                ++same;
+            if (same == REWIND_MIN_SKIP || end + same == size)
+                break;
+            end += same + 1;
+        }
+
+        out = put_varint(out, changed - i);
+        out = put_varint(out, end - changed);
+        for (size_t k=changed; k<end; ++k)
+            *out++ = a[k] ^ b[k];
+        i = end;
+    }
+    return (size_t)(out - start);
+}
+
+/* Applies a delta to state, which turns either side of it into the other.
+ * Runs that would end past the state stop it. */
+static void apply_delta(uint8_t *state, size_t size, uint8_t *delta) {
+    size_t i = 0;
+    while (i < size) {
+        size_t skip, n;
+        delta = get_varint(delta, &skip);
+        delta = get_varint(delta, &n);
+        if (skip > size - i || n > size - i - skip)
+            return;
+        i += skip;
+        for (size_t k=0; k<n; ++k)
+            state[i + k] ^= delta[k];
+        delta += n;
+        i += n;
+    }
+}
+
+static void drop_oldest(void) {
+    rewind_ring.first = (rewind_ring.first + 1) % REWIND_MAX_FRAMES;
+    --rewind_ring.count;
+}
+
+/* Makes room for n bytes at rewind_ring.head, dropping the oldest deltas in the way */
+static bool rewind_alloc(size_t n) {
+    if (n > rewind_ring.capacity)
+        return false;
+    if (rewind_ring.head + n > rewind_ring.capacity) {
+        // the oldest deltas are what's left of the last lap, past head. the
+        // new lap would overwrite them out of order, so they all go first
+        while (rewind_ring.count && rewind_ring.entries[rewind_ring.first].offset >= rewind_ring.head)
+            drop_oldest();
+        rewind_ring.head = 0;
+    }
+    while (rewind_ring.count) {
+        rewind_entry_t *oldest = &rewind_ring.entries[rewind_ring.first];
+        if (oldest->offset >= rewind_ring.head + n || oldest->offset + oldest->size <= rewind_ring.head)
+            break;
+        drop_oldest();
+    }
+    if (rewind_ring.count == REWIND_MAX_FRAMES)
+        drop_oldest();
+    return true;
+}
+
+/* Records the state of the machine, called after every emulated frame */
+void rewind_push(cpu_t *cpu) {
+    if (!rewind_ring.enabled) return;
+
+    if (!rewind_ring.newest) {
+        rewind_ring.state_size = nes_state_size();
+        rewind_ring.newest = xmalloc(rewind_ring.state_size);
+        rewind_ring.next = xmalloc(rewind_ring.state_size);
+        rewind_ring.scratch = xmalloc(2*rewind_ring.state_size + 16);
+    }
+    nes_save_state(cpu, rewind_ring.next, rewind_ring.state_size);
+
+    if (rewind_ring.has_newest) {
+        size_t n = encode_delta(rewind_ring.newest, rewind_ring.next, rewind_ring.state_size, rewind_ring.scratch);
+        if (rewind_alloc(n)) {
+            uint32_t slot = (rewind_ring.first + rewind_ring.count) % REWIND_MAX_FRAMES;
+            rewind_ring.entries[slot] = (rewind_entry_t){ .offset = rewind_ring.head, .size = n };
+            memcpy(rewind_ring.data + rewind_ring.head, rewind_ring.scratch, n);
+            rewind_ring.head += n;
+            ++rewind_ring.count;
+        } else {
+            // a delta bigger than the whole budget, history starts over
+            rewind_ring.count = 0;
+            rewind_ring.head = 0;
+        }
+    }
+
+    uint8_t *swap = rewind_ring.newest;
+    rewind_ring.newest = rewind_ring.next;
+    rewind_ring.next = swap;
+    rewind_ring.has_newest = true;
+}
+
+/* Loads the state from one frame before the newest one and makes it the
+ * newest. Returns false once there's nothing older left. */
+bool rewind_pop(cpu_t *cpu) {
+    if (!rewind_ring.enabled || rewind_ring.count == 0)
+        return false;
+    uint32_t slot = (rewind_ring.first + rewind_ring.count - 1) % REWIND_MAX_FRAMES;
+    rewind_entry_t *entry = &rewind_ring.entries[slot];
+    apply_delta(rewind_ring.newest, rewind_ring.state_size, rewind_ring.data + entry->offset);
+    // the newest delta is the last one written, so its space is free again
+    rewind_ring.head = entry->offset;
+    --rewind_ring.count;
+    return nes_load_state(cpu, rewind_ring.newest, rewind_ring.state_size);
+}
@@ -0,0 +1,12 @@
+#ifndef __REWIND_H__
+#define __REWIND_H__
+
+#define REWIND_DEFAULT_MB 64
+
+struct cpu_t;
+
+void rewind_init(size_t budget);
+void rewind_push(struct cpu_t *cpu);
+bool rewind_pop(struct cpu_t *cpu);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Rom database, for dumps whose headers are wrong or missing information.
+ *
+ * Games are identified by the crc32 of their prg rom followed by chr rom,
+ * which doesn't depend on the header or a trainer. The database is a sorted
+ * array of fixed size records that is memory mapped and binary searched, so
+ * opening it costs nothing however many games it holds.
+ *
+ * Binary format, all values little endian:
+ *    0-7: "NESROMDB"
+ *    8-11: version, ROMDB_VERSION
+ *    12-15: number of records
+ *    16-: records, ROMDB_RECORD_SIZE bytes each, sorted by crc, no duplicates
+ *
+ * Record:
+ *    0-3: crc32
+ *    4-5: mapper
+ *    6: submapper
+ *    7: bits 0-1 mirroring, bit 2 battery, bits 4-5 timing
+ *    8: prg ram, low nibble volatile, high nibble battery backed
+ *    9: chr ram, low nibble volatile, high nibble battery backed
+ *       ram sizes are 64 << n bytes, 0 means none, the same as NES 2.0
+ *    10: hints
+ *    11-15: reserved, zero
+ *
+ * The binary file is built from a text file with --build-romdb, one game per
+ * line, # starts a comment:
+ *    CRC32 MAPPER[.SUB] MIRROR PRG_RAM PRG_NVRAM CHR_RAM CHR_NVRAM TIMING [HINTS]
+ *    e.g. 1A2B3C4D 4.0 V 0 8K 0 0 ntsc noframeskip,norunahead
+ * MIRROR is H, V or 4 (four screen), sizes are bytes with an optional K
+ * suffix, TIMING is ntsc, pal, multi or dendy.
+ */
+
+#define ROMDB_VERSION 1
+#define ROMDB_HEADER_SIZE 16
+#define ROMDB_RECORD_SIZE 16
+#define ROMDB_MAX_LINE 512
+
+static mapped_file_t romdb_file;
+static uint8_t *romdb_records;
+static uint32_t romdb_count;
+
+static uint32_t romdb_ram_size(uint8_t shift) {
+    return shift ? 64u << shift : 0;
+}
+
+/* Maps the database at path. Returns false, leaving lookups to always miss,
+ * if it doesn't exist or isn't a valid database. */
+bool romdb_open(char *path) {
+    romdb_close();
+    if (!map_file_readonly(path, &romdb_file))
+        return false;
+
+    uint8_t *data = romdb_file.data;
+    if (romdb_file.size < ROMDB_HEADER_SIZE || 0 != memcmp(data, "NESROMDB", 8) ||
+        get_le32(data + 8) != ROMDB_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %d rom database\n", path, ROMDB_VERSION);
+        romdb_close();
+        return false;
+    }
+    uint32_t count = get_le32(data + 12);
+    if ((romdb_file.size - ROMDB_HEADER_SIZE) / ROMDB_RECORD_SIZE < count) {
+        fprintf(stderr, "Rom database %s is truncated\n", path);
+        romdb_close();
+        return false;
+    }
+    romdb_records = data + ROMDB_HEADER_SIZE;
+    romdb_count = count;
+    return true;
+}
+
+void romdb_close(void) {
+    unmap_file(&romdb_file);
+    romdb_records = NULL;
+    romdb_count = 0;
+}
+
+bool romdb_lookup(uint32_t crc, romdb_entry_t *entry) {
+    uint32_t lo = 0, hi = romdb_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint8_t *rec = romdb_records + (size_t)mid * ROMDB_RECORD_SIZE;
+        uint32_t rec_crc = get_le32(rec);
+        if (rec_crc < crc) {
+            lo = mid + 1;
+        } else if (rec_crc > crc) {
+            hi = mid;
+        } else {
+            *entry = (romdb_entry_t){
+                .crc = crc,
+                .mapper = rec[4] | rec[5] << 8,
+                .submapper = rec[6],
+                .mirroring = rec[7] & 0x3,
+                .battery = rec[7] & 0x4,
+                .timing = (rec[7] >> 4) & 0x3,
+                .prg_ram_size = romdb_ram_size(rec[8] & 0xF) + romdb_ram_size(rec[8] >> 4),
+                .chr_ram_size = romdb_ram_size(rec[9] & 0xF) + romdb_ram_size(rec[9] >> 4),
+                .hints = rec[10],
+            };
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// building the database from text
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t bytes[ROMDB_RECORD_SIZE];
+} romdb_record_t;
+
+static int compare_records(const void *a, const void *b) {
+    uint32_t crc_a = get_le32(((romdb_record_t *)a)->bytes);
+    uint32_t crc_b = get_le32(((romdb_record_t *)b)->bytes);
+    return crc_a < crc_b ? -1 : crc_a > crc_b;
+}
+
+/* Parses a ram size in bytes, with an optional K suffix, into the 64 << n
+ * encoding. Returns -1 for sizes that can't be encoded. */
+static int parse_ram_shift(char *field) {
+    char *end;
+    unsigned long size = strtoul(field, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        size *= 1024;
+        ++end;
+    }
+    if (*end || end == field) return -1;
+    if (size == 0) return 0;
+    for (int shift=1; shift<16; ++shift)
+        if (64ul << shift == size) return shift;
+    return -1;
+}
+
+static bool parse_record(char *line, romdb_record_t *rec) {
+    char *fields[10];
+    int count = 0;
+    for (char *tok = strtok(line, " \t\r\n"); tok && count < 10; tok = strtok(NULL, " \t\r\n"))
+        fields[count++] = tok;
+    if (count < 8) return false;
+
+    memset(rec, 0, sizeof(*rec));
+    char *end;
+    uint32_t crc = (uint32_t)strtoul(fields[0], &end, 16);
+    if (*end) return false;
+    put_le32(rec->bytes, crc);
+
+    unsigned long mapper = strtoul(fields[1], &end, 10), submapper = 0;
+    if (*end == '.') submapper = strtoul(end+1, &end, 10);
+    if (*end || mapper > 0xFFF || submapper > 0xF) return false;
+    rec->bytes[4] = mapper & 0xFF;
+    rec->bytes[5] = mapper >> 8;
+    rec->bytes[6] = (uint8_t)submapper;
+
+    uint8_t flags;
+    if (0 == strcmp(fields[2], "H")) flags = ROMDB_MIRROR_HORIZONTAL;
+    else if (0 == strcmp(fields[2], "V")) flags = ROMDB_MIRROR_VERTICAL;
+    else if (0 == strcmp(fields[2], "4")) flags = ROMDB_MIRROR_FOUR_SCREEN;
+    else return false;
+
+    int prg_ram = parse_ram_shift(fields[3]), prg_nvram = parse_ram_shift(fields[4]);
+    int chr_ram = parse_ram_shift(fields[5]), chr_nvram = parse_ram_shift(fields[6]);
+    if (prg_ram < 0 || prg_nvram < 0 || chr_ram < 0 || chr_nvram < 0) return false;
+    rec->bytes[8] = (uint8_t)(prg_ram | prg_nvram << 4);
+    rec->bytes[9] = (uint8_t)(chr_ram | chr_nvram << 4);
+    if (prg_nvram || chr_nvram) flags |= 0x4;
+
+    static char *timings[] = { "ntsc", "pal", "multi", "dendy" };
+    int timing = -1;
+    for (size_t i=0; i<array_count(timings); ++i)
+        if (0 == strcmp(fields[7], timings[i])) timing = (int)i;
+    if (timing < 0) return false;
+    rec->bytes[7] = flags | (uint8_t)(timing << 4);
+
+    if (count > 8 && 0 != strcmp(fields[8], "-")) {
+        for (char *hint = strtok(fields[8], ","); hint; hint = strtok(NULL, ",")) {
+            if (0 == strcmp(hint, "noframeskip")) rec->bytes[10] |= ROMDB_HINT_NO_FRAMESKIP;
+            else if (0 == strcmp(hint, "norunahead")) rec->bytes[10] |= ROMDB_HINT_NO_RUN_AHEAD;
+            else return false;
+        }
+    }
+    return true;
+}
+
+/* Compiles the text database at text_path into the binary format at db_path.
+ * Prints the offending line and returns false on errors. */
+bool romdb_build(char *text_path, char *db_path) {
+    FILE *in = fopen(text_path, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", text_path, strerror(errno));
+        return false;
+    }
+
+    romdb_record_t *records = NULL;
+    char line[ROMDB_MAX_LINE];
+    int line_number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), in)) {
+        ++line_number;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = 0;
+        char *p = line;
+        while (isspace((unsigned char)*p)) ++p;
+        if (!*p) continue;
+
+        romdb_record_t rec;
+        if (!parse_record(p, &rec)) {
+            fprintf(stderr, "%s:%d: invalid rom database entry\n", text_path, line_number);
+            ok = false;
+        } else {
+            da_push(records, rec);
+        }
+    }
+    fclose(in);
+
+    uint32_t count = (uint32_t)da_lenu(records);
+    if (ok && count) {
+        qsort(records, count, sizeof(*records), compare_records);
+        for (uint32_t i=1; i<count; ++i) {
+            if (0 == compare_records(&records[i-1], &records[i])) {
+                fprintf(stderr, "%s: duplicate entry for crc %08X\n", text_path, get_le32(records[i].bytes));
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    if (ok) {
+        FILE *out = fopen(db_path, "wb");
+        if (!out) {
+            fprintf(stderr, "Failed to open %s: %s\n", db_path, strerror(errno));
+            ok = false;
+        } else {
+            uint8_t header[ROMDB_HEADER_SIZE];
+            memcpy(header, "NESROMDB", 8);
+            put_le32(header + 8, ROMDB_VERSION);
+            put_le32(header + 12, count);
+            fwrite(header, 1, sizeof(header), out);
+            if (count) fwrite(records, sizeof(*records), count, out);
+            bool failed = ferror(out);
+            if (fclose(out)) failed = true;
+            if (failed) {
+                fprintf(stderr, "Failed to write %s\n", db_path);
+                ok = false;
+            } else {
+                printf("Wrote %u entries to %s\n", count, db_path);
+            }
+        }
+    }
+    da_free(records);
+    return ok;
+}
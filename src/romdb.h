@@ -0,0 +1,36 @@
+#ifndef __ROMDB_H__
+#define __ROMDB_H__
+
+typedef enum {
+    TIMING_NTSC,
+    TIMING_PAL,
+    TIMING_MULTI,
+    TIMING_DENDY,
+} tv_timing_t;
+
+// per game hints, for features that trade accuracy for speed
+#define ROMDB_HINT_NO_FRAMESKIP 0x01 // needs every frame rendered, e.g. sprite 0 hit polling
+#define ROMDB_HINT_NO_RUN_AHEAD 0x02 // state can't be rolled back cheaply or safely
+
+#define ROMDB_MIRROR_HORIZONTAL 0
+#define ROMDB_MIRROR_VERTICAL 1
+#define ROMDB_MIRROR_FOUR_SCREEN 2
+
+typedef struct {
+    uint32_t crc;           // crc32 of prg rom followed by chr rom
+    uint16_t mapper;
+    uint8_t submapper;
+    uint8_t mirroring;      // ROMDB_MIRROR_*
+    bool battery;
+    uint32_t prg_ram_size;  // including battery backed ram
+    uint32_t chr_ram_size;
+    tv_timing_t timing;
+    uint8_t hints;          // ROMDB_HINT_*
+} romdb_entry_t;
+
+bool romdb_open(char *path);
+void romdb_close(void);
+bool romdb_lookup(uint32_t crc, romdb_entry_t *entry);
+bool romdb_build(char *text_path, char *db_path);
+
+#endif
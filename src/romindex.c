@@ -0,0 +1,389 @@
+/*
+ * Rom library index, for launchers that need to list thousands of roms
+ * without opening each one.
+ *
+ * index_rom_directory walks a directory tree for .nes, .zip and .gz files
+ * and inspects them on a pool of threads, using the same unpacking, header
+ * parsing and rom database correction as loading a rom. Files whose size and
+ * modification time match the previous index are not read again, so a
+ * rescan of an unchanged library only costs the directory walk.
+ *
+ * File format, all values little endian:
+ *    0-7: "NESINDEX"
+ *    8-11: version, ROMINDEX_VERSION
+ *    12-15: number of entries
+ *    16-: entries sorted by path, each ROMINDEX_ENTRY_SIZE bytes followed by
+ *         the path
+ *
+ * Entry:
+ *    0-7: modification time, ns since 1970 (100ns ticks since 1601 on windows)
+ *    8-15: file size
+ *    16-19: crc32 of prg rom followed by chr rom
+ *    20-23: prg rom size
+ *    24-27: chr rom size
+ *    28-31: prg ram size
+ *    32-33: mapper
+ *    34: submapper
+ *    35: flags, ROMINDEX_*
+ *    36: timing, tv_timing_t
+ *    37: hints, ROMDB_HINT_*
+ *    38-39: path length
+ *    path, relative to the indexed directory, '/' separated, no terminator
+ *
+ * Everything but the path, times and size is only meaningful with
+ * ROMINDEX_VALID set.
+ */
+
+#define ROMINDEX_VERSION 1
+#define ROMINDEX_HEADER_SIZE 16
+#define ROMINDEX_ENTRY_SIZE 40
+#define ROMINDEX_MAX_THREADS 64
+
+typedef struct {
+    char *path;
+    uint64_t mtime;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t prg_rom_size;
+    uint32_t chr_rom_size;
+    uint32_t prg_ram_size;
+    uint16_t mapper;
+    uint8_t submapper;
+    uint8_t flags;
+    uint8_t timing;
+    uint8_t hints;
+} rom_index_entry_t;
+
+typedef struct {
+    char *dir;
+    rom_index_entry_t *entries;
+    uint32_t *work;        // entries that need to be read
+    int work_count;
+    atomic_int_t next;     // next index into work to hand out
+} index_job_t;
+
+static char *join_path(char *a, char *b) {
+    size_t len_a = strlen(a);
+    char *path = xmalloc(len_a + strlen(b) + 2);
+    strcpy(path, a);
+    if (len_a && a[len_a-1] != '/' && a[len_a-1] != '\\')
+        strcat(path, "/");
+    strcat(path, b);
+    return path;
+}
+
+static bool has_extension(char *name, char *ext) {
+    size_t len = strlen(name), ext_len = strlen(ext);
+    if (len < ext_len) return false;
+    for (size_t i=0; i<ext_len; ++i)
+        if (tolower((unsigned char)name[len - ext_len + i]) != ext[i]) return false;
+    return true;
+}
+
+static bool is_rom_file_name(char *name) {
+    return has_extension(name, ".nes") || has_extension(name, ".zip") || has_extension(name, ".gz");
+}
+
+static int compare_entry_paths(const void *a, const void *b) {
+    return strcmp(((rom_index_entry_t *)a)->path, ((rom_index_entry_t *)b)->path);
+}
+
+static void add_rom_file(rom_index_entry_t **entries, char *rel, uint64_t mtime, uint64_t size) {
+    rom_index_entry_t entry = { .path = xmalloc(strlen(rel) + 1), .mtime = mtime, .size = size };
+    strcpy(entry.path, rel);
+    da_push(*entries, entry);
+}
+
+#ifndef _WIN32
+// in ns, so a rom rewritten within a second of being indexed is still noticed
+static uint64_t file_mtime(struct stat *st) {
+#ifdef __APPLE__
+    struct timespec t = st->st_mtimespec;
+#else
+    struct timespec t = st->st_mtim;
+#endif
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+#endif
+
+/* Adds every .nes, .zip and .gz file under root/rel to entries. Symlinked directories are
+ * not followed, so links can't make the walk loop. */
+static void walk_directory(char *root, char *rel, rom_index_entry_t **entries) {
+    char *dir = rel ? join_path(root, rel) : root;
+#ifdef _WIN32
+    char *pattern = join_path(dir, "*");
+    WIN32_FIND_DATAA found;
+    HANDLE find = FindFirstFileA(pattern, &found);
+    free(pattern);
+    if (find == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to read directory %s: error %lu\n", dir, GetLastError());
+    } else {
+        do {
+            char *name = found.cFileName;
+            if (0 == strcmp(name, ".") || 0 == strcmp(name, "..")) continue;
+            char *child = rel ? join_path(rel, name) : join_path("", name);
+            if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                if (!(found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                    walk_directory(root, child, entries);
+            } else if (is_rom_file_name(name)) {
+                uint64_t mtime = (uint64_t)found.ftLastWriteTime.dwHighDateTime << 32 | found.ftLastWriteTime.dwLowDateTime;
+                uint64_t size = (uint64_t)found.nFileSizeHigh << 32 | found.nFileSizeLow;
+                add_rom_file(entries, child, mtime, size);
+            }
+            free(child);
+        } while (FindNextFileA(find, &found));
+        FindClose(find);
+    }
+#else
+    DIR *handle = opendir(dir);
+    if (!handle) {
+        fprintf(stderr, "Failed to read directory %s: %s\n", dir, strerror(errno));
+    } else {
+        struct dirent *ent;
+        while ((ent = readdir(handle))) {
+            char *name = ent->d_name;
+            if (0 == strcmp(name, ".") || 0 == strcmp(name, "..")) continue;
+            char *child = rel ? join_path(rel, name) : join_path("", name);
+            char *full = join_path(root, child);
+            struct stat st;
+            if (lstat(full, &st) == 0) {
+                if (S_ISDIR(st.st_mode))
+                    walk_directory(root, child, entries);
+                else if (is_rom_file_name(name) && (S_ISREG(st.st_mode) || (S_ISLNK(st.st_mode) && stat(full, &st) == 0 && S_ISREG(st.st_mode))))
+                    add_rom_file(entries, child, file_mtime(&st), (uint64_t)st.st_size);
+            }
+            free(full);
+            free(child);
+        }
+        closedir(handle);
+    }
+#endif
+    if (rel) free(dir);
+}
+
+/* Reads one rom and fills in its entry. Runs on the index threads. */
+static void inspect_index_entry(char *dir, rom_index_entry_t *entry) {
+    char *path = join_path(dir, entry->path);
+    mapped_file_t file;
+    if (map_file_readonly(path, &file)) {
+        uint8_t *data = file.data, *unpacked = NULL;
+        size_t size = file.size;
+        if (is_archive(data, size)) {
+            unpacked = unpack_archive(data, size, path, &size);
+            data = unpacked;
+        }
+        ines_header_t header;
+        size_t offset;
+        char *error = data ? inspect_rom(data, size, &header, &offset) : NULL;
+        if (!data) {
+            // unpack_archive already said why
+        } else if (error) {
+            fprintf(stderr, "%s: %s\n", path, error);
+        } else {
+            entry->crc = header.crc;
+            entry->prg_rom_size = header.prg_rom_size;
+            entry->chr_rom_size = header.chr_rom_size;
+            entry->prg_ram_size = header.prg_ram_size;
+            entry->mapper = header.mapper;
+            entry->submapper = header.submapper;
+            entry->timing = (uint8_t)header.timing;
+            entry->hints = header.hints;
+            entry->flags = ROMINDEX_VALID;
+            if (mapper_supported(header.mapper)) entry->flags |= ROMINDEX_SUPPORTED;
+            if (header.battery_ram) entry->flags |= ROMINDEX_BATTERY;
+            if (header.mirror == MIRROR_VERTICAL) entry->flags |= ROMINDEX_VERTICAL;
+            if (header.four_screen) entry->flags |= ROMINDEX_FOUR_SCREEN;
+            if (header.nes2_0) entry->flags |= ROMINDEX_NES2_0;
+            if (header.from_romdb) entry->flags |= ROMINDEX_ROMDB;
+        }
+        free(unpacked);
+        unmap_file(&file);
+    }
+    free(path);
+}
+
+static int index_worker(void *data) {
+    index_job_t *job = data;
+    for (;;) {
+        int i = atomic_add(&job->next, 1);
+        if (i >= job->work_count) break;
+        inspect_index_entry(job->dir, &job->entries[job->work[i]]);
+    }
+    return 0;
+}
+
+/* Returns the entries of a previous index, sorted by path, or NULL if there
+ * is no usable index at path. */
+static rom_index_entry_t *read_index(char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    rom_index_entry_t *entries = NULL;
+    uint8_t header[ROMINDEX_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || 0 != memcmp(header, "NESINDEX", 8) ||
+        get_le32(header + 8) != ROMINDEX_VERSION)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    uint32_t count = get_le32(header + 12);
+    for (uint32_t i=0; i<count; ++i) {
+        uint8_t bytes[ROMINDEX_ENTRY_SIZE];
+        if (fread(bytes, 1, sizeof(bytes), fp) != sizeof(bytes)) break;
+        uint16_t path_len = bytes[38] | bytes[39] << 8;
+        rom_index_entry_t entry = {
+            .path = xmalloc(path_len + 1),
+            .mtime = get_le64(bytes),
+            .size = get_le64(bytes + 8),
+            .crc = get_le32(bytes + 16),
+            .prg_rom_size = get_le32(bytes + 20),
+            .chr_rom_size = get_le32(bytes + 24),
+            .prg_ram_size = get_le32(bytes + 28),
+            .mapper = bytes[32] | bytes[33] << 8,
+            .submapper = bytes[34],
+            .flags = bytes[35],
+            .timing = bytes[36],
+            .hints = bytes[37],
+        };
+        if (fread(entry.path, 1, path_len, fp) != path_len) {
+            free(entry.path);
+            break;
+        }
+        entry.path[path_len] = 0;
+        da_push(entries, entry);
+    }
+    fclose(fp);
+
+    if ((uint32_t)da_lenu(entries) != count)
+        fprintf(stderr, "Index %s is truncated, rereading missing roms\n", path);
+    return entries;
+}
+
+static bool write_index(char *path, rom_index_entry_t *entries) {
+    // written beside the old index and renamed over it, so a launcher never
+    // sees a partial index
+    char *tmp_path = xmalloc(strlen(path) + 5);
+    strcpy(tmp_path, path);
+    strcat(tmp_path, ".tmp");
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return false;
+    }
+
+    uint8_t header[ROMINDEX_HEADER_SIZE];
+    memcpy(header, "NESINDEX", 8);
+    put_le32(header + 8, ROMINDEX_VERSION);
+    put_le32(header + 12, (uint32_t)da_lenu(entries));
+    fwrite(header, 1, sizeof(header), fp);
+
+    for (int i=0; i<da_len(entries); ++i) {
+        rom_index_entry_t *e = &entries[i];
+        uint8_t bytes[ROMINDEX_ENTRY_SIZE];
+        size_t path_len = MIN(strlen(e->path), 0xFFFF);
+        put_le64(bytes, e->mtime);
+        put_le64(bytes + 8, e->size);
+        put_le32(bytes + 16, e->crc);
+        put_le32(bytes + 20, e->prg_rom_size);
+        put_le32(bytes + 24, e->chr_rom_size);
+        put_le32(bytes + 28, e->prg_ram_size);
+        bytes[32] = e->mapper & 0xFF;
+        bytes[33] = e->mapper >> 8;
+        bytes[34] = e->submapper;
+        bytes[35] = e->flags;
+        bytes[36] = e->timing;
+        bytes[37] = e->hints;
+        bytes[38] = path_len & 0xFF;
+        bytes[39] = (path_len >> 8) & 0xFF;
+        fwrite(bytes, 1, sizeof(bytes), fp);
+        fwrite(e->path, 1, path_len, fp);
+    }
+
+    bool failed = ferror(fp);
+    if (fclose(fp)) failed = true;
+#ifdef _WIN32
+    if (!failed && !MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) failed = true;
+#else
+    if (!failed && rename(tmp_path, path) < 0) failed = true;
+#endif
+    if (failed) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    return !failed;
+}
+
+static void free_index(rom_index_entry_t *entries) {
+    for (int i=0; i<da_len(entries); ++i)
+        free(entries[i].path);
+    da_free(entries);
+}
+
+/* Indexes every .nes file under dir into index_path, reusing the entries of
+ * the existing index for files that haven't changed. */
+bool index_rom_directory(char *dir, char *index_path) {
+    uint64_t start = get_ticks();
+
+    rom_index_entry_t *entries = NULL;
+    walk_directory(dir, NULL, &entries);
+    int count = da_len(entries);
+    if (count)
+        qsort(entries, count, sizeof(*entries), compare_entry_paths);
+
+    // carry over unchanged entries from the previous index
+    rom_index_entry_t *old = read_index(index_path);
+    uint32_t *work = NULL;
+    for (int i=0; i<count; ++i) {
+        rom_index_entry_t *e = &entries[i];
+        rom_index_entry_t *prev = old
+            ? bsearch(e, old, da_lenu(old), sizeof(*old), compare_entry_paths)
+            : NULL;
+        if (prev && prev->mtime == e->mtime && prev->size == e->size) {
+            char *path = e->path;
+            *e = *prev;
+            e->path = path;
+        } else {
+            da_push(work, (uint32_t)i);
+        }
+    }
+    free_index(old);
+
+    index_job_t job = {
+        .dir = dir,
+        .entries = entries,
+        .work = work,
+        .work_count = da_len(work),
+    };
+    atomic_set(&job.next, 0);
+
+    // the calling thread works too, extra threads are an optimization
+    thread_t *threads[ROMINDEX_MAX_THREADS];
+    int thread_count = MIN(MIN(cpu_count(), ROMINDEX_MAX_THREADS), job.work_count) - 1;
+    int started = 0;
+    for (int i=0; i<thread_count; ++i) {
+        threads[started] = thread_create(index_worker, &job);
+        if (threads[started]) ++started;
+    }
+    index_worker(&job);
+    for (int i=0; i<started; ++i)
+        thread_join(threads[i]);
+
+    int unsupported = 0, invalid = 0;
+    for (int i=0; i<count; ++i) {
+        if (!(entries[i].flags & ROMINDEX_VALID)) ++invalid;
+        else if (!(entries[i].flags & ROMINDEX_SUPPORTED)) ++unsupported;
+    }
+
+    bool ok = write_index(index_path, entries);
+    if (ok)
+        printf("Indexed %d roms (%d read, %d unsupported, %d invalid) to %s in %llu ms\n",
+            count, job.work_count, unsupported, invalid, index_path,
+            (unsigned long long)(get_ticks() - start));
+
+    da_free(work);
+    free_index(entries);
+    return ok;
+}
@@ -0,0 +1,15 @@
+#ifndef __ROMINDEX_H__
+#define __ROMINDEX_H__
+
+// rom index entry flags, see romindex.c for the file format
+#define ROMINDEX_VALID       0x01 // the header parsed and the roms are all there
+#define ROMINDEX_SUPPORTED   0x02 // valid and the mapper is implemented
+#define ROMINDEX_BATTERY     0x04
+#define ROMINDEX_VERTICAL    0x08
+#define ROMINDEX_FOUR_SCREEN 0x10
+#define ROMINDEX_NES2_0      0x20
+#define ROMINDEX_ROMDB       0x40 // corrected from the rom database
+
+bool index_rom_directory(char *dir, char *index_path);
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Event scheduler.
+ *
+ * Devices that know ahead of time when they'll next need attention, like a
+ * mapper irq counter, schedule an event for that ppu timestamp instead of
+ * being polled every cycle. The emulation loop only compares the timestamp
+ * against sched_next, and calls sched_run once it's reached.
+ */
+
+typedef void (*sched_handler_t)(uint64_t now);
+
+static sched_handler_t sched_handlers[SCHED_EVENT_COUNT] = {
+    [SCHED_CART_IRQ] = cart_irq_event,
+};
+
+static THREAD_LOCAL uint64_t sched_times[SCHED_EVENT_COUNT];
+static THREAD_LOCAL uint64_t sched_next = SCHED_NEVER; // earliest of sched_times
+
+static void sched_update_next(void) {
+    sched_next = SCHED_NEVER;
+    for (int i=0; i<SCHED_EVENT_COUNT; ++i)
+        sched_next = MIN(sched_next, sched_times[i]);
+}
+
+/* Schedules event for time, replacing the previous time, SCHED_NEVER cancels */
+void sched_set(sched_event_t event, uint64_t time) {
+    sched_times[event] = time;
+    if (time <= sched_next)
+        sched_next = time;
+    else
+        sched_update_next();
+}
+
+void sched_clear(void) {
+    for (int i=0; i<SCHED_EVENT_COUNT; ++i)
+        sched_times[i] = SCHED_NEVER;
+    sched_next = SCHED_NEVER;
+}
+
+bool sched_due(uint64_t now) {
+    return now >= sched_next;
+}
+
+/* Runs every event that is due. Events are one shot, handlers schedule them
+ * again if needed. */
+void sched_run(uint64_t now) {
+    for (int i=0; i<SCHED_EVENT_COUNT; ++i) {
+        if (sched_times[i] <= now) {
+            sched_times[i] = SCHED_NEVER;
+            sched_handlers[i](now);
+        }
+    }
+    sched_update_next();
+}
@@ -0,0 +1,17 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+/* Events are timed in ppu dots, see ppu_timestamp */
+typedef enum {
+    SCHED_CART_IRQ,
+    SCHED_EVENT_COUNT,
+} sched_event_t;
+
+#define SCHED_NEVER UINT64_MAX
+
+void sched_set(sched_event_t event, uint64_t time);
+void sched_clear(void);
+bool sched_due(uint64_t now);
+void sched_run(uint64_t now);
+
+#endif
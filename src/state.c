@@ -0,0 +1,170 @@
+/*
+ * Save states
+ *
+ * A save state is the whole machine: the cpu, its ram, the controller shift
+ * registers, the ppu, the apu and the cart's ram and mapper, copied into a
+ * buffer the caller provides. Saving or loading is a handful of memcpys, so
+ * it's cheap enough to do every frame.
+ *
+ * Format, header values little endian:
+ *    0-7: "NESSTATE"
+ *    8-11: version, STATE_VERSION
+ *    12-15: crc of the rom, see cart_rom_crc, states only load into the
+ *           rom they were saved from
+ *    16-19: number of sections
+ *    20-: sections, each a 4 character tag, a u32 size and size bytes
+ *
+ * Sections are copies of the emulator's own structs, in the host's byte
+ * order and layout, so states move between runs of the same build but not
+ * between builds or machines. STATE_VERSION is bumped whenever a saved
+ * struct changes. Host side fields like the screen pixels and palette are
+ * kept out of the saved part of the structs.
+ */
+
+#define STATE_VERSION 2
+#define STATE_HEADER_SIZE 20
+#define STATE_SECTION_HEADER_SIZE 8
+
+typedef enum {
+    SECTION_CPU,
+    SECTION_RAM,
+    SECTION_CONTROLLERS,
+    SECTION_PPU,
+    SECTION_APU,
+    SECTION_CART,   // after the ppu, see cart_load_state
+    SECTION_COUNT,
+} state_section_t;
+
+static const char section_tags[SECTION_COUNT][4] = {
+    [SECTION_CPU]         = "CPU ",
+    [SECTION_RAM]         = "RAM ",
+    [SECTION_CONTROLLERS] = "CTRL",
+    [SECTION_PPU]         = "PPU ",
+    [SECTION_APU]         = "APU ",
+    [SECTION_CART]        = "CART",
+};
+
+static uint32_t section_size(state_section_t section) {
+    switch (section) {
+    case SECTION_CPU:         return sizeof(cpu_t);
+    case SECTION_RAM:         return sizeof(cpu_ram);
+    case SECTION_CONTROLLERS: return sizeof(controller_registers);
+    case SECTION_PPU:         return ppu_state_size();
+    case SECTION_APU:         return apu_state_size();
+    case SECTION_CART:        return cart_state_size();
+    default:                  return 0;
+    }
+}
+
+static void save_section(state_section_t section, cpu_t *cpu, uint8_t *out) {
+    switch (section) {
+    case SECTION_CPU:         memcpy(out, cpu, sizeof(cpu_t)); break;
+    case SECTION_RAM:         memcpy(out, cpu_ram, sizeof(cpu_ram)); break;
+    case SECTION_CONTROLLERS: memcpy(out, controller_registers, sizeof(controller_registers)); break;
+    case SECTION_PPU:         ppu_save_state(out); break;
+    case SECTION_APU:         apu_save_state(out); break;
+    case SECTION_CART:        cart_save_state(out); break;
+    default: break;
+    }
+}
+
+static void load_section(state_section_t section, cpu_t *cpu, uint8_t *in) {
+    switch (section) {
+    case SECTION_CPU:         memcpy(cpu, in, sizeof(cpu_t)); break;
+    case SECTION_RAM:         memcpy(cpu_ram, in, sizeof(cpu_ram)); break;
+    case SECTION_CONTROLLERS: memcpy(controller_registers, in, sizeof(controller_registers)); break;
+    case SECTION_PPU:         ppu_load_state(in); break;
+    case SECTION_APU:         apu_load_state(in); break;
+    case SECTION_CART:        cart_load_state(in); break;
+    default: break;
+    }
+}
+
+/* The size of a save state of the cart that's loaded */
+size_t nes_state_size(void) {
+    size_t size = STATE_HEADER_SIZE;
+    for (int i=0; i<SECTION_COUNT; ++i)
+        size += STATE_SECTION_HEADER_SIZE + section_size(i);
+    return size;
+}
+
+/* Writes the state of the machine into buffer. Returns the number of bytes
+ * written, or 0 if it needs more than size, see nes_state_size. */
+size_t nes_save_state(cpu_t *cpu, uint8_t *buffer, size_t size) {
+    size_t needed = nes_state_size();
+    if (size < needed)
+        return 0;
+
+    memcpy(buffer, "NESSTATE", 8);
+    put_le32(buffer + 8, STATE_VERSION);
+    put_le32(buffer + 12, cart_rom_crc());
+    put_le32(buffer + 16, SECTION_COUNT);
+    uint8_t *p = buffer + STATE_HEADER_SIZE;
+    for (int i=0; i<SECTION_COUNT; ++i) {
+        uint32_t n = section_size(i);
+        memcpy(p, section_tags[i], 4);
+        put_le32(p + 4, n);
+        save_section(i, cpu, p + STATE_SECTION_HEADER_SIZE);
+        p += STATE_SECTION_HEADER_SIZE + n;
+    }
+    return needed;
+}
+
+/* Loads a state written by nes_save_state. The whole state is checked
+ * before anything is loaded, so on failure the machine is left as it was.
+ * Sections with unknown tags are skipped. */
+bool nes_load_state(cpu_t *cpu, uint8_t *buffer, size_t size) {
+    char *error = NULL;
+    uint8_t *sections[SECTION_COUNT] = {0};
+
+    if (size < STATE_HEADER_SIZE || 0 != memcmp(buffer, "NESSTATE", 8)) {
+        error = "not a save state";
+    } else if (get_le32(buffer + 8) != STATE_VERSION) {
+        error = "saved by a different version";
+    } else if (get_le32(buffer + 12) != cart_rom_crc()) {
+        error = "saved from a different rom";
+    } else {
+        uint32_t count = get_le32(buffer + 16);
+        size_t offset = STATE_HEADER_SIZE;
+        for (uint32_t s=0; s<count && !error; ++s) {
+            if (size - offset < STATE_SECTION_HEADER_SIZE) {
+                error = "truncated";
+                break;
+            }
+            uint8_t *p = buffer + offset;
+            uint32_t n = get_le32(p + 4);
+            if (size - offset - STATE_SECTION_HEADER_SIZE < n) {
+                error = "truncated";
+                break;
+            }
+            for (int i=0; i<SECTION_COUNT; ++i) {
+                if (0 != memcmp(p, section_tags[i], 4))
+                    continue;
+                if (n != section_size(i))
+                    error = "section size doesn't match this build";
+                sections[i] = p + STATE_SECTION_HEADER_SIZE;
+            }
+            offset += STATE_SECTION_HEADER_SIZE + n;
+        }
+        for (int i=0; i<SECTION_COUNT && !error; ++i)
+            if (!sections[i])
+                error = "missing a section";
+    }
+    if (error) {
+        fprintf(stderr, "Failed to load state: %s\n", error);
+        return false;
+    }
+
+    for (int i=0; i<SECTION_COUNT; ++i)
+        load_section(i, cpu, sections[i]);
+    return true;
+}
+
+/* The machine's ram in a state saved by this build, where it can be read or
+ * changed without loading the state */
+uint8_t *nes_state_ram(uint8_t *buffer) {
+    size_t offset = STATE_HEADER_SIZE;
+    for (int i=0; i<SECTION_RAM; ++i)
+        offset += STATE_SECTION_HEADER_SIZE + section_size(i);
+    return buffer + offset + STATE_SECTION_HEADER_SIZE;
+}
@@ -0,0 +1,11 @@
+#ifndef __STATE_H__
+#define __STATE_H__
+
+struct cpu_t;
+
+size_t nes_state_size(void);
+size_t nes_save_state(struct cpu_t *cpu, uint8_t *buffer, size_t size);
+bool nes_load_state(struct cpu_t *cpu, uint8_t *buffer, size_t size);
+uint8_t *nes_state_ram(uint8_t *buffer);
+
+#endif
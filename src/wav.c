@@ -0,0 +1,95 @@
+/*
+ * Streaming RIFF/WAVE writer used for offline audio rendering.
+ *
+ * The header is written up front with zeroed sizes, samples are appended as
+ * they are produced, and the RIFF and data chunk sizes are patched in
+ * wav_close. Output is always mono.
+ *
+ * more info: http://soundfile.sapp.org/doc/WaveFormat/
+ */
+
+#define WAV_HEADER_SIZE 44
+#define WAV_FILE_BUFFER_SIZE 65536
+#define WAV_CHUNK_SAMPLES 1024
+
+static void wav_write_header(wav_writer_t *wav) {
+    uint8_t header[WAV_HEADER_SIZE];
+    uint16_t bytes_per_sample = wav->format == WAV_FORMAT_F32 ? 4 : 2;
+
+    memcpy(header, "RIFF", 4);
+    put_le32(header+4, 36 + wav->data_bytes);
+    memcpy(header+8, "WAVE", 4);
+
+    memcpy(header+12, "fmt ", 4);
+    put_le32(header+16, 16);                                   /* fmt chunk size */
+    put_le16(header+20, wav->format == WAV_FORMAT_F32 ? 3 : 1); /* 3 = IEEE float, 1 = PCM */
+    put_le16(header+22, 1);                                    /* channels */
+    put_le32(header+24, wav->sample_rate);
+    put_le32(header+28, wav->sample_rate * bytes_per_sample);  /* byte rate */
+    put_le16(header+32, bytes_per_sample);                     /* block align */
+    put_le16(header+34, bytes_per_sample * 8);                 /* bits per sample */
+
+    memcpy(header+36, "data", 4);
+    put_le32(header+40, wav->data_bytes);
+
+    fwrite(header, 1, WAV_HEADER_SIZE, wav->fp);
+}
+
+bool wav_open(wav_writer_t *wav, char *filepath, int sample_rate, wav_format_t format) {
+    memset(wav, 0, sizeof(*wav));
+    wav->fp = fopen(filepath, "wb");
+    if (!wav->fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    setvbuf(wav->fp, NULL, _IOFBF, WAV_FILE_BUFFER_SIZE);
+
+    wav->format = format;
+    wav->sample_rate = sample_rate;
+    wav_write_header(wav);
+    return true;
+}
+
+void wav_write(wav_writer_t *wav, float *samples, int count) {
+    if (!wav->fp) return;
+
+    if (wav->format == WAV_FORMAT_F32) {
+        uint8_t chunk[WAV_CHUNK_SAMPLES*4];
+        while (count > 0) {
+            int n = MIN(count, WAV_CHUNK_SAMPLES);
+            for (int i=0; i<n; ++i) {
+                uint32_t bits;
+                memcpy(&bits, &samples[i], 4);
+                put_le32(chunk + 4*i, bits);
+            }
+            fwrite(chunk, 4, n, wav->fp);
+            wav->data_bytes += 4*n;
+            samples += n; count -= n;
+        }
+    } else {
+        uint8_t chunk[WAV_CHUNK_SAMPLES*2];
+        while (count > 0) {
+            int n = MIN(count, WAV_CHUNK_SAMPLES);
+            for (int i=0; i<n; ++i) {
+                float s = samples[i];
+                if (s > 1.0f) s = 1.0f;
+                else if (s < -1.0f) s = -1.0f;
+                put_le16(chunk + 2*i, (uint16_t)(int16_t)(s * 32767.0f));
+            }
+            fwrite(chunk, 2, n, wav->fp);
+            wav->data_bytes += 2*n;
+            samples += n; count -= n;
+        }
+    }
+}
+
+void wav_close(wav_writer_t *wav) {
+    if (!wav->fp) return;
+    /* patch chunk sizes now that the length is known */
+    if (fseek(wav->fp, 0, SEEK_SET) == 0)
+        wav_write_header(wav);
+    else
+        perror("fseek");
+    fclose(wav->fp);
+    wav->fp = NULL;
+}
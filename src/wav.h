@@ -0,0 +1,20 @@
+#ifndef __WAV_H__
+#define __WAV_H__
+
+typedef enum {
+    WAV_FORMAT_F32,
+    WAV_FORMAT_S16,
+} wav_format_t;
+
+typedef struct {
+    FILE *fp;
+    wav_format_t format;
+    int sample_rate;
+    uint32_t data_bytes;
+} wav_writer_t;
+
+bool wav_open(wav_writer_t *wav, char *filepath, int sample_rate, wav_format_t format);
+void wav_write(wav_writer_t *wav, float *samples, int count);
+void wav_close(wav_writer_t *wav);
+
+#endif